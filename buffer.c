@@ -28,6 +28,7 @@ extern EditBufferDataType raw_data_type;
 extern char g_backup_dir[];
 
 EditBufferDataType *first_buffer_data_type = NULL;
+static EditBufferSaveHook *first_save_hook = NULL;
 
 /************************************************************/
 /* basic access to the edit buffer */
@@ -45,7 +46,13 @@ static Page *find_page(EditBuffer *b, int *offset_ptr)
         *offset_ptr -= b->cur_offset;
         return b->cur_page;
     } else {
-        p = b->page_table;
+        if (b->cur_page && offset >= b->cur_offset) {
+            /* sequential accesses: continue from the cached page */
+            p = b->cur_page;
+            offset -= b->cur_offset;
+        } else {
+            p = b->page_table;
+        }
         while (offset >= p->size) {
             offset -= p->size;
             p++;
@@ -118,6 +125,25 @@ int eb_read(EditBuffer *b, int offset, u8 *buf, int size)
     return eb_rw(b, offset, buf, size, 0);
 }
 
+/* Return the data of the page containing 'offset' and store the
+   buffer offset of its first byte in '*start_ptr' and its size in
+   '*size_ptr'. Return NULL if 'offset' is outside the buffer. The
+   data is only valid until the next buffer modification. */
+const u8 *eb_get_page(EditBuffer *b, int offset, int *start_ptr,
+                      int *size_ptr)
+{
+    Page *p;
+    int page_offset;
+
+    if (offset < 0 || offset >= b->total_size)
+        return NULL;
+    page_offset = offset;
+    p = find_page(b, &page_offset);
+    *start_ptr = offset - page_offset;
+    *size_ptr = p->size;
+    return p->data;
+}
+
 /* Note: eb_write can be used to insert after the end of the buffer */
 void eb_write(EditBuffer *b, int offset, u8 *buf, int size)
 {
@@ -350,8 +376,9 @@ void eb_delete(EditBuffer *b, int offset, int size)
     if (offset >= b->total_size)
         return;
 
-    b->total_size -= size;
+    /* the callbacks can still read the deleted bytes */
     eb_addlog(b, LOGOP_DELETE, offset, size);
+    b->total_size -= size;
 
     /* find the correct page */
     p = find_page(b, &offset);
@@ -397,6 +424,19 @@ void eb_delete(EditBuffer *b, int offset, int size)
     b->cur_page = NULL;
 }
 
+/* Replace the 'size' bytes at 'offset' of 'b' by the contents of
+   'src'. The replacement is a single undo step. */
+void eb_replace_buffer(EditBuffer *b, int offset, int size,
+                       EditBuffer *src)
+{
+    if (size > 0 && offset < b->total_size) {
+        eb_delete(b, offset, size);
+        b->log_linked = 1;
+    }
+    eb_insert_buffer(b, offset, src, 0, src->total_size);
+    b->log_linked = 0;
+}
+
 /* flush the log */
 void log_reset(EditBuffer *b)
 {
@@ -468,6 +508,8 @@ void eb_free(EditBuffer *b)
     if (b->close)
         b->close(b);
 
+    search_index_free(b);
+
     /* free each callback */
     for(l = b->first_callback; l != NULL;) {
         l1 = l->next;
@@ -633,6 +675,7 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
     lb.offset = offset;
     lb.size = size;
     lb.was_modified = was_modified;
+    lb.linked = b->log_linked;
     eb_write(b->log_buffer, b->log_new_index,
              (unsigned char *) &lb, sizeof(LogBuffer));
     b->log_new_index += sizeof(LogBuffer);
@@ -660,7 +703,7 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
 void do_undo(EditState *s)
 {
     EditBuffer *b = s->b;
-    int log_index, saved, size_trailer;
+    int log_index, saved, size_trailer, linked;
     LogBuffer lb;
 
     if (!b->log_buffer)
@@ -680,50 +723,64 @@ void do_undo(EditState *s)
     } else {
         put_status(s, "Undo!");
     }
-    /* go backward */
-    log_index -= sizeof(int);
-    eb_read(b->log_buffer, log_index, (unsigned char *)&size_trailer, sizeof(int));
-    log_index -= size_trailer + sizeof(LogBuffer);
 
-    /* log_current is 1 + index to have zero as default value */
-    b->log_current = log_index + 1;
+    linked = 0;
+    for(;;) {
+        /* go backward */
+        log_index -= sizeof(int);
+        eb_read(b->log_buffer, log_index, (unsigned char *)&size_trailer, sizeof(int));
+        log_index -= size_trailer + sizeof(LogBuffer);
+
+        /* log_current is 1 + index to have zero as default value */
+        b->log_current = log_index + 1;
+
+        /* play the log entry */
+        eb_read(b->log_buffer, log_index, (unsigned char *)&lb, sizeof(LogBuffer));
+        log_index += sizeof(LogBuffer);
+
+        /* the operations undoing a linked group are linked too */
+        b->log_linked = linked;
+
+        switch(lb.op) {
+        case LOGOP_WRITE:
+            /* we must disable the log because we want to record a single
+               write (we should have the single operation: eb_write_buffer) */
+            saved = b->save_log;
+            b->save_log = 0;
+            eb_delete(b, lb.offset, lb.size);
+            eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+            b->save_log = saved;
+            eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
+            s->offset = lb.offset + lb.size;
+            break;
+        case LOGOP_DELETE:
+            /* we must also disable the log there because the log buffer
+               would be modified BEFORE we insert it by the implicit
+               eb_addlog */
+            saved = b->save_log;
+            b->save_log = 0;
+            eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+            b->save_log = saved;
+            eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
+            s->offset = lb.offset + lb.size;
+            break;
+        case LOGOP_INSERT:
+            eb_delete(b, lb.offset, lb.size);
+            s->offset = lb.offset;
+            break;
+        default:
+            abort();
+        }
+        b->log_linked = 0;
 
-    /* play the log entry */
-    eb_read(b->log_buffer, log_index, (unsigned char *)&lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
+        b->modified = lb.was_modified;
 
-    switch(lb.op) {
-    case LOGOP_WRITE:
-        /* we must disable the log because we want to record a single
-           write (we should have the single operation: eb_write_buffer) */
-        saved = b->save_log;
-        b->save_log = 0;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log = saved;
-        eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_DELETE:
-        /* we must also disable the log there because the log buffer
-           would be modified BEFORE we insert it by the implicit
-           eb_addlog */
-        saved = b->save_log;
-        b->save_log = 0;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log = saved;
-        eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_INSERT:
-        eb_delete(b, lb.offset, lb.size);
-        s->offset = lb.offset;
-        break;
-    default:
-        abort();
+        /* the log may have been shifted if it was full */
+        log_index = b->log_current - 1;
+        if (!lb.linked || log_index <= 0)
+            break;
+        linked = 1;
     }
-
-    b->modified = lb.was_modified;
 }
 
 /************************************************************/
@@ -1421,6 +1478,17 @@ void eb_register_data_type(EditBufferDataType *bdt)
     *lp = bdt;
 }
 
+void eb_register_save_hook(EditBufferSaveHook *hook)
+{
+    EditBufferSaveHook **lp;
+
+    lp = &first_save_hook;
+    while (*lp != NULL)
+        lp = &(*lp)->next;
+    hook->next = NULL;
+    *lp = hook;
+}
+
 /*
  * save buffer according to its data type
  */
@@ -1430,6 +1498,7 @@ int save_buffer(EditBuffer *b)
     char buf1[PATH_MAX];
     const char *filename;
     struct stat st;
+    EditBufferSaveHook *hook;
 
     if (!b->data_type->buffer_save)
         return -1;
@@ -1458,6 +1527,9 @@ int save_buffer(EditBuffer *b)
     /* reset log */
     log_reset(b);
     b->modified = 0;
+
+    for (hook = first_save_hook; hook != NULL; hook = hook->next)
+        hook->saved(b);
     return 0;
 }
 
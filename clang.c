@@ -18,232 +18,50 @@
  */
 #include "qe.h"
 
-static const char c_keywords[] = 
-"|auto|break|case|const|continue|do|else|enum|extern|for|goto|"
-"if|register|return|static|struct|switch|typedef|union|volatile|while|"
-"class|private|public|protected|try|except|template|typename|throw|"
-"using|namespace|catch|explicit|virtual|noexcept|operator|new|delete|";
-
-/* NOTE: 'var' is added for javascript */
-static const char c_types[] = 
-"|char|double|float|int|long|unsigned|short|signed|void|var|"
-"u8|uint8_t|u16|uint16_t|u32|uint32_t|u64|uint64_t|bool|"
-"vector|ordered_map|unordered_map|string|nullptr|";
-
-static int get_c_keyword(char *buf, int buf_size, unsigned int **pp)
+#include "clang-kw.h"
+
+static const SyntaxDef c_syntax = {
+    line_comment: "//",
+    comment_start: "/*",
+    comment_end: "*/",
+    string_delims: "\"'",
+    escape_char: '\\',
+    preprocessor_char: '#',
+    keywords: &c_keywords,
+    types: &c_types,
+    flags: SYNTAX_DECLARATIONS | SYNTAX_DISABLED,
+};
+
+/* return TRUE if the 'len' chars at 'p' are a C keyword or type */
+int c_is_keyword(const unsigned int *p, int len)
 {
-    unsigned int *p, c;
-    char *q;
-
-    p = *pp;
-    c = *p;
-    q = buf;
-    if ((c >= 'a' && c <= 'z') ||
-        (c >= 'A' && c <= 'Z') || 
-        (c == '_')) {
-        do {
-            if ((q - buf) < buf_size - 1)
-                *q++ = c;
-            p++;
-            c = *p;
-        } while ((c >= 'a' && c <= 'z') ||
-                 (c >= 'A' && c <= 'Z') ||
-                 (c == '_') ||
-                 (c >= '0' && c <= '9'));
-    }
-    *q = '\0';
-    *pp = p;
-    return q - buf;
+    return keyword_find(&c_keywords, p, len) ||
+        keyword_find(&c_types, p, len);
 }
 
-/* colorization states */
-enum {
-    C_COMMENT = 1,
-    C_STRING,
-    C_STRING_Q,
-    C_PREPROCESS,
-    C_IF0,
-};
+/* set the styles of the tokens of a line. Also used by the symbol
+   indexer, so the margin is not highlighted here. */
+void c_tokenize_line(unsigned int *buf, int len, int *colorize_state_ptr)
+{
+    syntax_tokenize_line(&c_syntax, buf, len, colorize_state_ptr, 0);
+}
 
 void c_colorize_line(unsigned int *buf, int len, 
                      int *colorize_state_ptr, int state_only)
 {
-    int c, state, l, type_decl;
-    unsigned int *p, *p_start, *p1;
-    char kbuf[32];
-
-    state = *colorize_state_ptr;
-    p = buf;
-    p_start = p;
-    type_decl = 0;
-
-    /* if already in a state, go directly in the code parsing it */
-    switch(state) {
-    case C_COMMENT:
-        goto parse_comment;
-    case C_STRING:
-    case C_STRING_Q:
-        goto parse_string;
-    case C_PREPROCESS:
-        goto parse_preprocessor;
-    case C_IF0:
-        goto parse_disabled_block;
-    default:
-        break;
-    }
+    syntax_colorize_line(&c_syntax, buf, len, colorize_state_ptr,
+                         state_only);
+}
 
-    for(;;) {
-        p_start = p;
-        c = *p;
-        switch(c) {
-        case '\n':
-            goto the_end;
-        case '/':
-            p++;
-            if (*p == '*') {
-                /* normal comment */
-                p++;
-                state = C_COMMENT;
-            parse_comment:
-                while (*p != '\n') {
-                    if (p[0] == '*' && p[1] == '/') {
-                        p += 2;
-                        state = 0;
-                        break;
-                    } else {
-                        p++;
-                    }
-                }
-                set_color(p_start, p - p_start, QE_STYLE_COMMENT);
-            } else if (*p == '/') {
-                /* line comment */
-                while (*p != '\n') 
-                    p++;
-                set_color(p_start, p - p_start, QE_STYLE_COMMENT);
-            }
-            break;
-        case '#':
-            if (p[1] == 'i' && p[2] == 'f' && p[3] == ' ' && p[4] == '0') {
-                state = C_IF0;
-                set_color(p_start, len, QE_STYLE_COMMENT);
-                goto the_end;
-            } else {
-                goto parse_preprocessor;
-            }
-        parse_disabled_block:
-            if (p[1] == 'e' && p[2] == 'n' && p[3] == 'd' && p[4] == 'i' && p[5] == 'f') {
-                state = 0;
-                set_color(p_start, len, QE_STYLE_COMMENT);
-                goto the_end;
-            } else if (p[1] == 'e' && p[2] == 'l') {
-                if ((p[3] == 'i' && p[4] == 'f') ||
-                    (p[3] == 's' && p[4] == 'e')) {
-                        state = 0;
-                        set_color(p_start, len, QE_STYLE_COMMENT);
-                        goto the_end;
-                    }
-            } else {
-                set_color(p_start, len, QE_STYLE_COMMENT);
-                state = C_IF0;
-                goto the_end;
-            }
-            /* preprocessor */
-        parse_preprocessor:
-            p = buf + len;
-            set_color(p_start, p - p_start, QE_STYLE_PREPROCESS);
-            if (p > buf && (p[-1] & CHAR_MASK) == '\\') 
-                state = C_PREPROCESS;
-            else
-                state = 0;
-            goto the_end;
-        case '\'':
-            state = C_STRING_Q;
-            goto string;
-        case '\"':
-            /* strings/chars */
-            state = C_STRING;
-        string:
-            p++;
-        parse_string:
-            while (*p != '\n') {
-                if (*p == '\\') {
-                    p++;
-                    if (*p == '\n')
-                        break;
-                    p++;
-                } else if ((*p == '\'' && state == C_STRING_Q) ||
-                           (*p == '\"' && state == C_STRING)) {
-                    p++;
-                    state = 0;
-                    break;
-                } else {
-                    p++;
-                }
-            }
-            set_color(p_start, p - p_start, QE_STYLE_STRING);
-            break;
-        case '=':
-            p++;
-            /* exit type declaration */
-            type_decl = 0;
-            break;
-        default:
-            if ((c >= 'a' && c <= 'z') ||
-                (c >= 'A' && c <= 'Z') || 
-                (c == '_')) {
-                
-                l = get_c_keyword(kbuf + 1, sizeof(kbuf) - 2, &p);
-                kbuf[0] = '|';
-                kbuf[l + 1] = '|';
-                kbuf[l + 2] = '\0';
-                p1 = p;
-                if (strstr(c_keywords, kbuf)) {
-                    set_color(p_start, p1 - p_start, QE_STYLE_KEYWORD);
-                } else if (strstr(c_types, kbuf)) {
-                    /* c type */
-                    while (*p == ' ' || *p == '\t')
-                        p++;
-                    /* if not cast, assume type declaration */
-                    if (*p != ')') {
-                        type_decl = 1;
-                    }
-                    set_color(p_start, p1 - p_start, QE_STYLE_TYPE);
-                } else {
-                    /* assume typedef if starting at first column */
-                    if (p_start == buf)
-                        type_decl = 1;
-
-                    if (type_decl) {
-                        while (*p == ' ' || *p == '\t')
-                            p++;
-                        if (*p == '(') {
-                            /* function definition case */
-                            set_color(p_start, p1 - p_start, QE_STYLE_FUNCTION);
-                            type_decl = 1;
-                        } else if (p_start == buf) {
-                            /* assume type if first column */
-                            set_color(p_start, p1 - p_start, QE_STYLE_TYPE);
-                        } else {
-                            set_color(p_start, p1 - p_start, QE_STYLE_VARIABLE);
-                        }
-                    }
-                }
-            } else {
-                p++;
-            }
-            break;
-        }
-    }
+/* a declaration or a closing brace at the first column is assumed to
+   be outside of comments, strings and disabled blocks */
+static int c_resync_line(unsigned int *buf, int len)
+{
+    unsigned int c = buf[0];
 
- the_end:
-    /* highlight the lines that overstep the margins */
-    if (g_highlight_over_margin && len > g_margin_size) {
-	    /* clear previous from margin to the end of line */
-	    clear_color(buf+g_margin_size, len - g_margin_size);
-	    set_color(buf+g_margin_size, len - g_margin_size,
-		      QE_STYLE_MARGIN_HIGHLIGHT);
-    }
-    *colorize_state_ptr = state;
+    return (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z') ||
+        (c == '_') || (c == '}');
 }
 
 #define MAX_BUF_SIZE    512
@@ -574,6 +392,7 @@ int c_mode_init(EditState *s, ModeSavedData *saved_data)
     if (ret)
         return ret;
     set_colorize_func(s, c_colorize_line);
+    set_colorize_resync_func(s, c_resync_line);
     return ret;
 }
 
@@ -21,14 +21,17 @@
 #include <string.h>
 #include <libgen.h>
 #include <unistd.h>
+#include <sys/wait.h>
 
 #define PRETTY_WRITE 1
 
+/* a result: the strings are offsets in the results arena, where the
+   file and function names are stored once */
 typedef struct CscopeOutput {
-    char file[1024];
+    int file;
+    int sym;
+    int context;
     int line;
-    char sym[256];
-    char context[1024];
 } CscopeOutput;
 
 typedef struct CscopeMark {
@@ -49,16 +52,89 @@ typedef struct CscopeState {
     char *symdir;
     CscopeOutput *out;
     int entries;
+    int out_size;
+    int rendered;       /* results already written to the buffer */
+    char *arena;        /* strings of the results */
+    int arena_len, arena_size;
+    int *names;         /* hash table of the names in the arena + 1 */
+    int names_size, nb_names;
+    EditBuffer *b;      /* *cscope* buffer of the last query */
     CscopeMarkStack cstack;
 } CscopeState;
 
+/* cscope line mode process used when cscope.out cannot be read
+   natively. It is kept alive between the queries and restarted when
+   the database changes. */
+typedef struct CscopeProc {
+    char db[1024];      /* path of the cscope.out it reads */
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    int pid;
+    int to_fd, from_fd;
+    char *buf;          /* output not yet processed */
+    int len, size;
+    int query;          /* true if a query is running */
+    int nb_lines;       /* announced result lines, -1 before */
+    int nb_read;        /* result lines received */
+    /* query being answered, the key of its results in the cache */
+    int op;
+    char *sym;
+    char symdir[1024];
+} CscopeProc;
+
+/* results of a previous query, valid as long as cscope.out keeps the
+   same inode and mtime */
+typedef struct CscopeCacheEntry {
+    int op;
+    char *sym;          /* NULL if the entry is free */
+    char *symdir;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    CscopeOutput *out;
+    int entries;
+    char *arena;
+    int arena_len;
+    int last_use;
+} CscopeCacheEntry;
+
+/* background rebuild of the database after saves */
+typedef struct CscopeRebuild {
+    char symdir[1024];
+    QETimer *timer;     /* delay after the last save */
+    int pid;            /* -1 if no rebuild is running */
+    int nb_changed;     /* files saved since the last rebuild */
+    int pending;        /* files saved during the rebuild */
+} CscopeRebuild;
+
+#define CSCOPE_REBUILD_DELAY 2000 /* ms without saves before rebuilding */
+#define CSCOPE_REBUILD_DB    "cscope.out.new"
+
+#define CSCOPE_CACHE_SIZE   32
+#define CSCOPE_CACHE_MAX    (16 * 1024 * 1024) /* larger results are not kept */
+
 int split_horizontal = 1;
 
 ModeDef cscope_mode;
 
 CscopeState cs;
 
-#define OUTBUF_WIN_SZ	1024
+static CscopeProc csp = {
+    pid: -1,
+    to_fd: -1,
+    from_fd: -1,
+};
+
+#define CSCOPE_READ_SIZE  (64 * 1024)
+
+static CscopeRebuild csr = {
+    pid: -1,
+};
+
+static CscopeCacheEntry cscope_cache[CSCOPE_CACHE_SIZE];
+static int cscope_cache_clock;
+static int cscope_cache_hits, cscope_cache_misses;
 
 void do_load_at_line(EditState *s, const char *filename, int line);
 
@@ -91,19 +167,27 @@ static void cscope_free_previous_allocs(void)
     if (cs.out) {
         free(cs.out);
         cs.out = NULL;
+        cs.out_size = 0;
+        cs.entries = 0;
     }
+    free(cs.arena);
+    cs.arena = NULL;
+    cs.arena_len = cs.arena_size = 0;
+    free(cs.names);
+    cs.names = NULL;
+    cs.names_size = cs.nb_names = 0;
     if (cs.sym) {
         free(cs.sym);
         cs.sym = NULL;
     }
 }
 
-static char cscope_symbol_file_exists(char *dir)
+static char cscope_db_file_exists(const char *dir, const char *name)
 {
     char cscope_file[2048];
     struct stat st;
 
-    snprintf(cscope_file, sizeof(cscope_file), "%s/cscope.out", dir);
+    snprintf(cscope_file, sizeof(cscope_file), "%s/%s", dir, name);
 
     if (stat(cscope_file, &st) < 0) {
         goto out;
@@ -119,6 +203,13 @@ out:
     return 0;
 }
 
+/* a cscope database or, without one, the index of symindex.c */
+static char cscope_symbol_file_exists(char *dir)
+{
+    return cscope_db_file_exists(dir, "cscope.out") ||
+        cscope_db_file_exists(dir, SYMINDEX_FILE);
+}
+
 char *cscope_get_home_dir(void)
 {
     char *homedir = NULL;
@@ -155,176 +246,114 @@ static void cscope_select_file(EditState *s)
         return;
 
     put_status(s, "Save %d offset in %s", s->offset, cs.os->b->name);
-    if (cscope_push_mark(cs.os->b, cs.os->offset)) {
-        put_status(s, "Cscope stack full!");
-    }
-
-    snprintf(fpath, sizeof(fpath), "%s/%s", cs.symdir, cs.out[index].file);
-    do_load_at_line(cs.os, fpath, cs.out[index].line);
+    snprintf(fpath, sizeof(fpath), "%s/%s", cs.symdir,
+             cs.arena + cs.out[index].file);
+    cscope_goto_line(cs.os, fpath, cs.out[index].line);
 }
 
-int cscope_query(char *symdir, int opc, char *sym, char **response, int *len)
+/* load 'filename' at 'line' in 's' after pushing the current position
+   of 's' on the mark stack, so that cscope-pop-mark comes back to
+   it. Also used by the project grep. */
+void cscope_goto_line(EditState *s, const char *filename, int line)
 {
-    char cs_command[2048];
-    FILE *co;
-    int rc;
-    int tlen, nr_reads = 1;
-    char *outbuf = NULL, *ob;
-
-    snprintf(cs_command, sizeof(cs_command),
-             "cscope -p8 -d -f %s/cscope.out -L%d %s", symdir, opc, sym);
-
-    outbuf = malloc(OUTBUF_WIN_SZ);
-    if (outbuf == NULL)
-        return -1;
-
-    memset(outbuf, 0, OUTBUF_WIN_SZ);
-
-    co = popen(cs_command, "r");
-    if (co == NULL) {
-        free(outbuf);
-        return -1;
+    if (cscope_push_mark(s->b, s->offset)) {
+        put_status(s, "Cscope stack full!");
     }
+    cs.os = s;
+    do_load_at_line(s, filename, line);
+}
 
-    tlen = 0;
-    for(;;) {
-        rc = fread(outbuf+tlen, 1, OUTBUF_WIN_SZ, co);
-        if (rc == 0 || rc < OUTBUF_WIN_SZ) {
-            if (ferror(co)) {
-                free(outbuf);
-                pclose(co);
-                return -1;
-            }
-
-            if (feof(co)) {
-                tlen += rc;
-                goto out;
-            }
-        }
+/* append 'len' bytes of 'str' and a null to the arena. Return the
+   offset of the copy or -1. */
+static int cscope_arena_add(const char *str, int len)
+{
+    char *arena;
+    int size, pos;
 
-        tlen += rc;
-        nr_reads++;
-        ob = realloc(outbuf, (nr_reads * OUTBUF_WIN_SZ));
-        if (ob == NULL) {
-            free(outbuf);
-            pclose(co);
+    if (cs.arena_len + len + 1 > cs.arena_size) {
+        size = max(cs.arena_size * 2, cs.arena_len + len + 1 + 65536);
+        arena = realloc(cs.arena, size);
+        if (arena == NULL)
             return -1;
-        }
-        memset(ob + ((nr_reads-1) * OUTBUF_WIN_SZ), 0, OUTBUF_WIN_SZ);
-        outbuf = ob;
+        cs.arena = arena;
+        cs.arena_size = size;
     }
-
-out:
-    *response = outbuf;
-    *len = tlen;
-    pclose(co);
-
-    if (tlen == 0)
-        return -1;
-
-    return 0;
+    pos = cs.arena_len;
+    memcpy(cs.arena + pos, str, len);
+    cs.arena[pos + len] = '\0';
+    cs.arena_len += len + 1;
+    return pos;
 }
 
-void cscope_parse_line(char *line, CscopeOutput *out)
+static unsigned int cscope_hash(const char *str, int len)
 {
-    int state = 0;
-    int i = 0;
-    char lstr[8];
-
-    for (;;) {
-        switch(state) {
-        case 0: /* file name with relative path */
-            while (*line != ' ') {
-                if (i >= sizeof(out->file)-1) {
-                    line++;
-                    continue;
-                }
-                out->file[i] = *line;
-                line++;
-                i++;
-            }
-            out->file[i] = '\0';
-            state++;
-            line++;
-            break;
+    unsigned int h = 2166136261u;
 
-        case 1: /* symbol scope */
-            i = 0;
-            while (*line != ' ') {
-                if (i >= sizeof(out->sym)-1) {
-                    line++;
-                    continue;
-                }
-                out->sym[i] = *line;
-                line++;
-                i++;
-            }
-            out->sym[i] = '\0';
-            state++;
-            line++;
-            break;
-
-        case 2: /* line number */
-            i = 0;
-            memset(lstr, 0, sizeof(lstr));
-            while (*line != ' ') {
-                if (i >= 7) {
-                    line++;
-                    continue;
-                }
-                lstr[i] = *line;
-                i++;
-                line++;
-            }
-            lstr[7] = '\0';
-            out->line = atoi(lstr);
-            state++;
-            line++;
-            break;
+    while (len-- > 0)
+        h = (h ^ (u8)*str++) * 16777619u;
+    return h;
+}
 
-        case 3: /* context or preview of the line */
-            i = 0;
-            while (*line != '\n' ||
-                   *line != '\0' ||
-                   *line != 0) {
-                       if (i >= sizeof(out->context)-1) {
-                           out->context[i-1] = '\0';
-                           goto out;
-                       }
-                       out->context[i] = *line;
-                       line++;
-                       i++;
-            }
-            out->context[i] = '\0';
-            state++;
-            goto out;
-            break;
+/* return the offset of the name in the arena, added only once */
+static int cscope_arena_intern(const char *str, int len)
+{
+    int *names, i, pos, size, mask;
+    unsigned int h;
 
-        default:
-            break;
+    if (cs.nb_names * 2 >= cs.names_size) {
+        size = max(cs.names_size * 2, 1024);
+        names = calloc(size, sizeof(int));
+        if (names == NULL)
+            return -1;
+        for (i = 0; i < cs.names_size; i++) {
+            if (!cs.names[i])
+                continue;
+            pos = cs.names[i] - 1;
+            h = cscope_hash(cs.arena + pos, strlen(cs.arena + pos));
+            while (names[h & (size - 1)])
+                h++;
+            names[h & (size - 1)] = pos + 1;
         }
+        free(cs.names);
+        cs.names = names;
+        cs.names_size = size;
     }
-
- out:
-    return;
+    mask = cs.names_size - 1;
+    for (h = cscope_hash(str, len); cs.names[h & mask]; h++) {
+        pos = cs.names[h & mask] - 1;
+        if (!memcmp(cs.arena + pos, str, len) && cs.arena[pos + len] == '\0')
+            return pos;
+    }
+    pos = cscope_arena_add(str, len);
+    if (pos < 0)
+        return -1;
+    cs.names[h & mask] = pos + 1;
+    cs.nb_names++;
+    return pos;
 }
 
-CscopeOutput *cscope_parse_output(char *output, int nr_entries)
+/* parse a "file function line text" result line. Return -1 if it is
+   not one. */
+static int cscope_parse_line(const char *line, CscopeOutput *out)
 {
-    int i = 0;
-    char *tok;
-    CscopeOutput *out = malloc(nr_entries * sizeof(CscopeOutput));
-    if (out == NULL)
-        return NULL;
+    const char *file, *sym, *p;
 
-    tok = strtok(output, "\n");
-    while (tok != NULL) {
-        cscope_parse_line(tok, &out[i]);
-        i++;
-        tok = strtok(NULL, "\n");
-    }
-
-    return out;
+    file = line;
+    sym = strchr(file, ' ');
+    if (sym == NULL)
+        return -1;
+    p = strchr(++sym, ' ');
+    if (p == NULL || !isdigit((u8)p[1]))
+        return -1;
+    out->file = cscope_arena_intern(file, sym - 1 - file);
+    out->sym = cscope_arena_intern(sym, p - sym);
+    out->line = strtol(p + 1, (char **)&p, 10);
+    if (*p == ' ')
+        p++;
+    out->context = cscope_arena_add(p, strlen(p));
+    if (out->file < 0 || out->sym < 0 || out->context < 0)
+        return -1;
+    return 0;
 }
 
 /* colorization states */
@@ -382,76 +411,665 @@ out:
     return;
 }
 
-/* show a list of buffers */
-void cscope_query_and_show(EditState *s)
+/* find the window showing the *cscope* buffer */
+static EditState *cscope_find_window(void)
 {
-    QEmacsState *qs = s->qe_state;
-    EditBuffer *b;
     EditState *e;
-    int x, y, rlen, ln, cn;
-    char *cs_resp;
-    char fpath[2048];
 
-    if (cscope_query(cs.symdir, cs.op, cs.sym, &cs_resp, &rlen) < 0) {
-        put_status(s, "cscope query failed");
-        return;
+    for (e = qe_state.first_window; e != NULL; e = e->next_window) {
+        if (e->b == cs.b && cs.b)
+            return e;
     }
+    return NULL;
+}
+
+/* clear the *cscope* buffer and the previous results */
+static int cscope_results_begin(void)
+{
+    EditBuffer *b;
 
     if ((b = eb_find("*cscope*")) == NULL) {
         b = eb_new("*cscope*", BF_READONLY | BF_SYSTEM);
         if (b == NULL)
-            return;
+            return -1;
     } else
         /* if found a previous buffer, clear it up */
         eb_delete(b, 0, b->total_size);
 
-    /* write the current cscope output */
-    eb_write(b, 0, (unsigned char *)cs_resp, rlen);
-    eb_get_pos(b, &ln, &cn, b->total_size);
-    cs.entries = ln;
-    cs.out = cscope_parse_output(cs_resp, ln);
-    (void)cn;
+    cs.b = b;
+    cs.entries = 0;
+    cs.rendered = 0;
+    return 0;
+}
 
-#if PRETTY_WRITE
-    y = 0; /* offset in buffer */
-    eb_delete(b, 0, b->total_size);
-    for (cn = 0; cn < ln; cn++) {
-        x = snprintf(fpath, sizeof(fpath),
-                     "%-32s [%d] %-24s %s\n",
-                     cs.out[cn].file, cs.out[cn].line,
-                     cs.out[cn].sym, cs.out[cn].context);
-        eb_write(b, y, (unsigned char *)fpath, x);
-        y += x;
-        memset(fpath, 0, sizeof(fpath));
+/* parse a "file function line text" result and append it */
+static void cscope_results_add(const char *line)
+{
+    CscopeOutput *out;
+    int size;
+
+    if (cs.entries >= cs.out_size) {
+        size = max(cs.out_size * 2, 64);
+        out = realloc(cs.out, size * sizeof(CscopeOutput));
+        if (out == NULL)
+            return;
+        cs.out = out;
+        cs.out_size = size;
+    }
+    if (cscope_parse_line(line, &cs.out[cs.entries]) == 0)
+        cs.entries++;
+}
+
+/* write the new results at the end of the *cscope* buffer */
+static void cscope_results_flush(void)
+{
+    CscopeOutput *out;
+    char *buf;
+    int i, len, size;
+
+    if (cs.rendered >= cs.entries)
+        return;
+
+    /* every result is written in one insertion */
+    size = 1;
+    for (i = cs.rendered; i < cs.entries; i++) {
+        out = &cs.out[i];
+        size += strlen(cs.arena + out->file) + strlen(cs.arena + out->sym) +
+            strlen(cs.arena + out->context) + 80;
     }
+    buf = malloc(size);
+    if (buf == NULL)
+        return;
+    len = 0;
+    for (i = cs.rendered; i < cs.entries && len < size; i++) {
+        out = &cs.out[i];
+#if PRETTY_WRITE
+        len += snprintf(buf + len, size - len, "%-32s [%d] %-24s %s\n",
+                        cs.arena + out->file, out->line,
+                        cs.arena + out->sym, cs.arena + out->context);
+#else
+        len += snprintf(buf + len, size - len, "%s %s %d %s\n",
+                        cs.arena + out->file, cs.arena + out->sym,
+                        out->line, cs.arena + out->context);
 #endif
+    }
+    len = min(len, size - 1);
+    eb_write(cs.b, cs.b->total_size, (unsigned char *)buf, len);
+    free(buf);
+    cs.rendered = cs.entries;
+}
 
-    if (ln > 1) {
-        if (!split_horizontal) {
-            x = (s->x2 + s->x1) / 2;
-            e = edit_new(b, x, s->y1, s->x2 - x,
-                         s->y2 - s->y1, WF_MODELINE);
+static void cscope_cache_free(CscopeCacheEntry *c)
+{
+    free(c->sym);
+    free(c->symdir);
+    free(c->out);
+    free(c->arena);
+    memset(c, 0, sizeof(*c));
+}
 
-            s->x2 = x;
-            s->flags |= WF_RSEPARATOR;
-        } else {
-            y = (s->y2 + s->y1) / 2;
-            e = edit_new(b, s->x1, y,
-                         s->x2 - s->x1, s->y2 - y,
-                         WF_MODELINE | (s->flags & WF_RSEPARATOR));
-            s->y2 = y;
-        }
+static int cscope_cache_stat(const char *symdir, struct stat *st)
+{
+    char db[2048];
+
+    snprintf(db, sizeof(db), "%s/cscope.out", symdir);
+    if (stat(db, st) == 0)
+        return 0;
+    snprintf(db, sizeof(db), "%s/%s", symdir, SYMINDEX_FILE);
+    return stat(db, st);
+}
+
+/* return the cached results of the current query, dropping them if
+   the database changed since */
+static CscopeCacheEntry *cscope_cache_find(void)
+{
+    CscopeCacheEntry *c;
+    struct stat st;
+    int i;
+
+    for (i = 0; i < CSCOPE_CACHE_SIZE; i++) {
+        c = &cscope_cache[i];
+        if (c->sym && c->op == cs.op && !strcmp(c->sym, cs.sym) &&
+            !strcmp(c->symdir, cs.symdir))
+            break;
+    }
+    if (i == CSCOPE_CACHE_SIZE)
+        return NULL;
+    if (cscope_cache_stat(cs.symdir, &st) < 0 || c->dev != st.st_dev ||
+        c->ino != st.st_ino || c->mtime != st.st_mtime) {
+        cscope_cache_free(c);
+        return NULL;
+    }
+    c->last_use = ++cscope_cache_clock;
+    return c;
+}
 
-        do_set_mode(e, &cscope_mode, NULL);
+/* keep a copy of the current results as the answer of the query 'op'
+   of 'sym' in 'symdir', in place of the least recently used entry */
+static void cscope_cache_store(int op, const char *sym, const char *symdir,
+                               const struct stat *st)
+{
+    CscopeCacheEntry *c, *c1;
+    int i;
 
-        qs->active_window = e;
-        do_refresh(e);
+    if (cs.arena_len > CSCOPE_CACHE_MAX)
+        return;
+    c = &cscope_cache[0];
+    for (i = 1; i < CSCOPE_CACHE_SIZE && c->sym; i++) {
+        c1 = &cscope_cache[i];
+        if (!c1->sym || c1->last_use < c->last_use)
+            c = c1;
+    }
+    cscope_cache_free(c);
+    c->sym = strdup(sym);
+    c->symdir = strdup(symdir);
+    c->out = malloc(max(cs.entries, 1) * sizeof(CscopeOutput));
+    c->arena = malloc(max(cs.arena_len, 1));
+    if (!c->sym || !c->symdir || !c->out || !c->arena) {
+        cscope_cache_free(c);
+        return;
+    }
+    c->op = op;
+    c->dev = st->st_dev;
+    c->ino = st->st_ino;
+    c->mtime = st->st_mtime;
+    c->entries = cs.entries;
+    memcpy(c->out, cs.out, cs.entries * sizeof(CscopeOutput));
+    c->arena_len = cs.arena_len;
+    memcpy(c->arena, cs.arena, cs.arena_len);
+    c->last_use = ++cscope_cache_clock;
+}
+
+/* make the cached results the current ones */
+static int cscope_cache_load(CscopeCacheEntry *c)
+{
+    CscopeOutput *out;
+    char *arena;
+
+    out = malloc(max(c->entries, 1) * sizeof(CscopeOutput));
+    arena = malloc(max(c->arena_len, 1));
+    if (!out || !arena) {
+        free(out);
+        free(arena);
+        return -1;
+    }
+    memcpy(out, c->out, c->entries * sizeof(CscopeOutput));
+    memcpy(arena, c->arena, c->arena_len);
+    free(cs.out);
+    free(cs.arena);
+    /* the names are not looked up any more */
+    free(cs.names);
+    cs.names = NULL;
+    cs.names_size = cs.nb_names = 0;
+    cs.out = out;
+    cs.out_size = max(c->entries, 1);
+    cs.entries = c->entries;
+    cs.arena = arena;
+    cs.arena_size = max(c->arena_len, 1);
+    cs.arena_len = c->arena_len;
+    return 0;
+}
+
+/* split the window of the query to show the *cscope* buffer */
+static void cscope_results_show(void)
+{
+    EditState *s = cs.os, *e;
+    int x, y;
+
+    if (cscope_find_window())
+        return;
+
+    if (!split_horizontal) {
+        x = (s->x2 + s->x1) / 2;
+        e = edit_new(cs.b, x, s->y1, s->x2 - x,
+                     s->y2 - s->y1, WF_MODELINE);
+
+        s->x2 = x;
+        s->flags |= WF_RSEPARATOR;
     } else {
-        put_status(s, "Save %d offset in %s", s->offset, cs.os->b->name);
+        y = (s->y2 + s->y1) / 2;
+        e = edit_new(cs.b, s->x1, y,
+                     s->x2 - s->x1, s->y2 - y,
+                     WF_MODELINE | (s->flags & WF_RSEPARATOR));
+        s->y2 = y;
+    }
+
+    do_set_mode(e, &cscope_mode, NULL);
+
+    s->qe_state->active_window = e;
+    do_refresh(e);
+}
+
+/* jump to a single result, else show them all */
+static void cscope_results_end(void)
+{
+    EditState *s = cs.os;
+    char fpath[2048];
+
+    cscope_results_flush();
+    if (cs.entries == 0) {
+        put_status(s, "cscope query failed");
+    } else if (cs.entries == 1 && !cscope_find_window()) {
+        put_status(s, "Save %d offset in %s (cache: %d hits, %d misses)",
+                   s->offset, cs.os->b->name,
+                   cscope_cache_hits, cscope_cache_misses);
         cscope_push_mark(s->b, s->offset);
-        snprintf(fpath, sizeof(fpath), "%s/%s", cs.symdir, cs.out[0].file);
+        snprintf(fpath, sizeof(fpath), "%s/%s", cs.symdir,
+                 cs.arena + cs.out[0].file);
         do_load_at_line(s, fpath, cs.out[0].line);
+    } else {
+        cscope_results_show();
+        put_status(s, "cscope: %d matches (cache: %d hits, %d misses)",
+                   cs.entries, cscope_cache_hits, cscope_cache_misses);
+    }
+}
+
+static void cscope_proc_stop(void)
+{
+    int status;
+
+    if (csp.from_fd >= 0) {
+        set_read_handler(csp.from_fd, NULL, NULL);
+        close(csp.from_fd);
+        csp.from_fd = -1;
+    }
+    if (csp.to_fd >= 0) {
+        close(csp.to_fd);
+        csp.to_fd = -1;
+    }
+    if (csp.pid != -1) {
+        set_pid_handler(csp.pid, NULL, NULL);
+        kill(csp.pid, SIGKILL);
+        while (waitpid(csp.pid, &status, 0) != csp.pid && errno == EINTR)
+            continue;
+        csp.pid = -1;
+    }
+    csp.len = 0;
+    csp.query = 0;
+}
+
+/* the query ended: give the keys back and show the results */
+static void cscope_proc_end(void)
+{
+    qe_ungrab_keys();
+    cscope_results_end();
+    edit_display(&qe_state);
+    dpy_flush(qe_state.screen);
+}
+
+/* abort the running query. The process is restarted by the next
+   query since the only way to stop its search is to kill it. */
+static void cscope_proc_cancel(void)
+{
+    if (!csp.query)
+        return;
+    cscope_proc_stop();
+    qe_ungrab_keys();
+    put_status(NULL, "cscope: query aborted after %d results", cs.entries);
+}
+
+/* handle a complete line of the process output */
+static void cscope_proc_line(char *line)
+{
+    struct stat st;
+    const char *p;
+
+    /* the prompt is not followed by a newline */
+    while (strstart(line, ">> ", &p))
+        line = (char *)p;
+    if (!csp.query || *line == '\0')
+        return;
+
+    if (csp.nb_lines < 0) {
+        /* ignore the messages before the result header */
+        if (strstart(line, "cscope: ", &p)) {
+            csp.nb_lines = strtol(p, NULL, 10);
+            /* show the results while they arrive, unless there is
+               only one to jump to */
+            if (csp.nb_lines > 1) {
+                qe_ungrab_keys();
+                cscope_results_show();
+            }
+        }
+    } else {
+        cscope_results_add(line);
+        csp.nb_read++;
+    }
+    if (csp.nb_lines >= 0 && csp.nb_read >= csp.nb_lines) {
+        csp.query = 0;
+        st.st_dev = csp.dev;
+        st.st_ino = csp.ino;
+        st.st_mtime = csp.mtime;
+        /* the current query may have changed since it was sent */
+        if (csp.sym)
+            cscope_cache_store(csp.op, csp.sym, csp.symdir, &st);
+        cscope_proc_end();
+    }
+}
+
+static void cscope_proc_read_cb(void *opaque)
+{
+    char *line, *q;
+    int len, size, query;
+
+    if (csp.len + CSCOPE_READ_SIZE + 1 > csp.size) {
+        size = csp.len + CSCOPE_READ_SIZE + 1;
+        line = realloc(csp.buf, size);
+        if (line == NULL)
+            return;
+        csp.buf = line;
+        csp.size = size;
+    }
+    len = read(csp.from_fd, csp.buf + csp.len, CSCOPE_READ_SIZE);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (len <= 0) {
+        /* the process died: the next query starts another one */
+        query = csp.query;
+        cscope_proc_stop();
+        if (query)
+            cscope_proc_end();
+        return;
+    }
+    csp.len += len;
+    csp.buf[csp.len] = '\0';
+
+    line = csp.buf;
+    while ((q = strchr(line, '\n')) != NULL) {
+        *q = '\0';
+        cscope_proc_line(line);
+        line = q + 1;
+    }
+    csp.len -= line - csp.buf;
+    memmove(csp.buf, line, csp.len);
+
+    if (csp.query && cscope_find_window()) {
+        cscope_results_flush();
+        edit_display(&qe_state);
+        dpy_flush(qe_state.screen);
+    }
+}
+
+static void cscope_proc_pid_cb(void *opaque, int status)
+{
+    /* the output still in the pipe is read by cscope_proc_read_cb */
+    set_pid_handler(csp.pid, NULL, NULL);
+    csp.pid = -1;
+}
+
+static int cscope_proc_start(const char *db, struct stat *st)
+{
+    int to_pipe[2], from_pipe[2], pid, fd;
+
+    if (pipe(to_pipe) < 0)
+        return -1;
+    if (pipe(from_pipe) < 0) {
+        close(to_pipe[0]);
+        close(to_pipe[1]);
+        return -1;
+    }
+    pid = fork();
+    if (pid < 0) {
+        close(to_pipe[0]);
+        close(to_pipe[1]);
+        close(from_pipe[0]);
+        close(from_pipe[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        /* child process */
+        dup2(to_pipe[0], 0);
+        dup2(from_pipe[1], 1);
+        fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0)
+            dup2(fd, 2);
+        for (fd = 3; fd < getdtablesize(); fd++)
+            close(fd);
+        execlp("cscope", "cscope", "-d", "-l", "-f", db, (char *)NULL);
+        exit(1);
+    }
+    close(to_pipe[0]);
+    close(from_pipe[1]);
+    csp.pid = pid;
+    csp.to_fd = to_pipe[1];
+    csp.from_fd = from_pipe[0];
+    fcntl(csp.from_fd, F_SETFL, O_NONBLOCK);
+    pstrcpy(csp.db, sizeof(csp.db), db);
+    csp.dev = st->st_dev;
+    csp.ino = st->st_ino;
+    csp.mtime = st->st_mtime;
+    csp.len = 0;
+    set_read_handler(csp.from_fd, cscope_proc_read_cb, NULL);
+    set_pid_handler(csp.pid, cscope_proc_pid_cb, NULL);
+    return 0;
+}
+
+/* Rebuild of cscope.out after files under the symbol directory were
+   saved. The saves are debounced, then "cscope -b" updates a hard
+   link of the database: cscope only rescans the changed files and
+   replaces the link with the new database, which is then renamed over
+   cscope.out. The queries see either the old or the new database. */
+static void cscope_rebuild_start(void);
+
+static void cscope_rebuild_done(void *opaque, int status)
+{
+    char db[2048], tmp[2048];
+
+    set_pid_handler(csr.pid, NULL, NULL);
+    csr.pid = -1;
+    snprintf(db, sizeof(db), "%s/cscope.out", csr.symdir);
+    snprintf(tmp, sizeof(tmp), "%s/%s", csr.symdir, CSCOPE_REBUILD_DB);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+        rename(tmp, db) == 0) {
+        put_status(NULL, "cscope: database updated");
+    } else {
+        unlink(tmp);
+        put_status(NULL, "cscope: database rebuild failed");
+    }
+    if (csr.pending) {
+        /* files were saved during the rebuild */
+        csr.pending = 0;
+        cscope_rebuild_start();
+    }
+    edit_display(&qe_state);
+    dpy_flush(qe_state.screen);
+}
+
+static void cscope_rebuild_start(void)
+{
+    char db[2048], tmp[2048], files[2048], header[256];
+    const char *argv[8];
+    int argc, fd, pid, len;
+    struct stat st;
+
+    snprintf(db, sizeof(db), "%s/cscope.out", csr.symdir);
+    snprintf(tmp, sizeof(tmp), "%s/%s", csr.symdir, CSCOPE_REBUILD_DB);
+    snprintf(files, sizeof(files), "%s/cscope.files", csr.symdir);
+
+    /* keep the format and the file list of the current database */
+    argc = 0;
+    argv[argc++] = "cscope";
+    argv[argc++] = "-b";
+    fd = open(db, O_RDONLY);
+    if (fd < 0)
+        return;
+    len = read(fd, header, sizeof(header) - 1);
+    close(fd);
+    header[max(len, 0)] = '\0';
+    if (strchr(header, '\n'))
+        *strchr(header, '\n') = '\0';
+    if (strstr(header, " -c"))
+        argv[argc++] = "-c";
+    if (stat(files, &st) < 0)
+        argv[argc++] = "-R";
+    argv[argc++] = "-f";
+    argv[argc++] = CSCOPE_REBUILD_DB;
+    argv[argc] = NULL;
+
+    /* the link shares the mtime of the database, so cscope only
+       rescans the files modified since */
+    unlink(tmp);
+    if (link(db, tmp) < 0)
+        return;
+
+    pid = fork();
+    if (pid < 0) {
+        unlink(tmp);
+        return;
+    }
+    if (pid == 0) {
+        /* child process */
+        if (chdir(csr.symdir) < 0)
+            exit(1);
+        fd = open("/dev/null", O_RDWR);
+        if (fd >= 0) {
+            dup2(fd, 0);
+            dup2(fd, 1);
+            dup2(fd, 2);
+        }
+        for (fd = 3; fd < getdtablesize(); fd++)
+            close(fd);
+        execvp("cscope", (char *const *)argv);
+        exit(1);
+    }
+    csr.pid = pid;
+    set_pid_handler(pid, cscope_rebuild_done, NULL);
+    put_status(NULL, "cscope: rebuilding database (%d files changed)",
+               csr.nb_changed);
+    csr.nb_changed = 0;
+}
+
+static void cscope_rebuild_timer_cb(void *opaque)
+{
+    csr.timer = NULL;
+    if (!cscope_db_file_exists(csr.symdir, "cscope.out")) {
+        /* the native index updates only the changed files */
+        symindex_update(csr.symdir);
+        csr.nb_changed = 0;
+    } else if (csr.pid != -1)
+        csr.pending = 1;
+    else
+        cscope_rebuild_start();
+}
+
+static void cscope_buffer_saved(EditBuffer *b)
+{
+    int len;
+
+    if (cs.symdir == NULL || !cscope_symbol_file_exists(cs.symdir))
+        return;
+    len = strlen(cs.symdir);
+    if (strncmp(b->filename, cs.symdir, len) || b->filename[len] != '/')
+        return;
+
+    /* a rebuild of another directory goes on with its own */
+    if (csr.pid == -1)
+        pstrcpy(csr.symdir, sizeof(csr.symdir), cs.symdir);
+    else if (strcmp(csr.symdir, cs.symdir))
+        return;
+
+    csr.nb_changed++;
+    if (csr.timer)
+        qe_kill_timer(csr.timer);
+    csr.timer = qe_add_timer(CSCOPE_REBUILD_DELAY, NULL,
+                             cscope_rebuild_timer_cb);
+}
+
+static EditBufferSaveHook cscope_save_hook = {
+    saved: cscope_buffer_saved,
+};
+
+static void cscope_wait_key(void *opaque, int key)
+{
+    if (key == KEY_CTRL('g')) {
+        cscope_proc_cancel();
+    } else {
+        put_status(NULL, "cscope: searching %s... (C-g to abort)", cs.sym);
     }
+    edit_display(&qe_state);
+    dpy_flush(qe_state.screen);
+}
+
+/* send the query to the cscope process of 'symdir' */
+static int cscope_proc_query(const char *symdir, int op, const char *sym)
+{
+    char db[1024], cmd[1024];
+    struct stat st;
+    int len;
+
+    snprintf(db, sizeof(db), "%s/cscope.out", symdir);
+    if (stat(db, &st) < 0)
+        return -1;
+
+    /* a running query cannot be interrupted: restart the process */
+    if (csp.pid != -1 &&
+        (csp.query || strcmp(csp.db, db) || csp.dev != st.st_dev ||
+         csp.ino != st.st_ino || csp.mtime != st.st_mtime))
+        cscope_proc_stop();
+    if (csp.pid == -1 && cscope_proc_start(db, &st) < 0)
+        return -1;
+
+    len = snprintf(cmd, sizeof(cmd), "%d%s\n", op, sym);
+    if (write(csp.to_fd, cmd, len) != len) {
+        cscope_proc_stop();
+        return -1;
+    }
+    csp.query = 1;
+    csp.nb_lines = -1;
+    csp.nb_read = 0;
+    csp.op = op;
+    free(csp.sym);
+    csp.sym = strdup(sym);
+    pstrcpy(csp.symdir, sizeof(csp.symdir), symdir);
+    qe_grab_keys(cscope_wait_key, NULL);
+    put_status(NULL, "cscope: searching %s...", sym);
+    return 0;
+}
+
+/* query the native index of cscope.out, the index of symindex.c or,
+   if neither can answer, the cscope process whose results are then
+   shown as they arrive */
+void cscope_query_and_show(EditState *s)
+{
+    CscopeCacheEntry *c;
+    struct stat st;
+    char *resp, *line, *q;
+    int len;
+
+    /* the results of a previous query are no longer wanted */
+    cscope_proc_cancel();
+    if (cscope_results_begin() < 0)
+        return;
+
+    c = cscope_cache_find();
+    if (c && cscope_cache_load(c) == 0) {
+        cscope_cache_hits++;
+        cscope_results_end();
+        return;
+    }
+    cscope_cache_misses++;
+
+    if (cscope_cache_stat(cs.symdir, &st) == 0 &&
+        (cscope_db_query(cs.symdir, cs.op, cs.sym, &resp, &len) == 0 ||
+         symindex_query(cs.symdir, cs.op, cs.sym, &resp, &len) == 0)) {
+        for (line = resp; (q = strchr(line, '\n')) != NULL; line = q + 1) {
+            *q = '\0';
+            cscope_results_add(line);
+        }
+        free(resp);
+        cscope_cache_store(cs.op, cs.sym, cs.symdir, &st);
+        cscope_results_end();
+        return;
+    }
+
+    if (cscope_proc_query(cs.symdir, cs.op, cs.sym) < 0)
+        put_status(s, "cscope query failed");
+}
+
+static void cscope_quit(EditState *s)
+{
+    cscope_proc_cancel();
+    do_delete_window(s, 0);
 }
 
 static void cscope_query_symbol(void *opaque, char *reply)
@@ -478,6 +1096,8 @@ static void do_cscope_operation(EditState *s, int op)
     char current_dir[1024], *c;
     char *cdir = getcwd(current_dir, sizeof(current_dir));
 
+    /* a running query must not fill the results freed here */
+    cscope_proc_cancel();
     cscope_free_previous_allocs();
 
     if (cs.symdir == NULL) {
@@ -540,7 +1160,7 @@ static void do_cscope_operation(EditState *s, int op)
                     cscope_query_symbol, (void *)s);
 }
 
-static void do_cscope_pop_mark(EditState *s)
+void do_cscope_pop_mark(EditState *s)
 {
     CscopeMark csm;
     if (cscope_pop_mark(&csm)) {
@@ -619,6 +1239,24 @@ out:
     free(or);
 }
 
+/* index the sources below the symbol directory, or the current
+   directory if there is none, for the queries without cscope */
+static void do_cscope_build_index(EditState *s)
+{
+    char current_dir[1024];
+    char *cdir = getcwd(current_dir, sizeof(current_dir));
+
+    if (cs.symdir == NULL) {
+        if (cdir == NULL) {
+            put_status(s, "Cannot get the current directory");
+            return;
+        }
+        cs.symdir = strdup(cdir);
+    }
+    if (symindex_update(cs.symdir) < 0)
+        put_status(s, "Could not index %s", cs.symdir);
+}
+
 static void do_cscope_set_symbol_directory(EditState *s)
 {
     char current_dir[1024];
@@ -633,12 +1271,13 @@ static void do_cscope_set_symbol_directory(EditState *s)
 /* specific bufed commands */
 static CmdDef cscope_mode_commands[] = {
     CMD0( KEY_RET, ' ', "cscope-select", cscope_select_file)
-    CMD1( KEY_CTRL('g'), KEY_NONE, "delete-window", do_delete_window, 0)
+    CMD0( KEY_CTRL('g'), KEY_NONE, "cscope-quit", cscope_quit)
     CMD_DEF_END,
 };
 
 static CmdDef cscope_global_commands[] = {
     CMD0( KEY_CTRLXRET('s'), KEY_NONE, "cscope-set-symbol-directory", do_cscope_set_symbol_directory)
+    CMD0( KEY_CTRLXRET('r'), KEY_NONE, "cscope-build-index", do_cscope_build_index)
     CMD1( KEY_F2, KEY_NONE, "cscope-find-symbol", do_cscope_operation, 0)
     CMD1( KEY_F3, KEY_NONE, "cscope-find-global-definition",
          do_cscope_operation, 1)
@@ -691,6 +1330,8 @@ static int cscope_init(void)
 {
     cs.cstack.index = -1;
 
+    eb_register_save_hook(&cscope_save_hook);
+
     /* inherit from list mode */
     memcpy(&cscope_mode, &list_mode, sizeof(ModeDef));
     cscope_mode.name = "cscope";
@@ -0,0 +1,729 @@
+/*
+ * Native cscope database reader for QEmacs.
+ * Copyright (c) 2020 Himanshu Chauhan
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "qe.h"
+#include <sys/mman.h>
+
+/* cscope.out is mapped and scanned once to build a hash table of
+   its symbols: each symbol has the list of its references, in
+   database order, with the offset of the source line record and the
+   enclosing function. The queries are then answered from the table
+   and the mapped records, in the same "file function line text"
+   format as "cscope -L".
+
+   Database layout: after the header line, each file starts with a
+   "\t@file" line. Each source line is a record "lineno text" whose
+   symbols are on their own lines, alternating with the text between
+   them, and which ends with an empty line. A symbol line may start
+   with a tab and a mark giving the kind of the symbol. Unless the
+   header has "-c", the text is compressed: bytes >= 0x80 are
+   digraphs and bytes < ' ' are C keywords. */
+
+/* symbol marks */
+#define CSDB_FILE       '@'
+#define CSDB_FUNC_DEF   '$'
+#define CSDB_FUNC_CALL  '`'
+#define CSDB_FUNC_END   '}'
+#define CSDB_DEFINE     '#'
+#define CSDB_DEFINE_END ')'
+#define CSDB_INCLUDE    '~'
+#define CSDB_ASSIGN     '='
+#define CSDB_IDENT      ' '
+
+#define CSDB_FUNC_MAX   0xffffff /* limit of the function field */
+
+static const char csdb_dichar1[] = " teisaprnl(of)=c";
+static const char csdb_dichar2[] = " tnerpla";
+
+static const struct {
+    const char *text;
+    char delim;   /* ' ' or '(' if followed by a blank or " (" */
+} csdb_keywords[32] = {
+    { "", 0 },
+    { "#define", ' ' },
+    { "#include", ' ' },
+    { "break", 0 },
+    { "case", ' ' },
+    { "char", ' ' },
+    { "continue", 0 },
+    { "default", 0 },
+    { "double", ' ' },
+    { "\t", 0 },
+    { "\n", 0 },
+    { "else", ' ' },
+    { "enum", ' ' },
+    { "extern", ' ' },
+    { "float", ' ' },
+    { "for", '(' },
+    { "goto", ' ' },
+    { "if", '(' },
+    { "int", ' ' },
+    { "long", ' ' },
+    { "register", ' ' },
+    { "return", 0 },
+    { "short", ' ' },
+    { "sizeof", 0 },
+    { "static", ' ' },
+    { "struct", ' ' },
+    { "switch", '(' },
+    { "typedef", ' ' },
+    { "union", ' ' },
+    { "unsigned", ' ' },
+    { "void", ' ' },
+    { "while", '(' },
+};
+
+typedef struct CsDbRef {
+    unsigned int rec;      /* offset of the source line record */
+    unsigned int next;     /* next reference of the symbol + 1 */
+    unsigned int func : 24; /* enclosing function or macro + 1 */
+    unsigned int mark : 8;
+} CsDbRef;
+
+typedef struct CsDbSym {
+    unsigned int name;     /* offset in the string pool */
+    unsigned int hash;
+    unsigned int first, last; /* references + 1 */
+} CsDbSym;
+
+typedef struct CsDbFile {
+    unsigned int name;     /* offset in the string pool */
+    unsigned int offset;   /* offset of the first record */
+} CsDbFile;
+
+typedef struct CsDb {
+    char path[1024];
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+    const u8 *data;
+    int data_size;
+    int compressed;
+    char *pool;
+    int pool_len, pool_size;
+    CsDbSym *syms;
+    int nb_syms, syms_size;
+    unsigned int *hash_table;  /* symbol + 1, 0 if free */
+    int hash_size;
+    CsDbRef *refs;
+    int nb_refs, refs_size;
+    CsDbFile *files;
+    int nb_files, files_size;
+} CsDb;
+
+static CsDb *csdb;
+
+/* scanner events */
+enum {
+    CSDB_EV_END,
+    CSDB_EV_FILE,   /* name in str */
+    CSDB_EV_LINE,   /* new record: lineno, text in str */
+    CSDB_EV_SYM,    /* symbol of kind mark in str */
+    CSDB_EV_TEXT,   /* text between the symbols */
+    CSDB_EV_EOR,    /* end of record */
+};
+
+typedef struct CsDbScan {
+    const u8 *p, *end;
+    int in_record;
+    int expect_text;
+    /* current event */
+    int offset;
+    int mark;
+    int lineno;
+    const u8 *str;
+    int len;
+} CsDbScan;
+
+static void csdb_scan_init(CsDb *db, CsDbScan *sc, int offset)
+{
+    memset(sc, 0, sizeof(*sc));
+    sc->p = db->data + offset;
+    sc->end = db->data + db->data_size;
+}
+
+static int csdb_scan_next(CsDb *db, CsDbScan *sc)
+{
+    const u8 *l, *q;
+    int n;
+
+    for (;;) {
+        l = sc->p;
+        q = memchr(l, '\n', sc->end - l);
+        if (!q)
+            return CSDB_EV_END;
+        n = q - l;
+        sc->p = q + 1;
+        sc->offset = l - db->data;
+
+        if (n >= 2 && l[0] == '\t') {
+            sc->mark = l[1];
+            sc->str = l + 2;
+            sc->len = n - 2;
+            if (sc->mark == CSDB_FILE) {
+                sc->in_record = sc->expect_text = 0;
+                return n == 2 ? CSDB_EV_END : CSDB_EV_FILE;
+            }
+            sc->expect_text = 1;
+            return CSDB_EV_SYM;
+        }
+        if (sc->expect_text) {
+            sc->expect_text = 0;
+            sc->str = l;
+            sc->len = n;
+            return CSDB_EV_TEXT;
+        }
+        if (n == 0) {
+            if (sc->in_record) {
+                sc->in_record = 0;
+                return CSDB_EV_EOR;
+            }
+            continue;
+        }
+        if (!sc->in_record && isdigit(l[0])) {
+            sc->in_record = 1;
+            sc->lineno = 0;
+            while (n > 0 && isdigit(*l)) {
+                sc->lineno = sc->lineno * 10 + *l++ - '0';
+                n--;
+            }
+            if (n > 0 && *l == ' ') {
+                l++;
+                n--;
+            }
+            sc->str = l;
+            sc->len = n;
+            return CSDB_EV_LINE;
+        }
+        if (sc->in_record) {
+            sc->mark = CSDB_IDENT;
+            sc->str = l;
+            sc->len = n;
+            sc->expect_text = 1;
+            return CSDB_EV_SYM;
+        }
+        /* header or unknown line */
+    }
+}
+
+/* expand the compressed text 'str' at the end of 'buf'. Return the
+   new length. */
+static int csdb_decode(CsDb *db, char *buf, int pos, int size,
+                       const u8 *str, int len)
+{
+    const char *kw;
+    int c, i;
+
+    for (i = 0; i < len && pos < size - 3; i++) {
+        c = str[i];
+        if (!db->compressed) {
+            buf[pos++] = c;
+        } else if (c >= 0x80) {
+            c &= 0x7f;
+            buf[pos++] = csdb_dichar1[c / 8];
+            buf[pos++] = csdb_dichar2[c & 7];
+        } else if (c < ' ') {
+            for (kw = csdb_keywords[c].text; *kw && pos < size - 3; kw++)
+                buf[pos++] = *kw;
+            if (csdb_keywords[c].delim != '\0')
+                buf[pos++] = ' ';
+            if (csdb_keywords[c].delim == '(')
+                buf[pos++] = '(';
+        } else {
+            buf[pos++] = c;
+        }
+    }
+    buf[pos] = '\0';
+    return pos;
+}
+
+static unsigned int csdb_hash(const char *str)
+{
+    unsigned int h = 2166136261u;
+
+    while (*str)
+        h = (h ^ (u8)*str++) * 16777619u;
+    return h;
+}
+
+static int csdb_grow(void *pptr, int *size_ptr, int elem_size, int count)
+{
+    void *ptr;
+    int size;
+
+    if (count <= *size_ptr)
+        return 0;
+    size = max(*size_ptr * 2, count + 1024);
+    ptr = realloc(*(void **)pptr, (size_t)size * elem_size);
+    if (!ptr)
+        return -1;
+    *(void **)pptr = ptr;
+    *size_ptr = size;
+    return 0;
+}
+
+static int csdb_add_string(CsDb *db, const char *str)
+{
+    int len = strlen(str) + 1, pos;
+
+    if (csdb_grow(&db->pool, &db->pool_size, 1, db->pool_len + len))
+        return -1;
+    pos = db->pool_len;
+    memcpy(db->pool + pos, str, len);
+    db->pool_len += len;
+    return pos;
+}
+
+static int csdb_rehash(CsDb *db, int size)
+{
+    unsigned int *table, h;
+    int i;
+
+    table = calloc(size, sizeof(unsigned int));
+    if (!table)
+        return -1;
+    for (i = 0; i < db->nb_syms; i++) {
+        h = db->syms[i].hash & (size - 1);
+        while (table[h])
+            h = (h + 1) & (size - 1);
+        table[h] = i + 1;
+    }
+    free(db->hash_table);
+    db->hash_table = table;
+    db->hash_size = size;
+    return 0;
+}
+
+/* return the symbol index, or -1 if not found and 'add' is false */
+static int csdb_find_sym(CsDb *db, const char *name, int add)
+{
+    unsigned int hash, h;
+    CsDbSym *sym;
+    int index, pos;
+
+    hash = csdb_hash(name);
+    if (db->hash_size) {
+        h = hash & (db->hash_size - 1);
+        while ((index = db->hash_table[h]) != 0) {
+            sym = &db->syms[index - 1];
+            if (sym->hash == hash && !strcmp(db->pool + sym->name, name))
+                return index - 1;
+            h = (h + 1) & (db->hash_size - 1);
+        }
+    }
+    if (!add)
+        return -1;
+
+    if (db->nb_syms * 2 >= db->hash_size) {
+        if (csdb_rehash(db, db->hash_size ? db->hash_size * 2 : 65536))
+            return -1;
+    }
+    if (csdb_grow(&db->syms, &db->syms_size, sizeof(CsDbSym),
+                  db->nb_syms + 1))
+        return -1;
+    pos = csdb_add_string(db, name);
+    if (pos < 0)
+        return -1;
+    index = db->nb_syms++;
+    sym = &db->syms[index];
+    sym->name = pos;
+    sym->hash = hash;
+    sym->first = sym->last = 0;
+    h = hash & (db->hash_size - 1);
+    while (db->hash_table[h])
+        h = (h + 1) & (db->hash_size - 1);
+    db->hash_table[h] = index + 1;
+    return index;
+}
+
+static int csdb_add_ref(CsDb *db, int index, int rec, int func, int mark)
+{
+    CsDbSym *sym = &db->syms[index];
+    CsDbRef *ref;
+
+    if (csdb_grow(&db->refs, &db->refs_size, sizeof(CsDbRef),
+                  db->nb_refs + 1))
+        return -1;
+    ref = &db->refs[db->nb_refs++];
+    ref->rec = rec;
+    ref->next = 0;
+    ref->func = func <= CSDB_FUNC_MAX ? func : 0;
+    ref->mark = mark;
+    if (sym->last)
+        db->refs[sym->last - 1].next = db->nb_refs;
+    else
+        sym->first = db->nb_refs;
+    sym->last = db->nb_refs;
+    return 0;
+}
+
+/* the includes are indexed by the base name of the included file */
+static const char *csdb_include_key(const char *name)
+{
+    const char *p;
+
+    if (*name == '<' || *name == '"')
+        name++;
+    p = strrchr(name, '/');
+    return p ? p + 1 : name;
+}
+
+static int csdb_build(CsDb *db)
+{
+    CsDbScan sc;
+    char name[1024];
+    const char *key;
+    int ev, index, rec = 0, func = 0, macro = 0;
+
+    csdb_scan_init(db, &sc, 0);
+    while ((ev = csdb_scan_next(db, &sc)) != CSDB_EV_END) {
+        switch (ev) {
+        case CSDB_EV_FILE:
+            if (csdb_grow(&db->files, &db->files_size, sizeof(CsDbFile),
+                          db->nb_files + 1))
+                return -1;
+            /* file names are not compressed */
+            pstrncpy(name, sizeof(name), (const char *)sc.str, sc.len);
+            index = csdb_add_string(db, name);
+            if (index < 0)
+                return -1;
+            db->files[db->nb_files].name = index;
+            db->files[db->nb_files].offset = sc.offset;
+            db->nb_files++;
+            func = macro = 0;
+            break;
+        case CSDB_EV_LINE:
+            rec = sc.offset;
+            break;
+        case CSDB_EV_SYM:
+            if (sc.mark == CSDB_FUNC_END) {
+                func = 0;
+                break;
+            }
+            if (sc.mark == CSDB_DEFINE_END) {
+                macro = 0;
+                break;
+            }
+            if (sc.len == 0)
+                break;
+            csdb_decode(db, name, 0, sizeof(name), sc.str, sc.len);
+            key = name;
+            if (sc.mark == CSDB_INCLUDE)
+                key = csdb_include_key(name);
+            index = csdb_find_sym(db, key, 1);
+            if (index < 0)
+                return -1;
+            if (sc.mark == CSDB_FUNC_DEF)
+                func = index + 1;
+            else if (sc.mark == CSDB_DEFINE)
+                macro = index + 1;
+            if (csdb_add_ref(db, index, rec, func ? func : macro, sc.mark))
+                return -1;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void csdb_free(CsDb *db)
+{
+    if (!db)
+        return;
+    if (db->data)
+        munmap((void *)db->data, db->data_size);
+    free(db->pool);
+    free(db->syms);
+    free(db->hash_table);
+    free(db->refs);
+    free(db->files);
+    free(db);
+}
+
+/* return the database at 'path', mapped and indexed again if the
+   file changed since the last query */
+static CsDb *csdb_open(const char *path)
+{
+    struct stat st;
+    CsDb *db;
+    char buf[256];
+    void *data;
+    int fd, len;
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    db = csdb;
+    if (db && !strcmp(db->path, path) && db->dev == st.st_dev &&
+        db->ino == st.st_ino && db->mtime == st.st_mtime &&
+        db->size == st.st_size)
+        return db;
+
+    csdb_free(csdb);
+    csdb = NULL;
+
+    /* the record offsets are 32 bits */
+    if (st.st_size == 0 || st.st_size >= 0x7fffffff)
+        return NULL;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    db = calloc(1, sizeof(CsDb));
+    if (!db) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    pstrcpy(db->path, sizeof(db->path), path);
+    db->dev = st.st_dev;
+    db->ino = st.st_ino;
+    db->mtime = st.st_mtime;
+    db->size = st.st_size;
+    db->data = data;
+    db->data_size = st.st_size;
+
+    /* header: "cscope <version> <dir> [-c] [-q <n>] [-T] <trailer>" */
+    len = min((int)st.st_size, (int)sizeof(buf) - 1);
+    memcpy(buf, data, len);
+    buf[len] = '\0';
+    if (!strstart(buf, "cscope ", NULL) || !strchr(buf, '\n')) {
+        csdb_free(db);
+        return NULL;
+    }
+    *strchr(buf, '\n') = '\0';
+    db->compressed = !strstr(buf, " -c");
+
+    if (csdb_build(db)) {
+        csdb_free(db);
+        return NULL;
+    }
+    csdb = db;
+    return db;
+}
+
+typedef struct CsDbOutput {
+    char *buf;
+    int len, size;
+} CsDbOutput;
+
+static int csdb_printf(CsDbOutput *out, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    for (;;) {
+        va_start(ap, fmt);
+        len = vsnprintf(out->buf + out->len, out->size - out->len, fmt, ap);
+        va_end(ap);
+        if (len < out->size - out->len)
+            break;
+        if (csdb_grow(&out->buf, &out->size, 1, out->len + len + 1))
+            return -1;
+    }
+    out->len += len;
+    return 0;
+}
+
+/* return the file of the record at offset 'rec' */
+static const char *csdb_file_name(CsDb *db, unsigned int rec)
+{
+    int lo = 0, hi = db->nb_files - 1, mid;
+
+    if (hi < 0)
+        return "";
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (db->files[mid].offset <= rec)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return db->pool + db->files[lo].name;
+}
+
+/* expand the whole source line of the record at 'rec' */
+static int csdb_record_text(CsDb *db, unsigned int rec,
+                            char *buf, int size)
+{
+    CsDbScan sc;
+    int ev, pos = 0, lineno = 0;
+
+    csdb_scan_init(db, &sc, rec);
+    buf[0] = '\0';
+    while ((ev = csdb_scan_next(db, &sc)) != CSDB_EV_END) {
+        if (ev == CSDB_EV_LINE) {
+            if (lineno)
+                break;
+            lineno = sc.lineno;
+        } else if (ev != CSDB_EV_SYM && ev != CSDB_EV_TEXT) {
+            break;
+        }
+        pos = csdb_decode(db, buf, pos, size, sc.str, sc.len);
+    }
+    return lineno;
+}
+
+static int csdb_output_ref(CsDb *db, CsDbOutput *out, unsigned int rec,
+                           const char *func)
+{
+    char text[1024];
+    int lineno;
+
+    lineno = csdb_record_text(db, rec, text, sizeof(text));
+    return csdb_printf(out, "%s %s %d %s\n", csdb_file_name(db, rec),
+                       func, lineno, text);
+}
+
+static const char *csdb_func_name(CsDb *db, CsDbRef *ref)
+{
+    if (!ref->func)
+        return "<global>";
+    return db->pool + db->syms[ref->func - 1].name;
+}
+
+static int csdb_match_mark(int op, int mark)
+{
+    switch (op) {
+    case 0: /* symbol */
+        return mark != CSDB_INCLUDE;
+    case 1: /* definition */
+        return strchr("$#cegmlpstu", mark) != NULL;
+    case 3: /* calls */
+        return mark == CSDB_FUNC_CALL;
+    case 8: /* includes */
+        return mark == CSDB_INCLUDE;
+    case 9: /* assignments */
+        return mark == CSDB_ASSIGN;
+    }
+    return 0;
+}
+
+/* list the functions called by the definitions of 'sym' */
+static int csdb_called_by(CsDb *db, CsDbOutput *out, CsDbSym *sym)
+{
+    CsDbScan sc;
+    CsDbRef *ref;
+    char name[1024];
+    unsigned int r;
+    int ev, rec, depth;
+
+    for (r = sym->first; r; r = ref->next) {
+        ref = &db->refs[r - 1];
+        if (ref->mark != CSDB_FUNC_DEF)
+            continue;
+        csdb_scan_init(db, &sc, ref->rec);
+        rec = ref->rec;
+        depth = 0;
+        while ((ev = csdb_scan_next(db, &sc)) != CSDB_EV_END &&
+               ev != CSDB_EV_FILE) {
+            if (ev == CSDB_EV_LINE) {
+                rec = sc.offset;
+            } else if (ev == CSDB_EV_SYM) {
+                if (sc.mark == CSDB_FUNC_END ||
+                    (sc.mark == CSDB_FUNC_DEF && depth++))
+                    break;
+                if (sc.mark != CSDB_FUNC_CALL)
+                    continue;
+                csdb_decode(db, name, 0, sizeof(name), sc.str, sc.len);
+                if (csdb_output_ref(db, out, rec, name))
+                    return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Answer the query 'op' on 'sym' from the cscope.out of 'symdir'.
+   Return -1 if the database cannot be read natively, else 0 with
+   the matches in a malloced, null terminated '*response'. */
+int cscope_db_query(const char *symdir, int op, const char *sym,
+                    char **response, int *len)
+{
+    char path[1024];
+    CsDbOutput out;
+    CsDb *db;
+    CsDbSym *s;
+    CsDbRef *ref;
+    unsigned int r, last_rec;
+    const char *key;
+    int i, index, ret = 0;
+
+    /* the text searches read the source files, not the database */
+    if (op == 4 || op == 5 || op == 6)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/cscope.out", symdir);
+    db = csdb_open(path);
+    if (!db)
+        return -1;
+
+    memset(&out, 0, sizeof(out));
+    if (csdb_grow(&out.buf, &out.size, 1, 4096))
+        return -1;
+    out.buf[0] = '\0';
+
+    switch (op) {
+    case 2:
+        index = csdb_find_sym(db, sym, 0);
+        if (index >= 0)
+            ret = csdb_called_by(db, &out, &db->syms[index]);
+        break;
+    case 7:
+        for (i = 0; i < db->nb_files && !ret; i++) {
+            if (strstr(db->pool + db->files[i].name, sym))
+                ret = csdb_printf(&out, "%s <unknown> 1 <unknown>\n",
+                                  db->pool + db->files[i].name);
+        }
+        break;
+    default:
+        key = op == 8 ? csdb_include_key(sym) : sym;
+        index = csdb_find_sym(db, key, 0);
+        if (index < 0)
+            break;
+        s = &db->syms[index];
+        last_rec = 0;
+        for (r = s->first; r && !ret; r = ref->next) {
+            ref = &db->refs[r - 1];
+            /* one match per line */
+            if (!csdb_match_mark(op, ref->mark) || ref->rec == last_rec)
+                continue;
+            last_rec = ref->rec;
+            if (op == 8 && key != sym) {
+                char text[1024];
+                csdb_record_text(db, ref->rec, text, sizeof(text));
+                if (!strstr(text, sym))
+                    continue;
+            }
+            ret = csdb_output_ref(db, &out, ref->rec,
+                                  csdb_func_name(db, ref));
+        }
+        break;
+    }
+    if (ret) {
+        free(out.buf);
+        return -1;
+    }
+    *response = out.buf;
+    *len = out.len;
+    return 0;
+}
@@ -1,9 +1,6 @@
 #ifndef QE_DISPLAY_H
 #define QE_DISPLAY_H
 
-#define MAX_SCREEN_WIDTH 256  /* in chars */
-#define MAX_SCREEN_LINES 256  /* in text lines */
-
 typedef unsigned int QEColor;
 #define QEARGB(a,r,g,b) (((a) << 24) | ((r) << 16) | ((g) << 8) | (b))
 #define QERGB(r,g,b) QEARGB(0xff, r, g, b)
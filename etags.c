@@ -0,0 +1,428 @@
+/*
+ * Emacs TAGS lookup for QEmacs.
+ * Copyright (c) 2020 Himanshu Chauhan
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "qe.h"
+#include <sys/mman.h>
+
+/* The TAGS file written by etags is mapped and its tags sorted by name
+   once, so that the definitions are found by a binary search and the
+   completions are the run of names sharing the prefix. The names and
+   the file names stay in the mapping. The table is read again only
+   when TAGS changes. The jumps use the mark stack of cscope, so
+   cscope-pop-mark also comes back from a tag. */
+
+#define ETAGS_FILE            "TAGS"
+#define ETAGS_MAX_COMPLETIONS 1000
+
+typedef struct TagEntry {
+    int name, name_len;       /* in the mapped TAGS */
+    int file, file_len;
+    int line;
+} TagEntry;
+
+typedef struct TagTable {
+    char path[2048];
+    char dir[1024];           /* directory of the relative file names */
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+    const char *data;
+    TagEntry *tags;           /* sorted by name */
+    int nb_tags, tags_size;
+} TagTable;
+
+static TagTable tags;
+
+/* last tag found, for find-next-tag */
+static char tags_last[256];
+static int tags_last_index;
+
+static char *tags_default;    /* word at point when find-tag started */
+
+static const char *tags_sort_data;
+
+static int tags_compare(const void *p1, const void *p2)
+{
+    const TagEntry *t1 = p1, *t2 = p2;
+    int ret;
+
+    ret = memcmp(tags_sort_data + t1->name, tags_sort_data + t2->name,
+                 min(t1->name_len, t2->name_len));
+    if (ret == 0)
+        ret = t1->name_len - t2->name_len;
+    /* keep the definitions in the order of TAGS */
+    if (ret == 0)
+        ret = t1->name - t2->name;
+    return ret;
+}
+
+static void tags_free(void)
+{
+    if (tags.data)
+        munmap((void *)tags.data, tags.size);
+    free(tags.tags);
+    memset(&tags, 0, sizeof(tags));
+}
+
+static inline int tags_is_delim(int c)
+{
+    return strchr(" \f\t\n\r()=,;", c) != NULL;
+}
+
+/* add the tags of a section of TAGS: the lines after the header
+   'file,size' up to the next form feed */
+static int tags_add_section(const char *p, const char *end)
+{
+    const char *file, *q, *del, *name, *name_end, *pos;
+    TagEntry *t;
+    int file_len, size;
+
+    file = p;
+    q = memchr(p, '\n', end - p);
+    if (!q)
+        return 0;
+    for (p = q; p > file && p[-1] != ','; p--)
+        continue;
+    if (p == file)
+        return 0;
+    file_len = p - 1 - file;
+    /* included tags tables are not followed */
+    if (!strncmp(p, "include", 7))
+        return 0;
+
+    for (p = q + 1; p < end; p = q + 1) {
+        q = memchr(p, '\n', end - p);
+        if (!q)
+            q = end;
+        del = memchr(p, '\177', q - p);
+        if (!del)
+            continue;
+        name_end = memchr(del + 1, '\001', q - del - 1);
+        if (name_end) {
+            /* explicit tag name */
+            name = del + 1;
+            pos = name_end + 1;
+        } else {
+            pos = del + 1;
+            /* the name is the last word of the text */
+            for (name_end = del; name_end > p && tags_is_delim(name_end[-1]);
+                 name_end--)
+                continue;
+            for (name = name_end; name > p && !tags_is_delim(name[-1]);
+                 name--)
+                continue;
+        }
+        if (name == name_end)
+            continue;
+        if (tags.nb_tags >= tags.tags_size) {
+            size = max(tags.tags_size * 2, 4096);
+            t = realloc(tags.tags, size * sizeof(TagEntry));
+            if (!t)
+                return -1;
+            tags.tags = t;
+            tags.tags_size = size;
+        }
+        t = &tags.tags[tags.nb_tags++];
+        t->name = name - tags.data;
+        t->name_len = name_end - name;
+        t->file = file - tags.data;
+        t->file_len = file_len;
+        /* 'line,offset' follows the name */
+        t->line = strtol(pos, NULL, 10);
+    }
+    return 0;
+}
+
+/* map the TAGS file 'path' unless it is already loaded and did not
+   change */
+static int tags_load(const char *path)
+{
+    const char *p, *end, *q;
+    struct stat st;
+    void *data;
+    int fd;
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+    if (tags.data && !strcmp(tags.path, path) && tags.dev == st.st_dev &&
+        tags.ino == st.st_ino && tags.mtime == st.st_mtime &&
+        tags.size == st.st_size)
+        return 0;
+    tags_free();
+    tags_last[0] = '\0';
+
+    if (st.st_size == 0 || st.st_size >= 0x7fffffff)
+        return -1;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    pstrcpy(tags.path, sizeof(tags.path), path);
+    pstrcpy(tags.dir, sizeof(tags.dir), path);
+    *(char *)qe_basename(tags.dir) = '\0';
+    tags.dev = st.st_dev;
+    tags.ino = st.st_ino;
+    tags.mtime = st.st_mtime;
+    tags.size = st.st_size;
+    tags.data = data;
+
+    /* sections start with a form feed line */
+    p = tags.data;
+    end = p + tags.size;
+    while (p < end) {
+        q = memchr(p, '\f', end - p);
+        if (!q)
+            break;
+        p = q + 1;
+        if (p < end && *p == '\n')
+            p++;
+        q = memchr(p, '\f', end - p);
+        if (!q)
+            q = end;
+        if (tags_add_section(p, q) < 0) {
+            tags_free();
+            return -1;
+        }
+        p = q;
+    }
+    tags_sort_data = tags.data;
+    qsort(tags.tags, tags.nb_tags, sizeof(TagEntry), tags_compare);
+    return 0;
+}
+
+/* compare the name of the tag 'index' to the 'len' chars of 'name',
+   or only to its prefix if 'prefix' is true */
+static int tags_cmp_name(int index, const char *name, int len, int prefix)
+{
+    const TagEntry *t = &tags.tags[index];
+    int ret;
+
+    ret = memcmp(tags.data + t->name, name, min(t->name_len, len));
+    if (ret == 0 && t->name_len < len)
+        ret = -1;
+    else if (ret == 0 && !prefix && t->name_len > len)
+        ret = 1;
+    return ret;
+}
+
+/* return the index of the first tag whose name is 'name' or, if
+   'prefix' is true, starts with it. Set '*count' to the number of
+   such tags. */
+static int tags_find(const char *name, int prefix, int *count)
+{
+    int len = strlen(name), lo, hi, mid, first;
+
+    lo = 0;
+    hi = tags.nb_tags;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (tags_cmp_name(mid, name, len, prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    first = lo;
+    hi = tags.nb_tags;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (tags_cmp_name(mid, name, len, prefix) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *count = lo - first;
+    return first;
+}
+
+/* look for TAGS in the directory of the current file and its
+   parents, then in the current directory and its parents */
+static int tags_find_file(EditState *s, char *path, int size)
+{
+    char dir[1024];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (i == 0) {
+            if (!s->b->filename[0])
+                continue;
+            pstrcpy(dir, sizeof(dir), s->b->filename);
+            *(char *)qe_basename(dir) = '\0';
+        } else if (!getcwd(dir, sizeof(dir) - 1)) {
+            break;
+        } else {
+            pstrcat(dir, sizeof(dir), "/");
+        }
+        for (;;) {
+            snprintf(path, size, "%s%s", dir, ETAGS_FILE);
+            if (access(path, R_OK) == 0)
+                return 0;
+            /* strip the last directory */
+            if (strlen(dir) <= 1)
+                break;
+            dir[strlen(dir) - 1] = '\0';
+            *(char *)qe_basename(dir) = '\0';
+        }
+    }
+    return -1;
+}
+
+static void tags_goto(EditState *s, int index, int count)
+{
+    const TagEntry *t = &tags.tags[index];
+    char file[1024], path[2048];
+
+    pstrncpy(file, sizeof(file), tags.data + t->file, t->file_len);
+    if (file[0] == '/')
+        pstrcpy(path, sizeof(path), file);
+    else
+        snprintf(path, sizeof(path), "%s%s", tags.dir, file);
+    cscope_goto_line(s, path, max(t->line, 1));
+    if (count > 1)
+        put_status(s, "%s: %d of %d definitions (M-, for the next)",
+                   tags_last, tags_last_index + 1, count);
+}
+
+static void find_tag(EditState *s, const char *name)
+{
+    char path[2048];
+    int index, count;
+
+    if (tags_find_file(s, path, sizeof(path)) < 0) {
+        put_status(s, "No %s file found", ETAGS_FILE);
+        return;
+    }
+    if (tags_load(path) < 0) {
+        put_status(s, "Could not read %s", path);
+        return;
+    }
+    index = tags_find(name, 0, &count);
+    if (count == 0) {
+        put_status(s, "No tag for '%s'", name);
+        return;
+    }
+    pstrcpy(tags_last, sizeof(tags_last), name);
+    tags_last_index = 0;
+    tags_goto(s, index, count);
+}
+
+/* names of the tags starting with 'input', in the TAGS file found
+   when find-tag started */
+static void tag_completion(StringArray *cs, const char *input)
+{
+    const TagEntry *t;
+    char path[2048], name[256];
+    int index, count, i, n;
+
+    /* tags_load() clears the path of a changed table */
+    pstrcpy(path, sizeof(path), tags.path);
+    if (!path[0] || tags_load(path) < 0)
+        return;
+    index = tags_find(input, 1, &count);
+    n = 0;
+    for (i = index; i < index + count && n < ETAGS_MAX_COMPLETIONS; i++) {
+        t = &tags.tags[i];
+        /* the names are sorted, so a repeated name follows itself */
+        if (i > index && t->name_len == t[-1].name_len &&
+            !memcmp(tags.data + t->name, tags.data + t[-1].name,
+                    t->name_len))
+            continue;
+        pstrncpy(name, sizeof(name), tags.data + t->name, t->name_len);
+        add_string(cs, name);
+        n++;
+    }
+}
+
+static void find_tag_cb(void *opaque, char *reply)
+{
+    EditState *s = opaque;
+
+    if (!reply)
+        return;
+    if (reply[0] != '\0')
+        find_tag(s, reply);
+    else if (tags_default && tags_default[0] != '\0')
+        find_tag(s, tags_default);
+    free(reply);
+}
+
+static void do_find_tag(EditState *s)
+{
+    char prompt[512], path[2048];
+
+    /* load the table now for the completion */
+    if (tags_find_file(s, path, sizeof(path)) < 0) {
+        put_status(s, "No %s file found", ETAGS_FILE);
+        return;
+    }
+    if (tags_load(path) < 0) {
+        put_status(s, "Could not read %s", path);
+        return;
+    }
+    free(tags_default);
+    tags_default = do_read_word_at_offset(s);
+    if (tags_default && tags_default[0] != '\0') {
+        snprintf(prompt, sizeof(prompt), "Find tag [default %s]: ",
+                 tags_default);
+    } else {
+        pstrcpy(prompt, sizeof(prompt), "Find tag: ");
+    }
+    minibuffer_edit(NULL, prompt, NULL, tag_completion, find_tag_cb, s);
+}
+
+/* go to the next definition of the last tag */
+static void do_find_next_tag(EditState *s)
+{
+    char path[2048];
+    int index, count;
+
+    if (tags_last[0] && tags_find_file(s, path, sizeof(path)) == 0)
+        tags_load(path);
+    /* also forgotten when TAGS changes */
+    if (!tags_last[0]) {
+        put_status(s, "No previous tag");
+        return;
+    }
+    index = tags_find(tags_last, 0, &count);
+    if (count == 0) {
+        put_status(s, "No tag for '%s'", tags_last);
+        return;
+    }
+    tags_last_index = (tags_last_index + 1) % count;
+    tags_goto(s, index + tags_last_index, count);
+}
+
+static CmdDef etags_commands[] = {
+    CMD0( KEY_META('.'), KEY_NONE, "find-tag", do_find_tag)
+    CMD0( KEY_META(','), KEY_NONE, "find-next-tag", do_find_next_tag)
+    CMD0( KEY_META('*'), KEY_NONE, "pop-tag-mark", do_cscope_pop_mark)
+    CMD_DEF_END,
+};
+
+static int etags_init(void)
+{
+    qe_register_cmd_table(etags_commands, NULL);
+    register_completion("tag", tag_completion);
+    return 0;
+}
+
+qe_module_init(etags_init);
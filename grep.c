@@ -0,0 +1,908 @@
+/*
+ * Project grep for QEmacs.
+ * Copyright (c) 2020 Himanshu Chauhan
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "qe.h"
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The tree below the current directory is walked by a pool of
+   threads. Each thread owns a queue of directories to read: it takes
+   the last one it queued and, when its queue is empty, steals the
+   oldest one of another thread. The files are mapped and searched
+   with the search.c engine, and the matching lines of each file are
+   handed to the main loop, woken up by a pipe, which appends them to
+   the *grep* buffer.
+
+   The project query replace uses the same search to find the files
+   to modify: only them are then loaded in buffers. */
+
+#define GREP_MAX_THREADS  16
+#define GREP_BINARY_SIZE  4096 /* bytes tested for a NUL to skip binary files */
+#define GREP_LINE_SIZE    256  /* longest text shown for a match */
+#define GREP_MMAP_SIZE    (64 * 1024) /* smaller files are read, not mapped */
+
+typedef struct GrepQueue {
+    pthread_mutex_t lock;
+    char **dirs;
+    int head, tail; /* the queued directories are dirs[head..tail-1] */
+    int size;
+} GrepQueue;
+
+typedef struct GrepState GrepState;
+
+typedef struct GrepWorker {
+    GrepState *gs;
+    int index;
+    pthread_t thread;
+    GrepQueue queue;
+    u8 *buf;           /* contents of the small files */
+    /* matching lines of the current file */
+    char *out;
+    int out_len, out_size;
+} GrepWorker;
+
+struct GrepState {
+    EditBuffer *b;
+    EditState *os;     /* window where the grep was started */
+    char root[1024];
+    SearchPattern *sp;
+    int nb_workers;
+    int nb_threads;    /* workers with a running thread */
+    GrepWorker workers[GREP_MAX_THREADS];
+    int pending;       /* directories queued or being read */
+    int running;       /* workers not finished */
+    volatile int abort;
+    /* the idle workers wait for 'idle_gen' to change */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int idle_gen;
+    /* matching lines not yet in the buffer */
+    pthread_mutex_t lock;
+    char *out;
+    int out_len, out_size;
+    int nb_matches, nb_files;
+    int pipe_fds[2];
+    int start_time;
+    /* project query replace */
+    char *search;
+    char *replace;     /* NULL if simple grep */
+    char **files;      /* files with matches, relative to root */
+    int nb_stored, files_size; /* nb_stored < nb_files if out of memory */
+};
+
+typedef struct ProjectReplace {
+    EditState *os;
+    char root[1024];
+    char *search;
+    char *replace;
+    char **files;
+    int nb_files;
+    int index;         /* next file to process */
+    int nb_reps, nb_changed, nb_saved;
+    EditBuffer *b;     /* buffer of the file being replaced */
+    int modified;      /* true if it had unsaved changes before */
+    int status;        /* end of the replacement in the last file */
+    int busy, again;
+} ProjectReplace;
+
+static ModeDef grep_mode;
+
+static int grep_buf_append(char **buf_ptr, int *len_ptr, int *size_ptr,
+                           const char *data, int len)
+{
+    char *buf;
+    int size;
+
+    if (*len_ptr + len > *size_ptr) {
+        size = max(*size_ptr * 2, *len_ptr + len + 4096);
+        buf = realloc(*buf_ptr, size);
+        if (!buf)
+            return -1;
+        *buf_ptr = buf;
+        *size_ptr = size;
+    }
+    memcpy(*buf_ptr + *len_ptr, data, len);
+    *len_ptr += len;
+    return 0;
+}
+
+/* wake up one idle worker, or all of them if 'all' is true */
+static void grep_wakeup(GrepState *gs, int all)
+{
+    pthread_mutex_lock(&gs->idle_lock);
+    __sync_fetch_and_add(&gs->idle_gen, 1);
+    if (all)
+        pthread_cond_broadcast(&gs->idle_cond);
+    else
+        pthread_cond_signal(&gs->idle_cond);
+    pthread_mutex_unlock(&gs->idle_lock);
+}
+
+/* queue 'dir' on the queue of 'w'. The caller owns a pending count */
+static void grep_push_dir(GrepWorker *w, char *dir)
+{
+    GrepQueue *q = &w->queue;
+    char **dirs;
+    int n;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->size) {
+        n = q->tail - q->head;
+        if (n * 2 >= q->size) {
+            q->size = max(q->size * 2, 64);
+            dirs = realloc(q->dirs, q->size * sizeof(char *));
+            if (!dirs) {
+                pthread_mutex_unlock(&q->lock);
+                free(dir);
+                if (__sync_sub_and_fetch(&w->gs->pending, 1) == 0)
+                    grep_wakeup(w->gs, 1);
+                return;
+            }
+            q->dirs = dirs;
+        }
+        memmove(q->dirs, q->dirs + q->head, n * sizeof(char *));
+        q->head = 0;
+        q->tail = n;
+    }
+    q->dirs[q->tail++] = dir;
+    pthread_mutex_unlock(&q->lock);
+    grep_wakeup(w->gs, 0);
+}
+
+/* take the newest directory of our queue, or steal the oldest one of
+   another worker */
+static char *grep_pop_dir(GrepWorker *w)
+{
+    GrepState *gs = w->gs;
+    GrepQueue *q;
+    char *dir = NULL;
+    int i;
+
+    q = &w->queue;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head)
+        dir = q->dirs[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+
+    for(i = 1; dir == NULL && i < gs->nb_workers; i++) {
+        q = &gs->workers[(w->index + i) % gs->nb_workers].queue;
+        pthread_mutex_lock(&q->lock);
+        if (q->tail > q->head)
+            dir = q->dirs[q->head++];
+        pthread_mutex_unlock(&q->lock);
+    }
+    return dir;
+}
+
+/* give the matching lines of the file to the main loop */
+static void grep_flush(GrepWorker *w, const char *filename, int nb_matches)
+{
+    GrepState *gs = w->gs;
+    char **files;
+    int wakeup, size;
+
+    pthread_mutex_lock(&gs->lock);
+    wakeup = (gs->out_len == 0);
+    grep_buf_append(&gs->out, &gs->out_len, &gs->out_size,
+                    w->out, w->out_len);
+    gs->nb_matches += nb_matches;
+    if (gs->replace) {
+        if (gs->nb_stored == gs->files_size) {
+            size = max(gs->files_size * 2, 64);
+            files = realloc(gs->files, size * sizeof(char *));
+            if (files) {
+                gs->files = files;
+                gs->files_size = size;
+            }
+        }
+        if (gs->nb_stored < gs->files_size)
+            gs->files[gs->nb_stored++] = strdup(filename);
+    }
+    gs->nb_files++;
+    pthread_mutex_unlock(&gs->lock);
+    w->out_len = 0;
+
+    /* the main loop reads everything at once, one byte is enough */
+    if (wakeup && write(gs->pipe_fds[1], "", 1) < 0) {
+        /* pipe full: the main loop is already woken up */
+    }
+}
+
+static void grep_file(GrepWorker *w, const char *path)
+{
+    GrepState *gs = w->gs;
+    const char *filename = path + strlen(gs->root) + 1;
+    char buf[64];
+    const u8 *data;
+    const u8 *q;
+    struct stat st;
+    int fd, size, pos, line, line_pos, bol, eol, len, n;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_size == 0 || st.st_size > MAXINT) {
+        close(fd);
+        return;
+    }
+    size = st.st_size;
+    if (size < GREP_MMAP_SIZE) {
+        /* mapping a small file costs more than reading it */
+        if (!w->buf)
+            w->buf = malloc(GREP_MMAP_SIZE);
+        data = w->buf;
+        if (!data || read(fd, w->buf, size) != size) {
+            close(fd);
+            return;
+        }
+    } else {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+
+    n = 0;
+    if (memchr(data, 0, min(size, GREP_BINARY_SIZE)))
+        goto done;
+
+    pos = 0;
+    line = 1;
+    line_pos = 0;
+    bol = 0;
+    while (!gs->abort &&
+           (pos = search_pattern_find(gs->sp, data, size, pos)) >= 0) {
+        /* count the lines up to the match */
+        while ((q = memchr(data + line_pos, '\n', pos - line_pos)) != NULL) {
+            line++;
+            bol = line_pos = q - data + 1;
+        }
+        line_pos = pos;
+        q = memchr(data + pos, '\n', size - pos);
+        eol = q ? q - data : size;
+
+        len = snprintf(buf, sizeof(buf), ":%d:", line);
+        grep_buf_append(&w->out, &w->out_len, &w->out_size,
+                        filename, strlen(filename));
+        grep_buf_append(&w->out, &w->out_len, &w->out_size, buf, len);
+        grep_buf_append(&w->out, &w->out_len, &w->out_size,
+                        (const char *)data + bol,
+                        min(eol - bol, GREP_LINE_SIZE));
+        grep_buf_append(&w->out, &w->out_len, &w->out_size, "\n", 1);
+        n++;
+        /* one result per line */
+        pos = eol + 1;
+    }
+    if (n > 0)
+        grep_flush(w, filename, n);
+ done:
+    if (data != w->buf)
+        munmap((void *)data, size);
+}
+
+static void grep_dir(GrepWorker *w, const char *dir)
+{
+    GrepState *gs = w->gs;
+    char path[1024];
+    struct dirent *d;
+    struct stat st;
+    DIR *dp;
+    int type;
+
+    dp = opendir(dir);
+    if (!dp)
+        return;
+    while (!gs->abort && (d = readdir(dp)) != NULL) {
+        /* skip '.', '..' and the hidden files, such as .git */
+        if (d->d_name[0] == '.')
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s",
+                     dir, d->d_name) >= (int)sizeof(path))
+            continue;
+        type = d->d_type;
+        if (type == DT_UNKNOWN) {
+            if (lstat(path, &st) < 0)
+                continue;
+            if (S_ISDIR(st.st_mode))
+                type = DT_DIR;
+            else if (S_ISREG(st.st_mode))
+                type = DT_REG;
+        }
+        /* symbolic links are not followed */
+        if (type == DT_DIR) {
+            __sync_fetch_and_add(&gs->pending, 1);
+            grep_push_dir(w, strdup(path));
+        } else if (type == DT_REG) {
+            grep_file(w, path);
+        }
+    }
+    closedir(dp);
+}
+
+static void *grep_thread(void *opaque)
+{
+    GrepWorker *w = opaque;
+    GrepState *gs = w->gs;
+    char *dir;
+    int gen;
+
+    for(;;) {
+        /* a directory queued after this point changes 'idle_gen' */
+        gen = __sync_fetch_and_add(&gs->idle_gen, 0);
+        dir = grep_pop_dir(w);
+        if (!dir) {
+            /* the directories being read may still queue new ones */
+            if (gs->abort || __sync_fetch_and_add(&gs->pending, 0) == 0)
+                break;
+            pthread_mutex_lock(&gs->idle_lock);
+            while (!gs->abort && gs->idle_gen == gen &&
+                   __sync_fetch_and_add(&gs->pending, 0) != 0) {
+                pthread_cond_wait(&gs->idle_cond, &gs->idle_lock);
+            }
+            pthread_mutex_unlock(&gs->idle_lock);
+            continue;
+        }
+        if (!gs->abort)
+            grep_dir(w, dir);
+        free(dir);
+        if (__sync_sub_and_fetch(&gs->pending, 1) == 0)
+            grep_wakeup(gs, 1);
+    }
+    if (__sync_sub_and_fetch(&gs->running, 1) == 0) {
+        /* tell the main loop that the grep is finished */
+        if (write(gs->pipe_fds[1], "", 1) < 0) {
+        }
+    }
+    return NULL;
+}
+
+/* stop the threads, the results already found are kept */
+static void grep_stop(GrepState *gs)
+{
+    GrepWorker *w;
+    int i;
+
+    gs->abort = 1;
+    grep_wakeup(gs, 1);
+    for(i = 0; i < gs->nb_threads; i++)
+        pthread_join(gs->workers[i].thread, NULL);
+    gs->nb_threads = 0;
+    for(i = 0; i < gs->nb_workers; i++) {
+        w = &gs->workers[i];
+        while (w->queue.tail > w->queue.head)
+            free(w->queue.dirs[--w->queue.tail]);
+        free(w->queue.dirs);
+        pthread_mutex_destroy(&w->queue.lock);
+        free(w->buf);
+        free(w->out);
+    }
+    gs->nb_workers = 0;
+    if (gs->pipe_fds[0] >= 0) {
+        set_read_handler(gs->pipe_fds[0], NULL, NULL);
+        close(gs->pipe_fds[0]);
+        close(gs->pipe_fds[1]);
+        gs->pipe_fds[0] = -1;
+    }
+}
+
+static void grep_free(GrepState *gs)
+{
+    int i;
+
+    grep_stop(gs);
+    pthread_mutex_destroy(&gs->lock);
+    pthread_mutex_destroy(&gs->idle_lock);
+    pthread_cond_destroy(&gs->idle_cond);
+    search_pattern_free(gs->sp);
+    free(gs->out);
+    if (gs->files) {
+        for(i = 0; i < gs->nb_stored; i++)
+            free(gs->files[i]);
+        free(gs->files);
+    }
+    free(gs->search);
+    free(gs->replace);
+    free(gs);
+}
+
+static void project_replace_start(GrepState *gs);
+
+static void grep_close(EditBuffer *b)
+{
+    GrepState *gs = b->priv_data;
+
+    if (gs) {
+        grep_free(gs);
+        b->priv_data = NULL;
+    }
+}
+
+/* append the lines found since the last call to the *grep* buffer */
+static void grep_read_cb(void *opaque)
+{
+    GrepState *gs = opaque;
+    EditBuffer *b = gs->b;
+    char buf[256];
+    char *out;
+    int len, done;
+
+    while (read(gs->pipe_fds[0], buf, sizeof(buf)) > 0)
+        continue;
+
+    done = (__sync_fetch_and_add(&gs->running, 0) == 0);
+    pthread_mutex_lock(&gs->lock);
+    out = gs->out;
+    len = gs->out_len;
+    gs->out = NULL;
+    gs->out_len = gs->out_size = 0;
+    pthread_mutex_unlock(&gs->lock);
+
+    if (len > 0)
+        eb_insert(b, b->total_size, (u8 *)out, len);
+    free(out);
+
+    if (done) {
+        put_status(NULL, "%d matches in %d files (%d ms)",
+                   gs->nb_matches, gs->nb_files,
+                   get_clock_ms() - gs->start_time);
+        grep_stop(gs);
+        if (gs->replace)
+            project_replace_start(gs);
+    }
+    edit_schedule_background_display(&qe_state);
+}
+
+static int grep_start(GrepState *gs)
+{
+    GrepWorker *w;
+    int i, n;
+
+    if (pipe(gs->pipe_fds) < 0)
+        return -1;
+    fcntl(gs->pipe_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(gs->pipe_fds[1], F_SETFL, O_NONBLOCK);
+    set_read_handler(gs->pipe_fds[0], grep_read_cb, gs);
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > GREP_MAX_THREADS)
+        n = GREP_MAX_THREADS;
+
+    for(i = 0; i < n; i++) {
+        w = &gs->workers[i];
+        w->gs = gs;
+        w->index = i;
+        pthread_mutex_init(&w->queue.lock, NULL);
+    }
+    gs->nb_workers = n;
+    gs->pending = 1;
+    grep_push_dir(&gs->workers[0], strdup(gs->root));
+
+    gs->running = n;
+    for(i = 0; i < n; i++) {
+        if (pthread_create(&gs->workers[i].thread, NULL,
+                           grep_thread, &gs->workers[i]) != 0)
+            break;
+        gs->nb_threads++;
+    }
+    if (i < n) {
+        /* the threads already started steal the other queues */
+        __sync_fetch_and_sub(&gs->running, n - i);
+        if (i == 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* search 'str' in the files of the current directory tree and show the
+   matches in *grep*. If 'replace' is not NULL, they are then replaced
+   interactively */
+static void grep_run(EditState *s, const char *str, const char *replace)
+{
+    QEmacsState *qs = s->qe_state;
+    GrepState *gs;
+    EditBuffer *b;
+    EditState *e, *os;
+    int x, y;
+
+    os = s;
+    if ((b = eb_find("*grep*")) == NULL) {
+        b = eb_new("*grep*", BF_READONLY | BF_SYSTEM);
+        if (b == NULL)
+            return;
+    } else {
+        /* stop the previous grep and clear its results */
+        if (s->b == b && b->priv_data)
+            os = ((GrepState *)b->priv_data)->os;
+        grep_close(b);
+        eb_delete(b, 0, b->total_size);
+    }
+
+    gs = malloc(sizeof(GrepState));
+    if (!gs)
+        return;
+    memset(gs, 0, sizeof(GrepState));
+    gs->pipe_fds[0] = -1;
+    pthread_mutex_init(&gs->lock, NULL);
+    pthread_mutex_init(&gs->idle_lock, NULL);
+    pthread_cond_init(&gs->idle_cond, NULL);
+    gs->b = b;
+    gs->os = os;
+    gs->start_time = get_clock_ms();
+    if (replace) {
+        /* replace the exact string, as query-replace */
+        gs->search = strdup(str);
+        gs->replace = strdup(replace);
+        gs->sp = search_pattern_new((const u8 *)str, strlen(str), 0);
+    } else {
+        gs->sp = search_pattern_new((const u8 *)str, strlen(str),
+                                    SEARCH_FLAG_SMARTCASE);
+    }
+    if (!gs->sp || (replace && (!gs->search || !gs->replace)) ||
+        !getcwd(gs->root, sizeof(gs->root)) || grep_start(gs) < 0) {
+        put_status(s, "Could not start grep");
+        grep_free(gs);
+        return;
+    }
+    b->priv_data = gs;
+    b->close = grep_close;
+
+    /* show the results as they come, in the same way as cscope */
+    for(e = qs->first_window; e != NULL; e = e->next_window) {
+        if (e->b == b)
+            break;
+    }
+    if (!e) {
+        if (!split_horizontal) {
+            x = (s->x2 + s->x1) / 2;
+            e = edit_new(b, x, s->y1, s->x2 - x,
+                         s->y2 - s->y1, WF_MODELINE);
+
+            s->x2 = x;
+            s->flags |= WF_RSEPARATOR;
+        } else {
+            y = (s->y2 + s->y1) / 2;
+            e = edit_new(b, s->x1, y,
+                         s->x2 - s->x1, s->y2 - y,
+                         WF_MODELINE | (s->flags & WF_RSEPARATOR));
+            s->y2 = y;
+        }
+        do_set_mode(e, &grep_mode, NULL);
+    }
+    e->offset = 0;
+    qs->active_window = e;
+    do_refresh(e);
+}
+
+static void do_project_grep(EditState *s, const char *str)
+{
+    grep_run(s, str, NULL);
+}
+
+/* return 'os' if it is still a window, otherwise another window not
+   showing 'b' */
+static EditState *grep_find_window(EditState *os, EditBuffer *b)
+{
+    QEmacsState *qs = &qe_state;
+    EditState *e;
+
+    for(e = qs->first_window; e != NULL; e = e->next_window) {
+        if (e == os)
+            return e;
+    }
+    for(e = qs->first_window; e != NULL; e = e->next_window) {
+        if (e->b != b && !e->minibuf && !(e->flags & WF_POPUP))
+            return e;
+    }
+    return qs->first_window;
+}
+
+/* jump to the match of the current line in the window where the grep
+   was started */
+static void grep_select(EditState *s)
+{
+    QEmacsState *qs = s->qe_state;
+    GrepState *gs = s->b->priv_data;
+    EditState *e;
+    char buf[1024], path[2048];
+    char *p, *q;
+    int offset, line = 0;
+
+    offset = list_get_offset(s);
+    eb_get_strline(s->b, buf, sizeof(buf), &offset);
+
+    /* lines are 'file:line:text' */
+    for(p = buf; (p = strchr(p, ':')) != NULL; p++) {
+        line = strtol(p + 1, &q, 10);
+        if (q > p + 1 && *q == ':')
+            break;
+    }
+    if (!p)
+        return;
+    *p = '\0';
+
+    e = grep_find_window(gs ? gs->os : NULL, s->b);
+    if (buf[0] == '/')
+        pstrcpy(path, sizeof(path), buf);
+    else
+        snprintf(path, sizeof(path), "%s/%s",
+                 gs ? gs->root : ".", buf);
+    qs->active_window = e;
+    cscope_goto_line(e, path, line);
+}
+
+/************************************************************/
+/* project query replace */
+
+static void project_replace_cb(void *opaque, int status, int nb_reps);
+
+static void project_replace_end(ProjectReplace *pr)
+{
+    int i;
+
+    put_status(NULL, "Replaced %d occurrences in %d files (%d saved)",
+               pr->nb_reps, pr->nb_changed, pr->nb_saved);
+    for(i = 0; i < pr->nb_files; i++)
+        free(pr->files[i]);
+    free(pr->files);
+    free(pr->search);
+    free(pr->replace);
+    free(pr);
+    edit_display(&qe_state);
+    dpy_flush(qe_state.screen);
+}
+
+/* replace all the matches of a file without asking and save it. The
+   file is loaded in a temporary buffer if it is not already edited */
+static void project_replace_file(ProjectReplace *pr, const char *path)
+{
+    char filename[1024];
+    EditBuffer *b;
+    FILE *f;
+    int n, created, modified;
+
+    canonize_absolute_path(filename, sizeof(filename), path);
+    b = eb_find_file(filename);
+    created = 0;
+    if (!b) {
+        f = fopen(filename, "r");
+        if (!f)
+            return;
+        b = eb_new("", 0);
+        if (!b) {
+            fclose(f);
+            return;
+        }
+        set_filename(b, filename);
+        raw_data_type.buffer_load(b, f);
+        fclose(f);
+        b->modified = 0;
+        created = 1;
+    }
+    modified = b->modified;
+    n = eb_replace_all(b, (const u8 *)pr->search, strlen(pr->search),
+                       (const u8 *)pr->replace, strlen(pr->replace));
+    if (n > 0) {
+        pr->nb_reps += n;
+        pr->nb_changed++;
+        /* do not save the changes made before by the user */
+        if (!modified && save_buffer(b) == 0)
+            pr->nb_saved++;
+    }
+    if (created)
+        eb_free(b);
+}
+
+/* go on after the end of the replacement in a file */
+static void project_replace_continue(ProjectReplace *pr)
+{
+    QEmacsState *qs = &qe_state;
+    EditState *s;
+    char path[2048];
+
+    pr->busy = 1;
+    for(;;) {
+        switch(pr->status) {
+        case QUERY_REPLACE_ALL:
+            for(; pr->index < pr->nb_files; pr->index++) {
+                snprintf(path, sizeof(path), "%s/%s",
+                         pr->root, pr->files[pr->index]);
+                project_replace_file(pr, path);
+            }
+            project_replace_end(pr);
+            return;
+        case QUERY_REPLACE_QUIT:
+            project_replace_end(pr);
+            return;
+        default:
+            break;
+        }
+        if (pr->index >= pr->nb_files) {
+            project_replace_end(pr);
+            return;
+        }
+
+        /* query replace in the next file */
+        s = grep_find_window(pr->os, eb_find("*grep*"));
+        pr->os = s;
+        snprintf(path, sizeof(path), "%s/%s",
+                 pr->root, pr->files[pr->index++]);
+        qs->active_window = s;
+        do_load(s, path);
+        s->offset = 0;
+        pr->b = s->b;
+        pr->modified = s->b->modified;
+        pr->again = 0;
+        query_replace_start(s, pr->search, pr->replace, 0,
+                            project_replace_cb, pr);
+        /* if the file was done without any key, loop instead of
+           recursing */
+        if (!pr->again)
+            break;
+    }
+    pr->busy = 0;
+}
+
+static void project_replace_cb(void *opaque, int status, int nb_reps)
+{
+    ProjectReplace *pr = opaque;
+
+    pr->nb_reps += nb_reps;
+    if (nb_reps > 0) {
+        pr->nb_changed++;
+        /* do not save the changes made before by the user */
+        if (!pr->modified && save_buffer(pr->b) == 0)
+            pr->nb_saved++;
+    }
+    pr->status = status;
+    if (pr->busy)
+        pr->again = 1;
+    else
+        project_replace_continue(pr);
+}
+
+static int project_replace_cmp(const void *p1, const void *p2)
+{
+    return strcmp(*(const char **)p1, *(const char **)p2);
+}
+
+/* called when the search is finished */
+static void project_replace_start(GrepState *gs)
+{
+    ProjectReplace *pr;
+    int i, n;
+
+    if (gs->nb_files == 0)
+        return;
+    pr = malloc(sizeof(ProjectReplace));
+    if (!pr)
+        return;
+    memset(pr, 0, sizeof(ProjectReplace));
+    pr->os = gs->os;
+    pstrcpy(pr->root, sizeof(pr->root), gs->root);
+    pr->search = gs->search;
+    pr->replace = gs->replace;
+    gs->search = NULL;
+    gs->replace = NULL;
+    /* take the files which could be stored */
+    n = 0;
+    for(i = 0; i < gs->nb_stored; i++) {
+        if (gs->files[i])
+            gs->files[n++] = gs->files[i];
+    }
+    pr->files = gs->files;
+    pr->nb_files = n;
+    gs->files = NULL;
+    gs->nb_stored = gs->files_size = 0;
+    qsort(pr->files, pr->nb_files, sizeof(char *), project_replace_cmp);
+    pr->status = QUERY_REPLACE_DONE;
+    project_replace_continue(pr);
+}
+
+static void do_project_query_replace(EditState *s, const char *search_str,
+                                     const char *replace_str)
+{
+    grep_run(s, search_str, replace_str);
+}
+
+/* stop the grep if still running, and close its window */
+static void grep_quit(EditState *s)
+{
+    GrepState *gs = s->b->priv_data;
+
+    if (gs && gs->nb_threads > 0) {
+        put_status(s, "Grep aborted: %d matches in %d files",
+                   gs->nb_matches, gs->nb_files);
+        grep_stop(gs);
+    }
+    do_delete_window(s, 0);
+}
+
+/* colorization states */
+enum {
+    GREP_FILE = 1,
+    GREP_LINE,
+};
+
+static void grep_colorize_line(unsigned int *buf, int len,
+                               int *colorize_state_ptr, int state_only)
+{
+    int i, start, state;
+
+    state = GREP_FILE;
+    start = 0;
+    for(i = 0; i < len && state <= GREP_LINE; i++) {
+        if (buf[i] != ':')
+            continue;
+        if (state == GREP_FILE) {
+            if (i + 1 >= len || buf[i + 1] < '0' || buf[i + 1] > '9')
+                continue;
+            set_color(buf, i, QE_STYLE_FUNCTION);
+        } else {
+            set_color(buf + start, i - start, QE_STYLE_STRING);
+        }
+        start = i + 1;
+        state++;
+    }
+}
+
+static CmdDef grep_mode_commands[] = {
+    CMD0( KEY_RET, ' ', "grep-select", grep_select)
+    CMD0( KEY_CTRL('g'), KEY_NONE, "grep-quit", grep_quit)
+    CMD_DEF_END,
+};
+
+static CmdDef grep_global_commands[] = {
+    CMD( KEY_NONE, KEY_NONE, "project-grep\0s{Project grep: }|search|",
+         do_project_grep)
+    CMD( KEY_NONE, KEY_NONE, "project-query-replace\0"
+         "s{Project query replace: }|search|s{With: }|replace|",
+         do_project_query_replace)
+    CMD_DEF_END,
+};
+
+static int grep_mode_init(EditState *s, ModeSavedData *saved_data)
+{
+    list_mode.mode_init(s, saved_data);
+    set_colorize_func(s, grep_colorize_line);
+    return 0;
+}
+
+static int grep_init(void)
+{
+    /* inherit from list mode */
+    memcpy(&grep_mode, &list_mode, sizeof(ModeDef));
+    grep_mode.name = "grep";
+    grep_mode.mode_probe = NULL;
+    grep_mode.mode_init = grep_mode_init;
+
+    qe_register_mode(&grep_mode);
+    qe_register_cmd_table(grep_mode_commands, "grep");
+    qe_register_cmd_table(grep_global_commands, NULL);
+
+    return 0;
+}
+
+qe_module_init(grep_init);
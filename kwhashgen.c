@@ -0,0 +1,188 @@
+/*
+ * Keyword perfect hash generator for QEmacs
+ * Copyright (c) 2020 Himanshu Chauhan
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * Read keyword sets and output a perfect hash table for each of
+ * them. The hash of a word of length 'len' is:
+ *
+ *   (a * w[0] + b * w[len / 2] + c * w[len - 1] + len) & mask
+ *
+ * The smallest power of two table size for which some coefficients
+ * give no collision is chosen. The lookup is done by keyword_find().
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_TABLES   16
+#define MAX_WORDS    256
+#define MAX_COEF     64
+#define MAX_SIZE     4096
+
+typedef struct KeywordSet {
+    char name[64];
+    char *words[MAX_WORDS];
+    int nb_words;
+} KeywordSet;
+
+static KeywordSet tables[MAX_TABLES];
+static int nb_tables;
+static const char *slots[MAX_SIZE];
+
+static unsigned int hash(const char *w, unsigned int a, unsigned int b,
+                         unsigned int c, unsigned int mask)
+{
+    const unsigned char *p = (const unsigned char *)w;
+    int len = strlen(w);
+
+    return (a * p[0] + b * p[len >> 1] + c * p[len - 1] + len) & mask;
+}
+
+static KeywordSet *find_table(const char *name)
+{
+    KeywordSet *ks;
+    int i;
+
+    for (i = 0; i < nb_tables; i++) {
+        if (!strcmp(tables[i].name, name))
+            return &tables[i];
+    }
+    if (nb_tables >= MAX_TABLES)
+        return NULL;
+    ks = &tables[nb_tables++];
+    snprintf(ks->name, sizeof(ks->name), "%s", name);
+    return ks;
+}
+
+static int parse_file(FILE *f)
+{
+    char line[1024], *p, *word;
+    KeywordSet *ks;
+    int line_num, i;
+
+    line_num = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_num++;
+        p = strchr(line, '#');
+        if (p)
+            *p = '\0';
+        word = strtok(line, " \t\r\n");
+        if (!word)
+            continue;
+        ks = find_table(word);
+        if (!ks) {
+            fprintf(stderr, "line %d: too many tables\n", line_num);
+            return -1;
+        }
+        while ((word = strtok(NULL, " \t\r\n")) != NULL) {
+            for (i = 0; i < ks->nb_words; i++) {
+                if (!strcmp(ks->words[i], word))
+                    break;
+            }
+            if (i < ks->nb_words)
+                continue;
+            if (ks->nb_words >= MAX_WORDS) {
+                fprintf(stderr, "line %d: too many words\n", line_num);
+                return -1;
+            }
+            ks->words[ks->nb_words++] = strdup(word);
+        }
+    }
+    return 0;
+}
+
+/* fill 'slots' with the words of 'ks' if there is no collision */
+static int try_hash(KeywordSet *ks, unsigned int a, unsigned int b,
+                    unsigned int c, unsigned int mask)
+{
+    unsigned int h;
+    int i;
+
+    memset(slots, 0, (mask + 1) * sizeof(slots[0]));
+    for (i = 0; i < ks->nb_words; i++) {
+        h = hash(ks->words[i], a, b, c, mask);
+        if (slots[h])
+            return 0;
+        slots[h] = ks->words[i];
+    }
+    return 1;
+}
+
+static int output_table(KeywordSet *ks)
+{
+    unsigned int a, b, c, size, i;
+
+    for (size = 16; size <= MAX_SIZE; size *= 2) {
+        if (size < (unsigned int)ks->nb_words)
+            continue;
+        for (a = 1; a < MAX_COEF; a++) {
+            for (b = 0; b < MAX_COEF; b++) {
+                for (c = 0; c < MAX_COEF; c++) {
+                    if (try_hash(ks, a, b, c, size - 1))
+                        goto found;
+                }
+            }
+        }
+    }
+    fprintf(stderr, "%s: no perfect hash found\n", ks->name);
+    return -1;
+
+ found:
+    printf("static const char * const %s_words[%u] = {", ks->name, size);
+    for (i = 0; i < size; i++) {
+        if ((i % 4) == 0)
+            printf("\n   ");
+        if (slots[i])
+            printf(" \"%s\",", slots[i]);
+        else
+            printf(" NULL,");
+    }
+    printf("\n};\n\n");
+    printf("static const KeywordHash %s = {\n"
+           "    %s_words, %u, %u, %u, %u,\n"
+           "};\n\n",
+           ks->name, ks->name, size - 1, a, b, c);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *f;
+    int i;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: kwhashgen file.kw\n");
+        exit(1);
+    }
+    f = fopen(argv[1], "r");
+    if (!f) {
+        perror(argv[1]);
+        exit(1);
+    }
+    if (parse_file(f) < 0)
+        exit(1);
+    fclose(f);
+
+    printf("/* This file was generated by kwhashgen from %s */\n\n",
+           argv[1]);
+    for (i = 0; i < nb_tables; i++) {
+        if (output_table(&tables[i]) < 0)
+            exit(1);
+    }
+    return 0;
+}
@@ -102,6 +102,12 @@ the_end:
     *colorize_state_ptr = state;
 }
 
+/* each line is colorized independently */
+static int patch_resync_line(unsigned int *buf, int len)
+{
+    return 1;
+}
+
 static int patch_mode_probe(ModeProbeData *p)
 {
     const char *r;
@@ -124,6 +130,7 @@ int patch_mode_init(EditState *s, ModeSavedData *saved_data)
     if (ret)
         return ret;
     set_colorize_func(s, patch_colorize_line);
+    set_colorize_resync_func(s, patch_resync_line);
     return ret;
 }
 
@@ -18,168 +18,46 @@
  */
 #include "qe.h"
 
-static const char py_keywords[] = 
-	"|def|break|continue|do|else|for|elif|try|except|pass|throw|"
-	"if|return|while|with|as|";
-
-/* NOTE: 'var' is added for javascript */
-static const char py_types[] = 
-"|char|double|float|int|long|unsigned|short|signed|void|var|"
-"u8|uint8_t|u16|uint16_t|u32|uint32_t|u64|uint64_t|";
+#include "pylang-kw.h"
+
+static const SyntaxDef py_syntax = {
+    line_comment: "#",
+    string_delims: "\"'",
+    escape_char: '\\',
+    keywords: &py_keywords,
+    types: &py_types,
+    flags: SYNTAX_IDENTIFIERS,
+};
 
-static int get_py_keyword(char *buf, int buf_size, unsigned int **pp)
+/* return TRUE if the 'len' chars at 'p' are a Python keyword or
+   builtin type */
+int py_is_keyword(const unsigned int *p, int len)
 {
-    unsigned int *p, c;
-    char *q;
-
-    p = *pp;
-    c = *p;
-    q = buf;
-    if ((c >= 'a' && c <= 'z') ||
-        (c >= 'A' && c <= 'Z') || 
-        (c == '_')) {
-        do {
-            if ((q - buf) < buf_size - 1)
-                *q++ = c;
-            p++;
-            c = *p;
-        } while ((c >= 'a' && c <= 'z') ||
-                 (c >= 'A' && c <= 'Z') ||
-                 (c == '_') ||
-                 (c >= '0' && c <= '9'));
-    }
-    *q = '\0';
-    *pp = p;
-    return q - buf;
+    return keyword_find(&py_keywords, p, len) ||
+        keyword_find(&py_types, p, len);
 }
 
-/* colorization states */
-enum {
-    PY_COMMENT = 1,
-    PY_STRING,
-    PY_STRING_Q,
-    PY_IF0,
-};
+/* tokens of a line without the margin highlight, for the indexer */
+void py_tokenize_line(unsigned int *buf, int len, int *colorize_state_ptr)
+{
+    syntax_tokenize_line(&py_syntax, buf, len, colorize_state_ptr, 0);
+}
 
 void py_colorize_line(unsigned int *buf, int len, 
 		      int *colorize_state_ptr, int state_only)
 {
-    int c, state, l, type_decl;
-    unsigned int *p, *p_start, *p1;
-    char kbuf[32];
-
-    state = *colorize_state_ptr;
-    p = buf;
-    p_start = p;
-    type_decl = 0;
-
-    /* if already in a state, go directly in the code parsing it */
-    switch(state) {
-    case PY_STRING:
-    case PY_STRING_Q:
-        goto parse_string;
-    default:
-        break;
-    }
+    syntax_colorize_line(&py_syntax, buf, len, colorize_state_ptr,
+                         state_only);
+}
 
-    for(;;) {
-        p_start = p;
-        c = *p;
-        switch(c) {
-        case '\n':
-            goto the_end;
-        case '#':
-	    /* line comment */
-	    while (*p != '\n') 
-		    p++;
-	    set_color(p_start, p - p_start, QE_STYLE_COMMENT);
-            break;
-        case '\'':
-            state = PY_STRING_Q;
-            goto string;
-        case '\"':
-            /* strings/chars */
-            state = PY_STRING;
-        string:
-            p++;
-        parse_string:
-            while (*p != '\n') {
-                if (*p == '\\') {
-                    p++;
-                    if (*p == '\n')
-                        break;
-                    p++;
-                } else if ((*p == '\'' && state == PY_STRING_Q) ||
-                           (*p == '\"' && state == PY_STRING)) {
-                    p++;
-                    state = 0;
-                    break;
-                } else {
-                    p++;
-                }
-            }
-            set_color(p_start, p - p_start, QE_STYLE_STRING);
-            break;
-        case '=':
-            p++;
-            /* exit type declaration */
-            type_decl = 0;
-            break;
-        default:
-            if ((c >= 'a' && c <= 'z') ||
-                (c >= 'A' && c <= 'Z') || 
-                (c == '_')) {
-                
-                l = get_py_keyword(kbuf + 1, sizeof(kbuf) - 2, &p);
-                kbuf[0] = '|';
-                kbuf[l + 1] = '|';
-                kbuf[l + 2] = '\0';
-                p1 = p;
-                if (strstr(py_keywords, kbuf)) {
-                    set_color(p_start, p1 - p_start, QE_STYLE_KEYWORD);
-                } else if (strstr(py_types, kbuf)) {
-                    /* c type */
-                    while (*p == ' ' || *p == '\t')
-                        p++;
-                    /* if not cast, assume type declaration */
-                    if (*p != ')') {
-                        type_decl = 1;
-                    }
-                    set_color(p_start, p1 - p_start, QE_STYLE_TYPE);
-                } else {
-		    type_decl = 1;
-
-                    if (type_decl) {
-                        while (*p == ' ' || *p == '\t')
-                            p++;
-                        if (*p == '(') {
-                            /* function definition case */
-                            set_color(p_start, p1 - p_start, QE_STYLE_FUNCTION);
-                            type_decl = 1;
-                        } else if (p_start == buf) {
-                            /* assume type if first column */
-                            set_color(p_start, p1 - p_start, QE_STYLE_TYPE);
-                        } else {
-                            set_color(p_start, p1 - p_start, QE_STYLE_VARIABLE);
-                        }
-                    }
-                }
-            } else {
-                p++;
-            }
-            break;
-        }
-    }
- the_end:
-    /* highlight the lines that overstep the margins */
-    if (g_highlight_over_margin && len > g_margin_size) {
-	    /* clear previous from margin to the end of line */
-	    clear_color(buf+g_margin_size, len - g_margin_size);
-	    set_color(buf+g_margin_size, len - g_margin_size,
-		      QE_STYLE_MARGIN_HIGHLIGHT);
-    }
+/* a statement at the first column cannot be inside a string */
+static int py_resync_line(unsigned int *buf, int len)
+{
+    unsigned int c = buf[0];
 
-    *colorize_state_ptr = state;
+    return (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z') ||
+        (c == '_');
 }
 
 #define MAX_BUF_SIZE    512
@@ -508,6 +386,7 @@ int py_mode_init(EditState *s, ModeSavedData *saved_data)
     if (ret)
         return ret;
     set_colorize_func(s, py_colorize_line);
+    set_colorize_resync_func(s, py_resync_line);
     return ret;
 }
 
@@ -71,6 +71,10 @@ static int screen_height = 0;
 #define DEFAULT_LINE_NUM_MODE		0
 #define DEFAULT_HIGHLIGHT_OVER_MARGIN	0
 #define DEFAULT_MARGIN_SIZE		80
+#define DEFAULT_MAX_FRAME_RATE		60
+#define DEFAULT_REDRAW_MAX_DELAY	100
+#define DEFAULT_COLORIZE_SYNC_LINES	2000
+#define DEFAULT_COLORIZE_SLICE		10
 
 int g_indent_size = DEFAULT_INDENT_SIZE;
 int g_tab_size = DEFAULT_TAB_SIZE;
@@ -78,6 +82,10 @@ int g_indent_tabs_mode = DEFAULT_INDENT_TABS_MODE;
 int g_line_num_mode = DEFAULT_LINE_NUM_MODE;
 int g_highlight_over_margin = DEFAULT_HIGHLIGHT_OVER_MARGIN;
 int g_margin_size = DEFAULT_MARGIN_SIZE;
+int g_max_frame_rate = DEFAULT_MAX_FRAME_RATE;
+int g_redraw_max_delay = DEFAULT_REDRAW_MAX_DELAY;
+int g_colorize_sync_lines = DEFAULT_COLORIZE_SYNC_LINES;
+int g_colorize_slice = DEFAULT_COLORIZE_SLICE;
 char g_backup_dir[PATH_MAX];
 /* mode handling */
 
@@ -893,7 +901,7 @@ int cursor_func(DisplayState *ds,
 
 void get_cursor_pos(EditState *s, CursorContext *m)
 {
-    DisplayState ds1, *ds = &ds1;
+    DisplayState *ds = s->display_state;
 
     display_init(ds, s, DISP_CURSOR);
     ds->cursor_opaque = m;
@@ -951,7 +959,7 @@ static int up_down_last_x = -1;
 void text_move_up_down(EditState *s, int dir)
 {
     MoveContext m1, *m = &m1;
-    DisplayState ds1, *ds = &ds1;
+    DisplayState *ds = s->display_state;
     CursorContext cm;
 
     if (s->qe_state->last_cmd_func != do_up_down)
@@ -1042,7 +1050,7 @@ void do_scroll_up_down(EditState *s, int dir)
 void perform_scroll_up_down(EditState *s, int h)
 {
     ScrollContext m1, *m = &m1;
-    DisplayState ds1, *ds = &ds1;
+    DisplayState *ds = s->display_state;
     int dir;
 
     if (h < 0)
@@ -1155,7 +1163,7 @@ static int left_right_cursor_func(DisplayState *ds,
 void text_move_left_right_visual(EditState *s, int dir)
 {
     LeftRightMoveContext m1, *m = &m1;
-    DisplayState ds1, *ds = &ds1;
+    DisplayState *ds = s->display_state;
     int xc, yc, nextline;
     CursorContext cm;
 
@@ -1267,7 +1275,7 @@ void text_mouse_goto(EditState *s, int x, int y)
 {
     QEmacsState *qs = s->qe_state;
     MouseGotoContext m1, *m = &m1;
-    DisplayState ds1, *ds = &ds1;
+    DisplayState *ds = s->display_state;
 
     m->dx_min = 0x3fffffff;
     m->dy_min = 0x3fffffff;
@@ -1390,8 +1398,7 @@ static void quote_grab_key(void *opaque, int key)
     if (!KEY_SPECIAL(key) ||
         (key >= 0 && key <= 31)) {
         do_char(s, key);
-        edit_display(qs);
-        dpy_flush(&global_screen);
+        edit_schedule_display(qs);
     }
     qe_ungrab_keys();
 }
@@ -1908,7 +1915,7 @@ void do_refresh(EditState *s);
    filename, modename) */
 void basic_mode_line(EditState *s, char *buf, int buf_size, int c1)
 {
-    int mod, state;
+    int mod, state, n, cur, complete;
     char *q;
 
     q = buf;
@@ -1933,6 +1940,14 @@ void basic_mode_line(EditState *s, char *buf, int buf_size, int c1)
     if (s->interactive)
         q += sprintf(q, " Interactive");
     q += sprintf(q, ")--");
+    if (s->b->search_index) {
+        /* match count of the current search */
+        n = search_index_count(s->b, &cur, &complete);
+        if (cur > 0)
+            q += sprintf(q, "[%d/%d%s]--", cur, n, complete ? "" : "+");
+        else
+            q += sprintf(q, "[%d%s]--", n, complete ? "" : "+");
+    }
 }
 
 char *get_date_time(void)
@@ -1984,7 +1999,7 @@ void text_mode_line(EditState *s, char *buf, int buf_size)
 
 void display_mode_line(EditState *s)
 {
-    char buf[512];
+    char buf[MAX_STATUS_SIZE];
 
     if (s->flags & WF_MODELINE) {
         s->mode->mode_line(s, buf, sizeof(buf));
@@ -2183,11 +2198,72 @@ void do_set_system_font(EditState *s, const char *qe_font_name,
 }
 
 
+/* minimum size of the display line buffers, in glyphs */
+#define DISPLAY_MIN_LINE_SIZE 256
+
+DisplayState *display_new(void)
+{
+    DisplayState *s;
+
+    s = malloc(sizeof(DisplayState));
+    if (!s)
+        return NULL;
+    memset(s, 0, sizeof(DisplayState));
+    return s;
+}
+
+void display_free(DisplayState *s)
+{
+    if (!s)
+        return;
+    free(s->fragments);
+    free(s->line_chars);
+    free(s->line_char_widths);
+    free(s->line_offsets);
+    free(s->line_hex_mode);
+    free(s);
+}
+
+/* grow the fragment and line buffers to 'size' glyphs. Return -1 if
+   allocation error (the previous buffers are kept) */
+static int display_realloc(DisplayState *s, int size)
+{
+    void *ptr;
+
+    if (size <= s->max_size)
+        return 0;
+    ptr = realloc(s->fragments, size * sizeof(TextFragment));
+    if (!ptr)
+        return -1;
+    s->fragments = ptr;
+    ptr = realloc(s->line_chars, size * sizeof(unsigned int));
+    if (!ptr)
+        return -1;
+    s->line_chars = ptr;
+    ptr = realloc(s->line_char_widths, size * sizeof(short));
+    if (!ptr)
+        return -1;
+    s->line_char_widths = ptr;
+    ptr = realloc(s->line_offsets, size * 2 * sizeof(int));
+    if (!ptr)
+        return -1;
+    s->line_offsets = ptr;
+    ptr = realloc(s->line_hex_mode, size);
+    if (!ptr)
+        return -1;
+    s->line_hex_mode = ptr;
+    s->max_size = size;
+    return 0;
+}
+
 void display_init(DisplayState *s, EditState *e, enum DisplayType do_disp)
 {
     QEFont *font;
     QEStyleDef style;
 
+    /* the line buffers must hold at least a full screen line */
+    display_realloc(s, max(DISPLAY_MIN_LINE_SIZE,
+                           e->screen->width + MAX_WORD_SIZE));
     s->do_disp = do_disp;
     s->wrap = e->wrap;
     s->edit_state = e;
@@ -2500,7 +2576,7 @@ static void flush_fragment(DisplayState *s)
 
     if (s->fragment_index == 0)
         return;
-    if (s->nb_fragments >= MAX_SCREEN_WIDTH)
+    if (s->nb_fragments >= s->max_size)
         goto the_end;
 
     /* update word start index if needed */
@@ -2511,7 +2587,7 @@ static void flush_fragment(DisplayState *s)
 
     /* convert fragment to glyphs (currently font independent, but may
        change) */
-    dst_max_size = MAX_SCREEN_WIDTH - s->line_index;
+    dst_max_size = s->max_size - s->line_index;
     if (dst_max_size <= 0)
         goto the_end;
     nb_glyphs = unicode_to_glyphs(s->line_chars + s->line_index,
@@ -2863,65 +2939,400 @@ static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
 /* NOTE: only one colorization mode can be selected at a time for a
    buffer */
 
-/* Gets the colorized line beginning at 'offset'. Its length
-   excluding '\n' is returned */
+#define COLORIZE_CHECKPOINT_LINES    128
+#define COLORIZE_LINE_SIZE           1024
+#define COLORIZE_IDLE_DELAY          20  /* delay between two slices, in ms */
+#define COLORIZE_RESYNC_LINES        1000 /* max lines scanned to estimate */
+
+static ColorizeCache *colorize_cache_get(EditBuffer *b,
+                                         ColorizeFunc colorize_func);
+
+/* add a valid checkpoint after the last valid one */
+static void colorize_cache_add_checkpoint(ColorizeCache *cc,
+                                          int line, int state)
+{
+    ColorizeCheckpoint *cp;
+    int n;
+
+    if (cc->colorize_nb_valid_checkpoints == cc->colorize_stale_index) {
+        /* no unused slot before the stale checkpoints */
+        if (cc->colorize_nb_checkpoints == cc->colorize_max_checkpoints) {
+            n = max(16, cc->colorize_max_checkpoints * 2);
+            cp = realloc(cc->colorize_checkpoints,
+                         n * sizeof(ColorizeCheckpoint));
+            if (!cp)
+                return; /* the state will be recomputed */
+            cc->colorize_checkpoints = cp;
+            cc->colorize_max_checkpoints = n;
+        }
+        cp = cc->colorize_checkpoints + cc->colorize_stale_index;
+        memmove(cp + 1, cp, (cc->colorize_nb_checkpoints -
+                             cc->colorize_stale_index) * sizeof(*cp));
+        cc->colorize_stale_index++;
+        cc->colorize_nb_checkpoints++;
+    }
+    cp = &cc->colorize_checkpoints[cc->colorize_nb_valid_checkpoints++];
+    cp->line = line;
+    cp->state = state;
+}
 
-#define COLORIZED_LINE_PREALLOC_SIZE 64
+/* apply the modifications done since the last colorization. The
+   checkpoints before the modified lines are kept, the ones after are
+   moved to follow the line number changes and kept as stale
+   checkpoints. */
+static void colorize_cache_invalidate(ColorizeCache *cc)
+{
+    ColorizeCheckpoint *cp;
+    int line_start, line_end, nb_lines, col, delta, stale_line;
+    int i, j, k, end;
 
-int get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
-                       int offset1, int line_num)
+    if (cc->colorize_max_valid_offset == MAXINT)
+        return;
+
+    eb_get_pos(cc->b, &line_start, &col, cc->colorize_max_valid_offset);
+    eb_get_pos(cc->b, &line_end, &col, cc->colorize_damage_end);
+    eb_get_pos(cc->b, &nb_lines, &col, cc->b->total_size);
+    delta = nb_lines - cc->colorize_nb_buffer_lines;
+    cc->colorize_nb_buffer_lines = nb_lines;
+    cc->colorize_max_valid_offset = MAXINT;
+    cc->colorize_damage_end = 0;
+
+    if (cc->colorize_cur_line > line_start)
+        cc->colorize_cur_line = -1;
+    if (cc->colorize_est_line > line_start)
+        cc->colorize_est_line = -1;
+
+    /* first line after the modified area, before the line shift */
+    stale_line = line_end + 1 - delta;
+    if (cc->colorize_stale_index < cc->colorize_nb_checkpoints) {
+        /* a previous modification did not converge yet: only its
+           stale checkpoints are kept */
+        stale_line = max(stale_line, cc->colorize_converge_line);
+        k = cc->colorize_stale_index;
+        end = cc->colorize_nb_checkpoints;
+    } else {
+        cp = cc->colorize_checkpoints;
+        if (cc->colorize_valid_line >= stale_line &&
+            cc->colorize_valid_line >
+            cp[cc->colorize_nb_valid_checkpoints - 1].line) {
+            /* keep the last state too */
+            colorize_cache_add_checkpoint(cc, cc->colorize_valid_line,
+                                          cc->colorize_valid_state);
+        }
+        k = 0;
+        end = cc->colorize_nb_valid_checkpoints;
+    }
+    cp = cc->colorize_checkpoints;
+    while (k < end && cp[k].line < stale_line)
+        k++;
+
+    /* the checkpoints before the modified lines stay valid (the first
+       one is always line 0) */
+    j = cc->colorize_nb_valid_checkpoints;
+    while (j > 1 && cp[j - 1].line > line_start)
+        j--;
+    if (k < j)
+        k = j;
+
+    for(i = k; i < end; i++)
+        cp[i].line += delta;
+    cc->colorize_nb_valid_checkpoints = j;
+    cc->colorize_stale_index = k;
+    cc->colorize_nb_checkpoints = end;
+    cc->colorize_converge_line = stale_line + delta;
+
+    if (cc->colorize_valid_line > line_start) {
+        cc->colorize_valid_line = cp[j - 1].line;
+        cc->colorize_valid_state = cp[j - 1].state;
+    }
+}
+
+/* store the state before line 'line', which follows the last valid
+   line. If it matches the stale state computed before the last
+   modification, the colorization has converged and all the stale
+   checkpoints are valid again. */
+static void colorize_cache_store(ColorizeCache *cc, int line,
+                                 int colorize_state)
+{
+    ColorizeCheckpoint *cp;
+    int n;
+
+    cc->colorize_valid_line = line;
+    cc->colorize_valid_state = colorize_state;
+
+    /* the stale checkpoints before the line are useless */
+    while (cc->colorize_stale_index < cc->colorize_nb_checkpoints &&
+           cc->colorize_checkpoints[cc->colorize_stale_index].line < line)
+        cc->colorize_stale_index++;
+
+    if (cc->colorize_stale_index < cc->colorize_nb_checkpoints) {
+        cp = &cc->colorize_checkpoints[cc->colorize_stale_index];
+        if (cp->line == line && line >= cc->colorize_converge_line &&
+            cp->state == colorize_state) {
+            n = cc->colorize_nb_checkpoints - cc->colorize_stale_index;
+            memmove(cc->colorize_checkpoints +
+                    cc->colorize_nb_valid_checkpoints, cp, n * sizeof(*cp));
+            cc->colorize_nb_valid_checkpoints += n;
+            cc->colorize_nb_checkpoints = cc->colorize_nb_valid_checkpoints;
+            cc->colorize_stale_index = cc->colorize_nb_checkpoints;
+            cp = &cc->colorize_checkpoints[cc->colorize_nb_checkpoints - 1];
+            cc->colorize_valid_line = cp->line;
+            cc->colorize_valid_state = cp->state;
+            return;
+        }
+    }
+
+    cp = &cc->colorize_checkpoints[cc->colorize_nb_valid_checkpoints - 1];
+    if (line - cp->line >= COLORIZE_CHECKPOINT_LINES)
+        colorize_cache_add_checkpoint(cc, line, colorize_state);
+}
+
+/* propagate the state up to line 'line_num'. If 'end_time' is not
+   zero, stop when the clock reaches it. Return TRUE if the state of
+   'line_num' is valid. */
+static int colorize_cache_advance(ColorizeCache *cc,
+                                  unsigned int *buf, int buf_size,
+                                  int line_num, int end_time)
 {
-    int len, l, line, col, offset;
-    int colorize_state;
-    unsigned char *ptr;
+    int len, l, offset, colorize_state, count;
 
-    /* invalidate cache if needed */
-    if (s->colorize_max_valid_offset != MAXINT) {
-        eb_get_pos(s->b, &line, &col, s->colorize_max_valid_offset);
-        line++;
-        if (line < s->colorize_nb_valid_lines)
-            s->colorize_nb_valid_lines = line;
-        s->colorize_max_valid_offset = MAXINT;
+    count = 0;
+    while (line_num > cc->colorize_valid_line) {
+        l = cc->colorize_valid_line;
+        offset = eb_goto_pos(cc->b, l, 0);
+        colorize_state = cc->colorize_valid_state;
+
+        /* stop when the state converges */
+        for(; l == cc->colorize_valid_line && l < line_num; l++) {
+            len = eb_get_line(cc->b, buf, buf_size - 1, &offset);
+            buf[len] = '\n';
+
+            cc->colorize_func(buf, len, &colorize_state, 1);
+
+            colorize_cache_store(cc, l + 1, colorize_state);
+            /* the clock is not read for each line */
+            if (end_time && (++count & 63) == 0 &&
+                get_clock_ms() - end_time >= 0)
+                return line_num <= cc->colorize_valid_line;
+        }
     }
+    return 1;
+}
+
+/* find the last checkpoint at or before 'line_num' in [start, end) */
+static ColorizeCheckpoint *colorize_cache_find(ColorizeCache *cc,
+                                               int start, int end,
+                                               int line_num)
+{
+    ColorizeCheckpoint *cp = cc->colorize_checkpoints;
+    int lo, hi, mid;
 
-    /* realloc line buffer if needed */
-    if ((line_num + 2) > s->colorize_nb_lines) {
-        s->colorize_nb_lines = line_num + 2 + COLORIZED_LINE_PREALLOC_SIZE;
-        ptr = realloc(s->colorize_states, s->colorize_nb_lines);
-        if (!ptr)
-            return 0;
-        s->colorize_states = ptr;
+    if (start >= end || cp[start].line > line_num)
+        return NULL;
+    lo = start;
+    hi = end - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) >> 1;
+        if (cp[mid].line <= line_num)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
+    return &cp[lo];
+}
 
-    /* propagate state if needed */
-    if (line_num >= s->colorize_nb_valid_lines) {
-        if (s->colorize_nb_valid_lines == 0) {
-            s->colorize_states[0] = 0; /* initial state : zero */
-            s->colorize_nb_valid_lines = 1;
+/* compute the state before line 'line_num' from the nearest
+   checkpoint. 'line_num' must be at or before the last valid line. */
+static int colorize_cache_get_state(ColorizeCache *cc,
+                                    unsigned int *buf, int buf_size,
+                                    int line_num)
+{
+    ColorizeCheckpoint *cp;
+    int len, l, offset, colorize_state;
+
+    if (line_num == cc->colorize_valid_line)
+        return cc->colorize_valid_state;
+
+    cp = colorize_cache_find(cc, 0, cc->colorize_nb_valid_checkpoints,
+                             line_num);
+    l = cp->line;
+    colorize_state = cp->state;
+    if (cc->colorize_cur_line >= l && cc->colorize_cur_line <= line_num) {
+        l = cc->colorize_cur_line;
+        colorize_state = cc->colorize_cur_state;
+    }
+    if (l < line_num) {
+        offset = eb_goto_pos(cc->b, l, 0);
+        for(; l < line_num; l++) {
+            len = eb_get_line(cc->b, buf, buf_size - 1, &offset);
+            buf[len] = '\n';
+            cc->colorize_func(buf, len, &colorize_state, 1);
         }
-        offset = eb_goto_pos(s->b, s->colorize_nb_valid_lines - 1, 0);
-        colorize_state = s->colorize_states[s->colorize_nb_valid_lines - 1];
+    }
+    return colorize_state;
+}
+
+/* estimate the state before line 'line_num' by colorizing from the
+   nearest resync line above it */
+static int colorize_cache_estimate(ColorizeCache *cc,
+                                   unsigned int *buf, int buf_size,
+                                   int line_num)
+{
+    int len, l, offset, colorize_state;
+
+    l = line_num - COLORIZE_RESYNC_LINES;
+    colorize_state = 0;
+    if (cc->colorize_est_line >= l && cc->colorize_est_line <= line_num) {
+        l = cc->colorize_est_line;
+        colorize_state = cc->colorize_est_state;
+    } else if (l <= cc->colorize_valid_line) {
+        l = cc->colorize_valid_line;
+        colorize_state = cc->colorize_valid_state;
+    }
+    offset = eb_goto_pos(cc->b, l, 0);
+    for(; l < line_num; l++) {
+        len = eb_get_line(cc->b, buf, buf_size - 1, &offset);
+        buf[len] = '\n';
+        if (cc->colorize_resync_func(buf, len))
+            colorize_state = 0;
+        cc->colorize_func(buf, len, &colorize_state, 1);
+    }
+    return colorize_state;
+}
+
+/* estimate the state before line 'line_num' from the stale checkpoint
+   'cp' above it. The lines in between are colorized, continuing from
+   the previous estimate if possible, and at most COLORIZE_RESYNC_LINES
+   of them. */
+static int colorize_cache_estimate_stale(ColorizeCache *cc,
+                                         unsigned int *buf, int buf_size,
+                                         int line_num, ColorizeCheckpoint *cp)
+{
+    int len, l, offset, colorize_state;
+
+    l = cp->line;
+    colorize_state = cp->state;
+    if (cc->colorize_est_line >= l && cc->colorize_est_line <= line_num) {
+        l = cc->colorize_est_line;
+        colorize_state = cc->colorize_est_state;
+    }
+    if (line_num - l > COLORIZE_RESYNC_LINES) {
+        if (cc->colorize_resync_func)
+            return colorize_cache_estimate(cc, buf, buf_size, line_num);
+        /* only the nearest lines are taken into account */
+        l = line_num - COLORIZE_RESYNC_LINES;
+    }
+    offset = eb_goto_pos(cc->b, l, 0);
+    for(; l < line_num; l++) {
+        len = eb_get_line(cc->b, buf, buf_size - 1, &offset);
+        buf[len] = '\n';
+        if (cc->colorize_resync_func && cc->colorize_resync_func(buf, len))
+            colorize_state = 0;
+        cc->colorize_func(buf, len, &colorize_state, 1);
+    }
+    return colorize_state;
+}
+
+/* colorize in time bounded slices while the editor is idle, then
+   redisplay the windows with the right colors */
+static void colorize_timer_cb(void *opaque)
+{
+    ColorizeCache *cc = opaque;
+    unsigned int buf[COLORIZE_LINE_SIZE];
+
+    /* the timer is freed by the caller */
+    cc->colorize_timer = NULL;
+
+    colorize_cache_invalidate(cc);
+    if (is_user_input_pending() ||
+        !colorize_cache_advance(cc, buf, COLORIZE_LINE_SIZE,
+                                cc->colorize_wanted_line,
+                                get_clock_ms() + g_colorize_slice)) {
+        cc->colorize_timer = qe_add_timer(COLORIZE_IDLE_DELAY, cc,
+                                          colorize_timer_cb);
+        return;
+    }
+    edit_schedule_background_display(&qe_state);
+}
 
-        for(l = s->colorize_nb_valid_lines; l <= line_num; l++) {
-            len = eb_get_line(s->b, buf, buf_size - 1, &offset);
+/* Gets the colorized line beginning at 'offset'. Its length
+   excluding '\n' is returned. If the colorization state of the line
+   is too far to be computed now, the line is colorized from the
+   initial state and the state is computed in background. */
+int get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
+                       int offset1, int line_num)
+{
+    ColorizeCache *cc = s->colorize_cache;
+    ColorizeCheckpoint *cp;
+    int len, estimated, estimated_line;
+    int colorize_state;
+
+    if (!cc) {
+        /* colorizer restored from the saved mode data */
+        cc = colorize_cache_get(s->b, s->colorize_func);
+        if (!cc) {
+            len = eb_get_line(s->b, buf, buf_size - 1, &offset1);
             buf[len] = '\n';
+            return len;
+        }
+        s->colorize_cache = cc;
+    }
 
-            s->colorize_func(buf, len, &colorize_state, 1);
+    /* invalidate cache if needed */
+    colorize_cache_invalidate(cc);
 
-            s->colorize_states[l] = colorize_state;
+    /* propagate state if needed */
+    estimated = 0;
+    estimated_line = line_num;
+    if (line_num - cc->colorize_valid_line < g_colorize_sync_lines &&
+        colorize_cache_advance(cc, buf, buf_size, line_num, 0)) {
+        colorize_state = colorize_cache_get_state(cc, buf, buf_size,
+                                                  line_num);
+    } else {
+        /* estimated state until the background colorization reaches
+           the line */
+        cp = colorize_cache_find(cc, cc->colorize_stale_index,
+                                 cc->colorize_nb_checkpoints, line_num);
+        if (cp) {
+            colorize_state = colorize_cache_estimate_stale(cc, buf,
+                                                           buf_size,
+                                                           line_num, cp);
+            estimated = 1;
+        } else if (cc->colorize_resync_func) {
+            colorize_state = colorize_cache_estimate(cc, buf, buf_size,
+                                                     line_num);
+            estimated = 1;
+        } else {
+            colorize_state = 0;
+        }
+        if (line_num > cc->colorize_wanted_line)
+            cc->colorize_wanted_line = line_num;
+        if (!cc->colorize_timer) {
+            cc->colorize_timer = qe_add_timer(COLORIZE_IDLE_DELAY, cc,
+                                              colorize_timer_cb);
         }
+        line_num = -1;
     }
 
     /* compute line color */
     len = eb_get_line(s->b, buf, buf_size - 1, &offset1);
     buf[len] = '\n';
 
-    colorize_state = s->colorize_states[line_num];
-    s->colorize_func(buf, len, &colorize_state, 0);
-
-    s->colorize_states[line_num + 1] = colorize_state;
+    if (estimated && cc->colorize_resync_func &&
+        cc->colorize_resync_func(buf, len))
+        colorize_state = 0;
+    cc->colorize_func(buf, len, &colorize_state, 0);
 
-    s->colorize_nb_valid_lines = line_num + 2;
+    if (estimated) {
+        cc->colorize_est_line = estimated_line + 1;
+        cc->colorize_est_state = colorize_state;
+    }
+    if (line_num >= 0) {
+        if (line_num == cc->colorize_valid_line)
+            colorize_cache_store(cc, line_num + 1, colorize_state);
+        cc->colorize_cur_line = line_num + 1;
+        cc->colorize_cur_state = colorize_state;
+    }
     return len;
 }
 
@@ -2932,35 +3343,134 @@ static void colorize_callback(EditBuffer *b,
                               int offset,
                               int size)
 {
-    EditState *e = opaque;
+    ColorizeCache *cc = opaque;
+    int end;
 
-    if (offset < e->colorize_max_valid_offset)
-        e->colorize_max_valid_offset = offset;
+    /* the modified area is moved like the other offsets */
+    switch(op) {
+    case LOGOP_INSERT:
+        if (cc->colorize_damage_end > offset)
+            cc->colorize_damage_end += size;
+        end = offset + size;
+        break;
+    case LOGOP_DELETE:
+        if (cc->colorize_damage_end > offset) {
+            cc->colorize_damage_end -= size;
+            if (cc->colorize_damage_end < offset)
+                cc->colorize_damage_end = offset;
+        }
+        end = offset;
+        break;
+    default:
+        end = offset + size;
+        break;
+    }
+    if (end > cc->colorize_damage_end)
+        cc->colorize_damage_end = end;
+    if (offset < cc->colorize_max_valid_offset)
+        cc->colorize_max_valid_offset = offset;
+}
+
+/* find or create the colorization states of 'b' for 'colorize_func' */
+static ColorizeCache *colorize_cache_get(EditBuffer *b,
+                                         ColorizeFunc colorize_func)
+{
+    ColorizeCache *cc;
+    int col;
+
+    for(cc = b->first_colorize_cache; cc != NULL; cc = cc->next) {
+        if (cc->colorize_func == colorize_func) {
+            cc->ref_count++;
+            return cc;
+        }
+    }
+    cc = malloc(sizeof(ColorizeCache));
+    if (!cc)
+        return NULL;
+    memset(cc, 0, sizeof(ColorizeCache));
+    cc->colorize_func = colorize_func;
+    cc->b = b;
+    cc->ref_count = 1;
+    cc->colorize_max_valid_offset = MAXINT;
+    eb_get_pos(b, &cc->colorize_nb_buffer_lines, &col, b->total_size);
+    /* initial state : zero */
+    cc->colorize_checkpoints = malloc(16 * sizeof(ColorizeCheckpoint));
+    if (!cc->colorize_checkpoints) {
+        free(cc);
+        return NULL;
+    }
+    cc->colorize_checkpoints[0].line = 0;
+    cc->colorize_checkpoints[0].state = 0;
+    cc->colorize_max_checkpoints = 16;
+    cc->colorize_nb_checkpoints = 1;
+    cc->colorize_nb_valid_checkpoints = 1;
+    cc->colorize_stale_index = 1;
+    cc->colorize_cur_line = -1;
+    cc->colorize_est_line = -1;
+    if (eb_add_callback(b, colorize_callback, cc) < 0) {
+        free(cc->colorize_checkpoints);
+        free(cc);
+        return NULL;
+    }
+    cc->next = b->first_colorize_cache;
+    b->first_colorize_cache = cc;
+    return cc;
+}
+
+static void colorize_cache_release(EditBuffer *b, ColorizeCache *cc)
+{
+    ColorizeCache **pcc;
+
+    if (--cc->ref_count > 0)
+        return;
+    eb_free_callback(b, colorize_callback, cc);
+    if (cc->colorize_timer)
+        qe_kill_timer(cc->colorize_timer);
+    for(pcc = &b->first_colorize_cache; *pcc != NULL; pcc = &(*pcc)->next) {
+        if (*pcc == cc) {
+            *pcc = cc->next;
+            break;
+        }
+    }
+    free(cc->colorize_checkpoints);
+    free(cc);
 }
 
 void set_colorize_func(EditState *s, ColorizeFunc colorize_func)
 {
-    /* invalidate the previous states & free previous colorizer */
-    eb_free_callback(s->b, colorize_callback, s);
-    free(s->colorize_states);
-    s->colorize_states = NULL;
-    s->colorize_nb_lines = 0;
-    s->colorize_nb_valid_lines = 0;
-    s->colorize_max_valid_offset = MAXINT;
+    /* release the previous states & free previous colorizer */
+    if (s->colorize_cache) {
+        colorize_cache_release(s->b, s->colorize_cache);
+        s->colorize_cache = NULL;
+    }
     s->get_colorized_line_func = NULL;
     s->colorize_func = NULL;
 
     if (colorize_func) {
-        eb_add_callback(s->b, colorize_callback, s);
+        s->colorize_cache = colorize_cache_get(s->b, colorize_func);
+        if (!s->colorize_cache)
+            return;
         s->get_colorized_line_func = get_colorized_line;
         s->colorize_func = colorize_func;
     }
 }
 
+/* the resync lines are shared by all the windows using the same
+   colorizer on the buffer */
+void set_colorize_resync_func(EditState *s, ColorizeResyncFunc resync_func)
+{
+    if (s->colorize_cache)
+        s->colorize_cache->colorize_resync_func = resync_func;
+}
+
 #else
 void set_colorize_func(EditState *s, ColorizeFunc colorize_func)
 {
 }
+
+void set_colorize_resync_func(EditState *s, ColorizeResyncFunc resync_func)
+{
+}
 #endif
 
 #define RLE_EMBEDDINGS_SIZE    128
@@ -2969,7 +3479,7 @@ void set_colorize_func(EditState *s, ColorizeFunc colorize_func)
 int text_display(EditState *s, DisplayState *ds, int offset)
 {
     int c;
-    int offset0, offset1, line_num, col_num;
+    int offset0, offset1, offset2, line_num, col_num;
     TypeLink embeds[RLE_EMBEDDINGS_SIZE], *bd;
     int embedding_level, embedding_max_level;
     FriBidiCharType base;
@@ -3034,6 +3544,18 @@ int text_display(EditState *s, DisplayState *ds, int offset)
         colored_nb_chars = 0;
     }
 
+    /* highlight the search matches */
+    if (s->b->search_index) {
+        if (!s->get_colorized_line_func) {
+            offset2 = offset;
+            colored_nb_chars = eb_get_line(s->b, colored_chars,
+                                           COLORED_MAX_LINE_SIZE - 1,
+                                           &offset2);
+        }
+        search_index_highlight(s->b, colored_chars, colored_nb_chars,
+                               offset);
+    }
+
     bd = embeds + 1;
     char_index = 0;
     for(;;) {
@@ -3081,7 +3603,7 @@ int text_display(EditState *s, DisplayState *ds, int offset)
 void generic_text_display(EditState *s)
 {
     CursorContext m1, *m = &m1;
-    DisplayState ds1, *ds = &ds1;
+    DisplayState *ds = s->display_state;
     int x1, xc, yc, offset;
 
     /* if the cursor is before the top of the display zone, we must
@@ -3567,6 +4089,159 @@ void edit_display(QEmacsState *qs)
     }
 }
 
+/* Redraw scheduler: while keys are queued, the display is deferred
+   and coalesced to at most 'g_max_frame_rate' frames per second. A
+   frame is always painted at most 'g_redraw_max_delay' ms after the
+   first key which is not displayed yet. The background updates
+   (process output, colorization, searches) share the same frames
+   but are not counted in the input latency. */
+
+typedef struct RedrawState {
+    QETimer *timer;  /* deferred display, NULL if none */
+    int deferred;    /* true if the next frame was deferred */
+    int pending;     /* true if some keys are not displayed yet */
+    int input_time;  /* time of the first key not displayed yet */
+    int frame_time;  /* time of the last painted frame */
+    /* statistics */
+    int nb_frames;
+    int nb_skipped;
+    int latency_last;
+    int latency_max;
+    int64_t latency_sum;
+    int nb_latencies;
+} RedrawState;
+
+static RedrawState redraw_state;
+
+/* display all windows now */
+static void redraw_flush(QEmacsState *qs)
+{
+    RedrawState *rs = &redraw_state;
+    int now, latency;
+
+    if (rs->timer) {
+        qe_kill_timer(rs->timer);
+        rs->timer = NULL;
+    }
+    edit_display(qs);
+    dpy_flush(qs->screen);
+
+    now = get_clock_ms();
+    if (rs->pending) {
+        latency = now - rs->input_time;
+        rs->latency_last = latency;
+        if (latency > rs->latency_max)
+            rs->latency_max = latency;
+        rs->latency_sum += latency;
+        rs->nb_latencies++;
+        rs->pending = 0;
+    }
+    rs->frame_time = now;
+    rs->nb_frames++;
+    rs->deferred = 0;
+}
+
+static void redraw_schedule(QEmacsState *qs);
+
+static void redraw_timer_cb(void *opaque)
+{
+    /* the timer is freed by the caller */
+    redraw_state.timer = NULL;
+    redraw_schedule(opaque);
+}
+
+static int redraw_input_pending(void)
+{
+    QEditScreen *s = &global_screen;
+
+    if (!s->dpy.dpy_is_user_input_pending)
+        return 0;
+    return s->dpy.dpy_is_user_input_pending(s);
+}
+
+/* paint the next frame now or defer it */
+static void redraw_schedule(QEmacsState *qs)
+{
+    RedrawState *rs = &redraw_state;
+    int now, delay;
+
+    now = get_clock_ms();
+    delay = 0;
+    if (!rs->pending || now - rs->input_time < g_redraw_max_delay) {
+        if (rs->pending && redraw_input_pending()) {
+            /* more keys are coming: wait for them until the deadline */
+            delay = g_redraw_max_delay - (now - rs->input_time);
+        } else if (g_max_frame_rate > 0) {
+            delay = rs->frame_time + 1000 / g_max_frame_rate - now;
+        }
+    }
+    if (delay <= 0) {
+        redraw_flush(qs);
+        return;
+    }
+    /* a frame deferred several times is skipped once */
+    if (!rs->deferred) {
+        rs->deferred = 1;
+        rs->nb_skipped++;
+    }
+    if (rs->timer)
+        qe_kill_timer(rs->timer);
+    rs->timer = qe_add_timer(delay, qs, redraw_timer_cb);
+    if (!rs->timer)
+        redraw_flush(qs);
+}
+
+/* request a display after a key was handled */
+void edit_schedule_display(QEmacsState *qs)
+{
+    RedrawState *rs = &redraw_state;
+
+    if (!rs->pending) {
+        rs->pending = 1;
+        rs->input_time = get_clock_ms();
+    }
+    redraw_schedule(qs);
+}
+
+/* request a display after a change which is not due to a key, such
+   as process output or a background task */
+void edit_schedule_background_display(QEmacsState *qs)
+{
+    redraw_schedule(qs);
+}
+
+void do_global_set_max_frame_rate(EditState *s, int rate)
+{
+    if (rate >= 0)
+        g_max_frame_rate = rate;
+}
+
+void do_global_set_redraw_delay(EditState *s, int delay)
+{
+    if (delay >= 0)
+        g_redraw_max_delay = delay;
+}
+
+void do_global_set_colorize_sync_lines(EditState *s, int nb_lines)
+{
+    if (nb_lines >= 0)
+        g_colorize_sync_lines = nb_lines;
+}
+
+void do_show_redraw_stats(EditState *s)
+{
+    RedrawState *rs = &redraw_state;
+    int avg;
+
+    avg = 0;
+    if (rs->nb_latencies > 0)
+        avg = rs->latency_sum / rs->nb_latencies;
+    put_status(s, "Frames: %d painted, %d skipped; "
+               "input latency: last %d ms, avg %d ms, max %d ms",
+               rs->nb_frames, rs->nb_skipped,
+               rs->latency_last, avg, rs->latency_max);
+}
+
 void do_universal_argument(EditState *s)
 {
     /* nothing is done there (see qe_key_process()) */
@@ -3752,7 +4427,9 @@ static void qe_key_process(int key)
     s = qs->active_window;
     if (!s->minibuf) {
         put_status(s, "");
-        dpy_flush(&global_screen);
+        /* the status is flushed with the next frame if keys are queued */
+        if (!redraw_state.timer)
+            dpy_flush(&global_screen);
     }
 
     /* special case for escape : we transform it as meta so
@@ -3837,8 +4514,7 @@ static void qe_key_process(int key)
                 exec_command(s, d, c->argval);
             }
             qe_key_init();
-            edit_display(qs);
-            dpy_flush(&global_screen);
+            edit_schedule_display(qs);
             return;
         }
     }
@@ -3856,12 +4532,68 @@ static void qe_key_process(int key)
     }
 }
 
+/* Insert text pasted in the terminal. If possible, it is inserted
+   with a single buffer modification, so that it is fast and undone in
+   one step. Otherwise it is handled as typed keys. */
+static void qe_paste_process(const unsigned char *data, int len)
+{
+    QEmacsState *qs = &qe_state;
+    QEKeyContext *c = &key_ctx;
+    EditState *s = qs->active_window;
+    CharsetDecodeState decode;
+    const unsigned char *p, *p_end;
+    unsigned char *buf, *q;
+    int ch, fast;
+
+    if (len <= 0 || !s)
+        return;
+
+    fast = (!c->grab_key_cb && c->nb_keys == 0 && !qs->defining_macro &&
+            !s->minibuf && s->insert && !s->input_method &&
+            s->mode->write_char == text_write_char);
+    buf = NULL;
+    if (fast) {
+        if (s->b->flags & BF_READONLY) {
+            put_status(s, "Buffer is read only");
+            edit_schedule_display(qs);
+            return;
+        }
+        buf = malloc(len * MAX_CHAR_BYTES + 1);
+    }
+
+    charset_decode_init(&decode, qs->screen->charset);
+    p = data;
+    p_end = data + len;
+    q = buf;
+    while (p < p_end) {
+        ch = charset_decode(&decode, &p);
+        if (!buf) {
+            qe_key_process(ch);
+            continue;
+        }
+        if (ch == '\r') {
+            ch = '\n';
+            if (p < p_end && *p == '\n')
+                p++;
+        }
+        q += unicode_to_charset(q, ch, s->b->charset);
+    }
+    charset_decode_close(&decode);
+
+    if (buf) {
+        eb_insert(s->b, s->offset, buf, q - buf);
+        s->offset += q - buf;
+        free(buf);
+        edit_schedule_display(qs);
+    }
+}
+
 /* Print in latin 1 charset */
 void print_at_byte(QEditScreen *screen,
                    int x, int y, int width, int height,
                    const char *str, int style_index)
 {
-    unsigned int ubuf[256];
+    unsigned int ubuf[MAX_STATUS_SIZE];
     int len;
     QEStyleDef style;
     QEFont *font;
@@ -3887,7 +4619,7 @@ void print_at_byte(QEditScreen *screen,
 
 void put_status(EditState *s, const char *fmt, ...)
 {
-    char buf[MAX_SCREEN_WIDTH];
+    char buf[MAX_STATUS_SIZE];
     va_list ap;
 
     va_start(ap, fmt);
@@ -3997,6 +4729,11 @@ EditState *edit_new(EditBuffer *b,
     if (!s)
         return NULL;
     memset(s, 0, sizeof(EditState));
+    s->display_state = display_new();
+    if (!s->display_state) {
+        free(s);
+        return NULL;
+    }
     s->qe_state = qs;
     s->screen = qs->screen;
     s->x1 = x1;
@@ -4041,6 +4778,7 @@ void edit_close(EditState *s)
         qs->active_window = qs->first_window;
 
     free(s->line_shadow);
+    display_free(s->display_state);
     free(s);
 }
 
@@ -4974,102 +5712,6 @@ static void quit_confirm_cb(void *opaque, char *reply)
     free(reply);
 }
 
-
-#define SEARCH_FLAG_IGNORECASE 0x0001
-#define SEARCH_FLAG_SMARTCASE  0x0002 /* case sensitive if upper case present */
-#define SEARCH_FLAG_WORD       0x0004
-
-/* XXX: OPTIMIZE ! */
-/* XXX: use UTF8 for words/chars ? */
-int eb_search(EditBuffer *b, int offset, int dir, u8 *buf, int size,
-              int flags, CSSAbortFunc *abort_func, void *abort_opaque)
-{
-    int total_size = b->total_size;
-    int i, c, lower_count, upper_count;
-    unsigned char ch;
-    u8 buf1[1024];
-
-    if (size == 0 || size >= sizeof(buf1))
-        return -1;
-
-    /* analyse buffer if smart case */
-    if (flags & SEARCH_FLAG_SMARTCASE) {
-        upper_count = 0;
-        lower_count = 0;
-        for(i=0;i<size;i++) {
-            c = buf[i];
-            lower_count += islower(c);
-            upper_count += isupper(c);
-        }
-        if (lower_count > 0 && upper_count == 0)
-            flags |= SEARCH_FLAG_IGNORECASE;
-    }
-
-    /* copy buffer */
-    for(i=0;i<size;i++) {
-        c = buf[i];
-        if (flags & SEARCH_FLAG_IGNORECASE)
-            buf1[i] = toupper(c);
-        else
-            buf1[i] = c;
-    }
-
-    if (dir < 0) {
-        if (offset > (total_size - size))
-            offset = total_size - size;
-    } else {
-        offset--;
-    }
-
-    for(;;) {
-        offset += dir;
-        if (offset < 0)
-            return -1;
-        if (offset > (total_size - size))
-            return -1;
-        /* search abort */
-        if ((offset & 0xfff) == 0) {
-            if (abort_func && abort_func(abort_opaque))
-                return -1;
-        }
-
-        /* search start of word */
-        if (flags & SEARCH_FLAG_WORD) {
-            if (offset == 0)
-                goto word_start_found;
-            eb_read(b, offset - 1, &ch, 1);
-            if (!isword(ch))
-                goto word_start_found;
-            else
-                continue;
-        }
-
-    word_start_found:
-        i = 0;
-        for(;;) {
-            eb_read(b, offset + i, &ch, 1);
-            if (flags & SEARCH_FLAG_IGNORECASE)
-                ch = toupper(ch);
-            if (ch != buf1[i])
-                    break;
-            i++;
-            if (i == size) {
-                /* check end of word */
-                if (flags & SEARCH_FLAG_WORD) {
-                    if (offset + size >= total_size)
-                        goto word_end_found;
-                    eb_read(b, offset + size, &ch, 1);
-                    if (!isword(ch))
-                        goto word_end_found;
-                    break;
-                }
-            word_end_found:
-                return offset;
-            }
-        }
-    }
-}
-
 void usprintf(char **pp, const char *fmt, ...)
 {
     char *q = *pp;
@@ -5095,15 +5737,27 @@ int search_abort_func(void *opaque)
     return is_user_input_pending();
 }
 
+/* search result after each char of the search string */
+typedef struct ISearchResult {
+    int found_offset;
+    int offset;         /* cursor position */
+    int len;            /* length of the searched bytes, -1 if the
+                           result is not known */
+    int dir;
+    const char *error;
+} ISearchResult;
+
 typedef struct ISearchState {
     EditState *s;
     int start_offset;
     int dir;
     int pos;
-    int stack_ptr;
+    int stack_ptr;      /* 'stack' holds the results of the 'stack_ptr'
+                           first chars */
     int search_flags;
     int found_offset;
     unsigned int search_string[SEARCH_LENGTH];
+    ISearchResult stack[SEARCH_LENGTH + 1];
 } ISearchState;
 
 static void isearch_display(ISearchState *is)
@@ -5113,8 +5767,11 @@ static void isearch_display(ISearchState *is)
     u8 buf[2*SEARCH_LENGTH], *q; /* XXX: incorrect size */
     int i, len, hex_nibble, h;
     unsigned int v;
-    int search_offset;
+    int search_offset, end;
     int flags;
+    QERegex *re;
+    const char *error;
+    ISearchResult *r;
 
     /* prepare the search bytes */
     q = buf;
@@ -5142,18 +5799,80 @@ static void isearch_display(ISearchState *is)
         }
     }
     len = q - buf;
+    error = NULL;
+    flags = is->search_flags;
+    if (s->hex_mode)
+        flags = 0;
+    r = &is->stack[is->pos];
+    if (is->pos <= is->stack_ptr) {
+        /* the string was shortened: restore the result if known */
+        if (r->len >= 0) {
+            is->found_offset = r->found_offset;
+            s->offset = r->offset;
+            error = r->error;
+            is->stack_ptr = is->pos;
+            goto display;
+        }
+        is->stack_ptr = is->pos - 1;
+    }
+    if (is->pos == is->stack_ptr + 1 && is->pos >= 2 && !s->hex_mode &&
+        !(is->search_flags & (SEARCH_FLAG_WORD | SEARCH_FLAG_REGEX)) &&
+        !(is->search_string[is->pos - 1] & FOUND_TAG) &&
+        r[-1].len > 0 && r[-1].dir == is->dir) {
+        /* the string was extended: its matches are matches of the
+           previous string, so the search continues from the previous
+           match */
+        if (r[-1].found_offset < 0) {
+            is->found_offset = -1;
+            goto save;
+        }
+        if (is->dir < 0)
+            search_offset = r[-1].found_offset + 1;
+        else
+            search_offset = r[-1].found_offset;
+    }
     if (len == 0) {
         s->offset = is->start_offset;
         is->found_offset = -1;
+    } else if (flags & SEARCH_FLAG_REGEX) {
+        is->found_offset = -1;
+        re = regex_compile(buf, len, flags, &error);
+        if (re) {
+            is->found_offset = eb_regex_search(s->b, re, search_offset,
+                                               is->dir, &end,
+                                               search_abort_func, NULL);
+            if (is->found_offset >= 0)
+                s->offset = end;
+            regex_free(re);
+        }
     } else {
-        flags = is->search_flags;
-        if (s->hex_mode)
-            flags = 0;
         is->found_offset = eb_search(s->b, search_offset, is->dir, buf, len,
                                      flags, search_abort_func, NULL);
         if (is->found_offset >= 0)
             s->offset = is->found_offset + len;
     }
+    /* an aborted search is not a failure */
+    if (is->found_offset < 0 && len > 0 && !error && is_user_input_pending())
+        goto display;
+
+ save:
+    for(i = is->stack_ptr + 1; i < is->pos; i++)
+        is->stack[i].len = -1;
+    r->found_offset = is->found_offset;
+    r->offset = s->offset;
+    r->len = len;
+    r->dir = is->dir;
+    r->error = error;
+    is->stack_ptr = is->pos;
+
+ display:
+    /* highlight all the matches */
+    if (len > 0 && !error) {
+        search_index_set(s->b, buf, len, flags, is->found_offset,
+                         is->found_offset >= 0 ? s->offset : -1);
+    } else {
+        search_index_free(s->b);
+    }
 
     /* display search string */
     uq = ubuf;
@@ -5168,6 +5887,8 @@ static void isearch_display(ISearchState *is)
             usprintf(&uq, "case-insensitive ");
         else if (!(is->search_flags & SEARCH_FLAG_SMARTCASE))
             usprintf(&uq, "case-sensitive ");
+        if (is->search_flags & SEARCH_FLAG_REGEX)
+            usprintf(&uq, "regexp ");
     }
     usprintf(&uq, "I-search");
     if (is->dir < 0)
@@ -5180,14 +5901,13 @@ static void isearch_display(ISearchState *is)
         }
     }
     *uq = '\0';
+    if (error)
+        usprintf(&uq, " [%s]", error);
 
         /* display text */
     center_cursor(s);
-    edit_display(s->qe_state);
-
     put_status(NULL, ubuf);
-
-    dpy_flush(s->screen);
+    edit_schedule_display(s->qe_state);
 }
 
 static void isearch_key(void *opaque, int ch)
@@ -5214,6 +5934,7 @@ static void isearch_key(void *opaque, int ch)
             }
             last_search_string_len = j;
         }
+        search_index_free(s->b);
         qe_ungrab_keys();
         free(is);
         return;
@@ -5232,6 +5953,8 @@ static void isearch_key(void *opaque, int ch)
             /* add the match position, if any */
             if (is->pos < SEARCH_LENGTH && is->found_offset >= 0)
                 is->search_string[is->pos++] = FOUND_TAG | is->found_offset;
+            else
+                is->stack_ptr = is->pos - 1; /* search again */
         }
         break;
 #if 0
@@ -5246,10 +5969,16 @@ static void isearch_key(void *opaque, int ch)
         /* case / word */
     case KEY_CTRL('w'):
         is->search_flags ^= SEARCH_FLAG_WORD;
+        is->stack_ptr = 0;
         break;
     case KEY_CTRL('c'):
         is->search_flags ^= SEARCH_FLAG_IGNORECASE;
         is->search_flags &= ~SEARCH_FLAG_SMARTCASE;
+        is->stack_ptr = 0;
+        break;
+    case KEY_META('r'):
+        is->search_flags ^= SEARCH_FLAG_REGEX;
+        is->stack_ptr = 0;
         break;
     default:
         if (KEY_SPECIAL(ch)) {
@@ -5272,7 +6001,7 @@ static void isearch_key(void *opaque, int ch)
 }
 
 /* XXX: handle busy */
-void do_isearch(EditState *s, int dir)
+static void isearch_start(EditState *s, int dir, int flags)
 {
     ISearchState *is;
 
@@ -5284,12 +6013,27 @@ void do_isearch(EditState *s, int dir)
     is->dir = dir;
     is->pos = 0;
     is->stack_ptr = 0;
-    is->search_flags = SEARCH_FLAG_SMARTCASE;
+    is->search_flags = flags;
+    is->stack[0].found_offset = -1;
+    is->stack[0].offset = s->offset;
+    is->stack[0].len = 0;
+    is->stack[0].dir = dir;
+    is->stack[0].error = NULL;
 
     qe_grab_keys(isearch_key, is);
     isearch_display(is);
 }
 
+void do_isearch(EditState *s, int dir)
+{
+    isearch_start(s, dir, SEARCH_FLAG_SMARTCASE);
+}
+
+void do_isearch_regexp(EditState *s, int dir)
+{
+    isearch_start(s, dir, SEARCH_FLAG_SMARTCASE | SEARCH_FLAG_REGEX);
+}
+
 static int to_bytes(EditState *s1, u8 *dst, int dst_size, const char *str)
 {
     const char *s;
@@ -5327,11 +6071,47 @@ static int to_bytes(EditState *s1, u8 *dst, int dst_size, const char *str)
     }
 }
 
+/* search a regexp and move to the end of the match, or to its start
+   when searching backward */
+void do_re_search(EditState *s, int dir, const char *str)
+{
+    u8 buf[SEARCH_MAX_SIZE];
+    QERegex *re;
+    const char *error;
+    int len, start, end;
+
+    len = to_bytes(s, buf, sizeof(buf), str);
+    re = regex_compile(buf, len, SEARCH_FLAG_SMARTCASE, &error);
+    if (!re) {
+        put_status(s, "Invalid regexp: %s", error);
+        return;
+    }
+    start = eb_regex_search(s->b, re, s->offset, dir, &end,
+                            search_abort_func, NULL);
+    regex_free(re);
+    if (start < 0) {
+        put_status(s, "Search failed: \"%s\"", str);
+        return;
+    }
+    if (dir < 0)
+        s->offset = start;
+    else
+        s->offset = end;
+}
+
 typedef struct QueryReplaceState {
     EditState *s;
+    EditBuffer *b;
     int nb_reps;
     int search_bytes_len, replace_bytes_len, found_offset;
+    int found_end;
+    QERegex *regex; /* NULL if plain string search */
     int replace_all;
+    int bulk_reps, bulk_time; /* bulk replacement statistics */
+    /* if not NULL, called at the end instead of showing the status */
+    QueryReplaceCB *cb;
+    void *opaque;
+    int status;
     char search_str[SEARCH_LENGTH];
     char replace_str[SEARCH_LENGTH];
     u8 search_bytes[SEARCH_LENGTH];
@@ -5341,50 +6121,270 @@ typedef struct QueryReplaceState {
 static void query_replace_abort(QueryReplaceState *is)
 {
     EditState *s = is->s;
+    QueryReplaceCB *cb = is->cb;
+    void *opaque = is->opaque;
+    int status = is->status, nb_reps = is->nb_reps;
 
     qe_ungrab_keys();
-    put_status(NULL, "Replaced %d occurrences", is->nb_reps);
+    if (cb) {
+        /* the caller shows its own status */
+    } else if (is->bulk_reps > 0) {
+        put_status(NULL, "Replaced %d occurrences (%d/s)", is->nb_reps,
+                   (int)(is->bulk_reps * 1000LL / max(is->bulk_time, 1)));
+    } else {
+        put_status(NULL, "Replaced %d occurrences", is->nb_reps);
+    }
+    regex_free(is->regex);
     free(is);
     edit_display(s->qe_state);
     dpy_flush(&global_screen);
+    if (cb)
+        cb(opaque, status, nb_reps);
+}
+
+/* build the replacement of a regexp match: '\&' or '\0' is replaced
+   by the whole match and '\1' to '\9' by the groups */
+static u8 *query_replace_expand(QueryReplaceState *is, int *len_ptr)
+{
+    EditBuffer *b = is->b;
+    int groups[2 * REGEX_MAX_GROUPS];
+    const u8 *p, *end;
+    u8 *buf;
+    int pass, len, c, n, nb_groups;
+
+    nb_groups = eb_regex_groups(b, is->regex, is->found_offset,
+                                is->found_end, groups);
+    buf = NULL;
+    len = 0;
+    for(pass = 0; pass < 2; pass++) {
+        len = 0;
+        p = is->replace_bytes;
+        end = p + is->replace_bytes_len;
+        for(; p < end; p++) {
+            c = *p;
+            if (c == '\\' && p + 1 < end) {
+                c = *++p;
+                if (c == '&')
+                    c = '0';
+                if (c >= '0' && c <= '9') {
+                    n = c - '0';
+                    if (n < nb_groups && groups[2 * n] >= 0) {
+                        if (pass)
+                            eb_read(b, groups[2 * n], buf + len,
+                                    groups[2 * n + 1] - groups[2 * n]);
+                        len += groups[2 * n + 1] - groups[2 * n];
+                    }
+                    continue;
+                }
+            }
+            if (pass)
+                buf[len] = c;
+            len++;
+        }
+        if (!pass) {
+            buf = malloc(len + 1);
+            if (!buf)
+                return NULL;
+        }
+    }
+    *len_ptr = len;
+    return buf;
+}
+
+/* continue the search after the current match */
+static void query_replace_skip(QueryReplaceState *is)
+{
+    if (is->found_end > is->found_offset)
+        is->found_offset = is->found_end;
+    else
+        is->found_offset++;
 }
 
 static void query_replace_replace(QueryReplaceState *is)
 {
     EditState *s = is->s;
+    u8 *buf;
+    int len;
 
-    eb_delete(s->b, is->found_offset, is->search_bytes_len);
-    eb_insert(s->b, is->found_offset, is->replace_bytes, is->replace_bytes_len);
-    is->found_offset += is->replace_bytes_len;
+    if (is->regex) {
+        buf = query_replace_expand(is, &len);
+        if (!buf) {
+            /* not enough memory: the match is kept */
+            query_replace_skip(is);
+            return;
+        }
+        eb_delete(s->b, is->found_offset, is->found_end - is->found_offset);
+        eb_insert(s->b, is->found_offset, buf, len);
+        free(buf);
+        /* an empty match is not found again at the same position */
+        if (is->found_end == is->found_offset)
+            len++;
+        is->found_offset += len;
+    } else {
+        eb_delete(s->b, is->found_offset, is->search_bytes_len);
+        eb_insert(s->b, is->found_offset, is->replace_bytes,
+                  is->replace_bytes_len);
+        is->found_offset += is->replace_bytes_len;
+    }
     is->nb_reps++;
 }
 
+#define REPLACE_CHUNK_SIZE (16 * MAX_PAGE_SIZE)
+
+typedef struct ReplaceOutput {
+    EditBuffer *b;
+    u8 buf[REPLACE_CHUNK_SIZE];
+    int len;
+} ReplaceOutput;
+
+static void replace_output(ReplaceOutput *out, const u8 *buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+        n = min(len, REPLACE_CHUNK_SIZE - out->len);
+        memcpy(out->buf + out->len, buf, n);
+        out->len += n;
+        buf += n;
+        len -= n;
+        if (out->len == REPLACE_CHUNK_SIZE) {
+            eb_insert(out->b, out->b->total_size, out->buf, out->len);
+            out->len = 0;
+        }
+    }
+}
+
+/* copy the bytes [start, end) of 'b' */
+static void replace_output_copy(ReplaceOutput *out, EditBuffer *b,
+                                int start, int end)
+{
+    const u8 *data;
+    int page_start, page_size, len;
+
+    while (start < end) {
+        data = eb_get_page(b, start, &page_start, &page_size);
+        len = min(end, page_start + page_size) - start;
+        replace_output(out, data + start - page_start, len);
+        start += len;
+    }
+}
+
+/* Replace the current match and all the following ones. The text from
+   the current match to the end of the last one is read once to build
+   the new text in a separate buffer, which is then swapped in as a
+   single modification. It is much faster than replacing the matches
+   one by one, and it is undone in one step. Return -1 if not enough
+   memory. */
+static int query_replace_all(QueryReplaceState *is)
+{
+    EditBuffer *b = is->b;
+    SearchPattern *sp;
+    ReplaceOutput *out;
+    u8 *buf;
+    int start, start_end, pos, len, n, ti;
+
+    ti = get_clock_ms();
+    sp = NULL;
+    if (!is->regex) {
+        sp = search_pattern_new(is->search_bytes, is->search_bytes_len, 0);
+        if (!sp)
+            return -1;
+    }
+    out = malloc(sizeof(ReplaceOutput));
+    if (!out) {
+        search_pattern_free(sp);
+        return -1;
+    }
+    out->b = eb_new("*replace*", BF_SYSTEM);
+    out->len = 0;
+    if (!out->b) {
+        free(out);
+        search_pattern_free(sp);
+        return -1;
+    }
+
+    start = pos = is->found_offset;
+    start_end = is->found_end;
+    n = 0;
+    while (is->found_offset >= 0) {
+        replace_output_copy(out, b, pos, is->found_offset);
+        if (is->regex) {
+            buf = query_replace_expand(is, &len);
+            if (!buf) {
+                /* nothing is replaced: the caller restarts at the
+                   first match */
+                is->found_offset = start;
+                is->found_end = start_end;
+                eb_free(out->b);
+                free(out);
+                return -1;
+            }
+            replace_output(out, buf, len);
+            free(buf);
+            pos = is->found_end;
+            /* an empty match is not found again at the same position */
+            is->found_offset = eb_regex_search_forward(b, is->regex,
+                pos + (is->found_end == is->found_offset), b->total_size + 1,
+                &is->found_end, NULL, NULL);
+        } else {
+            replace_output(out, is->replace_bytes, is->replace_bytes_len);
+            pos = is->found_end;
+            is->found_offset = eb_search_pattern(b, pos, sp, NULL, NULL);
+            is->found_end = is->found_offset + is->search_bytes_len;
+        }
+        n++;
+    }
+    if (out->len > 0)
+        eb_insert(out->b, out->b->total_size, out->buf, out->len);
+
+    eb_replace_buffer(b, start, pos - start, out->b);
+    is->nb_reps += n;
+
+    eb_free(out->b);
+    free(out);
+    search_pattern_free(sp);
+
+    is->bulk_reps = n;
+    is->bulk_time = get_clock_ms() - ti;
+    return 0;
+}
+
 static void query_replace_display(QueryReplaceState *is)
 {
     EditState *s = is->s;
 
  redo:
-    is->found_offset = eb_search(s->b, is->found_offset, 1,
-                                 is->search_bytes, is->search_bytes_len,
-                                 0, NULL, NULL);
+    if (is->regex) {
+        is->found_offset = eb_regex_search(s->b, is->regex,
+                                           is->found_offset, 1,
+                                           &is->found_end, NULL, NULL);
+    } else {
+        is->found_offset = eb_search(s->b, is->found_offset, 1,
+                                     is->search_bytes, is->search_bytes_len,
+                                     0, NULL, NULL);
+        is->found_end = is->found_offset + is->search_bytes_len;
+    }
     if (is->found_offset < 0) {
         query_replace_abort(is);
         return;
     }
 
     if (is->replace_all) {
-        query_replace_replace(is);
-        goto redo;
+        if (query_replace_all(is) < 0) {
+            /* not enough memory: replace the matches one by one */
+            query_replace_replace(is);
+            goto redo;
+        }
+        query_replace_abort(is);
+        return;
     }
 
     /* display text */
     s->offset = is->found_offset;
     center_cursor(s);
-    edit_display(s->qe_state);
-
     put_status(NULL, "Query replace %s with %s: ",
                is->search_str, is->replace_str);
-    dpy_flush(&global_screen);
+    edit_schedule_display(s->qe_state);
 }
 
 static void query_replace_key(void *opaque, int ch)
@@ -5401,26 +6401,59 @@ static void query_replace_key(void *opaque, int ch)
         break;
     case 'n':
     case KEY_DELETE:
+        query_replace_skip(is);
+        break;
+    case 'N':
+        /* skip the rest of the buffer */
+        if (!is->cb)
+            goto quit;
+        is->status = QUERY_REPLACE_NEXT;
+        query_replace_abort(is);
+        return;
+    case 'Y':
+        /* replace all the matches of this buffer and of the next ones */
+        if (!is->cb)
+            goto quit;
+        is->status = QUERY_REPLACE_ALL;
+        is->replace_all = 1;
         break;
     default:
+    quit:
+        is->status = QUERY_REPLACE_QUIT;
         query_replace_abort(is);
         return;
     }
     query_replace_display(is);
 }
 
-static void do_query_replace(EditState *s,
-                             const char *search_str, const char *replace_str)
+/* Start an interactive replacement from the cursor of 's'. If 'cb' is
+   not NULL, it is called at the end with the reason of the end and the
+   number of replacements, and the keys 'N' and 'Y' are also accepted
+   to go to the next buffer and to replace everywhere. */
+void query_replace_start(EditState *s, const char *search_str,
+                         const char *replace_str, int regex,
+                         QueryReplaceCB *cb, void *opaque)
 {
     QueryReplaceState *is;
+    const char *error;
 
-    if (s->b->flags & BF_READONLY)
+    if (s->b->flags & BF_READONLY) {
+        if (cb)
+            cb(opaque, QUERY_REPLACE_NEXT, 0);
         return;
+    }
 
     is = malloc(sizeof(QueryReplaceState));
-    if (!is)
+    if (!is) {
+        if (cb)
+            cb(opaque, QUERY_REPLACE_QUIT, 0);
         return;
+    }
     is->s = s;
+    is->b = s->b;
+    is->cb = cb;
+    is->opaque = opaque;
+    is->status = QUERY_REPLACE_DONE;
     pstrcpy(is->search_str, sizeof(is->search_str), search_str);
     pstrcpy(is->replace_str, sizeof(is->replace_str), replace_str);
 
@@ -5430,12 +6463,64 @@ static void do_query_replace(EditState *s,
                                      replace_str);
     is->nb_reps = 0;
     is->replace_all = 0;
+    is->bulk_reps = 0;
+    is->bulk_time = 0;
     is->found_offset = s->offset;
+    is->regex = NULL;
+    if (regex) {
+        is->regex = regex_compile(is->search_bytes, is->search_bytes_len,
+                                  SEARCH_FLAG_SMARTCASE, &error);
+        if (!is->regex) {
+            put_status(s, "Invalid regexp: %s", error);
+            free(is);
+            if (cb)
+                cb(opaque, QUERY_REPLACE_QUIT, 0);
+            return;
+        }
+    }
 
     qe_grab_keys(query_replace_key, is);
     query_replace_display(is);
 }
 
+/* Replace all the occurrences of 'search' in 'b' in one pass, without
+   asking. Return the number of replacements or -1 if error. */
+int eb_replace_all(EditBuffer *b, const u8 *search, int search_len,
+                   const u8 *replace, int replace_len)
+{
+    QueryReplaceState is1, *is = &is1;
+
+    if (search_len <= 0 || search_len > SEARCH_LENGTH ||
+        replace_len > SEARCH_LENGTH)
+        return -1;
+    memset(is, 0, sizeof(QueryReplaceState));
+    is->b = b;
+    memcpy(is->search_bytes, search, search_len);
+    is->search_bytes_len = search_len;
+    memcpy(is->replace_bytes, replace, replace_len);
+    is->replace_bytes_len = replace_len;
+    is->found_offset = eb_search(b, 0, 1, is->search_bytes, search_len,
+                                 0, NULL, NULL);
+    if (is->found_offset < 0)
+        return 0;
+    is->found_end = is->found_offset + search_len;
+    if (query_replace_all(is) < 0)
+        return -1;
+    return is->nb_reps;
+}
+
+static void do_query_replace(EditState *s,
+                             const char *search_str, const char *replace_str)
+{
+    query_replace_start(s, search_str, replace_str, 0, NULL, NULL);
+}
+
+static void do_query_replace_regexp(EditState *s, const char *search_str,
+                                    const char *replace_str)
+{
+    query_replace_start(s, search_str, replace_str, 1, NULL, NULL);
+}
+
 void do_doctor(EditState *s)
 {
     put_status(s, "Hello, how are you ?");
@@ -6115,13 +7200,15 @@ void qe_handle_event(QEEvent *ev)
     case QE_KEY_EVENT:
         qe_key_process(ev->key_event.key);
         break;
+    case QE_PASTE_EVENT:
+        qe_paste_process(ev->paste_event.data, ev->paste_event.len);
+        break;
     case QE_EXPOSE_EVENT:
         do_refresh(qs->first_window);
         goto redraw;
     case QE_UPDATE_EVENT:
     redraw:
-        edit_display(qs);
-        dpy_flush(qs->screen);
+        redraw_flush(qs);
         break;
 #ifndef CONFIG_TINY
     case QE_BUTTON_PRESS_EVENT:
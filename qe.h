@@ -58,6 +58,7 @@ struct EditState;
 
 #define MAXINT 0x7fffffff
 #define MAX_FILENAME_SIZE 1024
+#define MAX_STATUS_SIZE 1024 /* mode line and status text, in bytes */
 #define NO_ARG MAXINT
 
 /* util.c */
@@ -287,6 +288,7 @@ enum QEEventType {
     QE_BUTTON_RELEASE_EVENT, /* mouse button release event */
     QE_MOTION_EVENT, /* mouse motion event */
     QE_SELECTION_CLEAR_EVENT, /* request selection clear (X11 type selection) */
+    QE_PASTE_EVENT, /* text pasted in the terminal (bracketed paste) */
 };
 
 #define KEY_META(c) ((c) | 0xe000)
@@ -367,12 +369,20 @@ typedef struct QEMotionEvent {
     int y;
 } QEMotionEvent;
 
+/* the pasted bytes are in the terminal charset */
+typedef struct QEPasteEvent {
+    enum QEEventType type;
+    const unsigned char *data;
+    int len;
+} QEPasteEvent;
+
 typedef union QEEvent {
     enum QEEventType type;
     QEKeyEvent key_event;
     QEExposeEvent expose_event;
     QEButtonEvent button_event;
     QEMotionEvent motion_event;
+    QEPasteEvent paste_event;
 } QEEvent;
 
 void qe_handle_event(QEEvent *ev);
@@ -467,9 +477,17 @@ typedef struct EditBuffer {
     int log_new_index, log_current;
     struct EditBuffer *log_buffer;
     int nb_logs;
+    int log_linked;  /* if true, the next operation is linked to the
+                        previous one in the log */
 
     /* modification callbacks */
     EditBufferCallbackList *first_callback;
+
+    /* colorization states, shared by all the windows */
+    struct ColorizeCache *first_colorize_cache;
+
+    /* matches of the current search, highlighted in all the windows */
+    struct SearchIndex *search_index;
     
     /* asynchronous loading/saving support */
     struct BufferIOState *io_state;
@@ -501,23 +519,34 @@ typedef struct EditBufferDataType {
     struct EditBufferDataType *next;
 } EditBufferDataType;
 
+/* called after a buffer was saved to its file */
+typedef struct EditBufferSaveHook {
+    void (*saved)(EditBuffer *b);
+    struct EditBufferSaveHook *next;
+} EditBufferSaveHook;
+
 /* the log buffer is used for the undo operation */
 /* header of log operation */
 typedef struct LogBuffer {
     u8 op;
     u8 was_modified;
+    u8 linked;  /* undone together with the previous operation */
     int offset;
     int size;
 } LogBuffer;
 
 void eb_init(void);
 int eb_read(EditBuffer *b, int offset, u8 *buf, int size);
+const u8 *eb_get_page(EditBuffer *b, int offset, int *start_ptr,
+                      int *size_ptr);
 void eb_write(EditBuffer *b, int offset, u8 *buf, int size);
 void eb_insert_buffer(EditBuffer *dest, int dest_offset, 
                       EditBuffer *src, int src_offset, 
                       int size);
 void eb_insert(EditBuffer *b, int offset, u8 *buf, int size);
 void eb_delete(EditBuffer *b, int offset, int size);
+void eb_replace_buffer(EditBuffer *b, int offset, int size,
+                       EditBuffer *src);
 void log_reset(EditBuffer *b);
 EditBuffer *eb_new(const char *name, int flags);
 void eb_free(EditBuffer *b);
@@ -560,6 +589,7 @@ int eb_is_empty_line(EditBuffer *b, int offset);
 int eb_next_line(EditBuffer *b, int offset);
 
 void eb_register_data_type(EditBufferDataType *bdt);
+void eb_register_save_hook(EditBufferSaveHook *hook);
 EditBufferDataType *eb_probe_data_type(const char *filename, int mode,
                                        uint8_t *buf, int buf_size);
 void eb_set_data_type(EditBuffer *b, EditBufferDataType *bdt);
@@ -625,6 +655,62 @@ typedef int (*GetColorizedLineFunc)(struct EditState *s,
 typedef void (*ColorizeFunc)(unsigned int *buf, int len, 
                              int *colorize_state_ptr, int state_only);
 
+/* return TRUE if the colorization state before the line can be
+   assumed to be the initial one. It is used to estimate the state of
+   lines far from the colorized ones */
+typedef int (*ColorizeResyncFunc)(unsigned int *buf, int len);
+
+/* colorization state before line 'line' */
+typedef struct ColorizeCheckpoint {
+    int line;
+    int state;
+} ColorizeCheckpoint;
+
+/* colorization state of a buffer for a given colorizer. It is shared
+   by all the windows showing the buffer with the same colorizer, so
+   that the buffer is colorized and invalidated only once */
+typedef struct ColorizeCache {
+    ColorizeFunc colorize_func;
+    ColorizeResyncFunc colorize_resync_func;
+    struct EditBuffer *b;
+    int ref_count;
+    /* checkpoints sorted by line, about one every
+       COLORIZE_CHECKPOINT_LINES lines. The states of the other lines
+       are recomputed from the previous checkpoint. [0,
+       colorize_nb_valid_checkpoints) are valid, [colorize_stale_index,
+       colorize_nb_checkpoints) were computed before the last
+       modification and the slots between them are unused */
+    ColorizeCheckpoint *colorize_checkpoints;
+    int colorize_nb_checkpoints;
+    int colorize_max_checkpoints;
+    int colorize_nb_valid_checkpoints;
+    int colorize_stale_index;
+    /* state before line 'colorize_valid_line'. The states of the
+       previous lines are known */
+    int colorize_valid_line;
+    int colorize_valid_state;
+    /* last state computed for the display, so that consecutive lines
+       do not restart from a checkpoint */
+    int colorize_cur_line;
+    int colorize_cur_state;
+    /* same for the estimated states */
+    int colorize_est_line;
+    int colorize_est_state;
+    /* maximum valid offset, MAXINT if not modified. Needed to invalide
+       the states */
+    int colorize_max_valid_offset; 
+    int colorize_damage_end; /* end of the modified area */
+    int colorize_nb_buffer_lines; /* buffer lines when last invalidated */
+    /* the stale checkpoints become valid again as soon as a
+       recomputed state after 'colorize_converge_line' matches one of
+       them */
+    int colorize_converge_line;
+    /* background colorization up to 'colorize_wanted_line' */
+    int colorize_wanted_line;
+    QETimer *colorize_timer;
+    struct ColorizeCache *next;
+} ColorizeCache;
+
 /* contains all the information necessary to uniquely identify a line,
    to avoid displaying it */
 typedef struct QELineShadow {
@@ -685,13 +771,8 @@ typedef struct EditState {
 
     EditBuffer *b;
 
-    /* state before line n, one byte per line */
-    unsigned char *colorize_states; 
-    int colorize_nb_lines;
-    int colorize_nb_valid_lines;
-    /* maximum valid offset, MAXINT if not modified. Needed to invalide
-       'colorize_states' */
-    int colorize_max_valid_offset; 
+    /* colorization states, shared with the other windows */
+    ColorizeCache *colorize_cache;
 
     int busy; /* true if editing cannot be done if the window
                  (e.g. the parser HTML is parsing the buffer to
@@ -713,9 +794,11 @@ typedef struct EditState {
     struct QEmacsState *qe_state;
     struct QEditScreen *screen; /* copy of qe_state->screen */
     /* display shadow to optimize redraw */
-    char modeline_shadow[MAX_SCREEN_WIDTH];
+    char modeline_shadow[MAX_STATUS_SIZE];
     QELineShadow *line_shadow; /* per window shadow */
     int shadow_nb_lines;
+    /* display state, reused for each display and cursor computation */
+    struct DisplayState *display_state;
     /* compose state for input method */
     struct InputMethod *input_method; /* current input method */
     struct InputMethod *selected_input_method; /* selected input method (used to switch) */
@@ -846,7 +929,7 @@ typedef struct QEmacsState {
     EditBuffer *yank_buffers[NB_YANK_BUFFERS];
     int yank_current;
     char res_path[1024];
-    char status_shadow[MAX_SCREEN_WIDTH];
+    char status_shadow[MAX_STATUS_SIZE];
     char system_fonts[NB_FONT_FAMILIES][256];
 } QEmacsState;
 
@@ -941,17 +1024,21 @@ typedef struct DisplayState {
     int eol_reached;
     EditState *edit_state;
     
+    /* size of the fragment and line buffers, grown with the screen
+       width */
+    int max_size;
+
     /* fragment buffers */
-    TextFragment fragments[MAX_SCREEN_WIDTH];
+    TextFragment *fragments;
     int nb_fragments;
     int last_word_space; /* true if last word was a space */
     int word_index;      /* fragment index of the start of the current
                             word */
     /* line char (in fact glyph) buffer */
-    unsigned int line_chars[MAX_SCREEN_WIDTH]; 
-    short line_char_widths[MAX_SCREEN_WIDTH];
-    int line_offsets[MAX_SCREEN_WIDTH][2]; 
-    unsigned char line_hex_mode[MAX_SCREEN_WIDTH];
+    unsigned int *line_chars;
+    short *line_char_widths;
+    int (*line_offsets)[2];
+    unsigned char *line_hex_mode;
     int line_index;
 
     /* fragment temporary buffer */
@@ -970,6 +1057,8 @@ enum DisplayType {
     DISP_CURSOR_SCREEN,
 };
 
+DisplayState *display_new(void);
+void display_free(DisplayState *s);
 void display_init(DisplayState *s, EditState *e, enum DisplayType do_disp);
 void display_bol(DisplayState *s);
 void display_setcursor(DisplayState *s, DirType dir);
@@ -1075,6 +1164,8 @@ EditState *edit_new(EditBuffer *b,
 void do_refresh(EditState *s);
 void do_delete_window(EditState *s, int force);
 void edit_display(QEmacsState *qs);
+void edit_schedule_display(QEmacsState *qs);
+void edit_schedule_background_display(QEmacsState *qs);
 void edit_invalidate(EditState *s);
 
 /* text mode */
@@ -1085,11 +1176,118 @@ int text_backward_offset(EditState *s, int offset);
 int text_display(EditState *s, DisplayState *ds, int offset);
 
 void set_colorize_func(EditState *s, ColorizeFunc colorize_func);
+void set_colorize_resync_func(EditState *s, ColorizeResyncFunc resync_func);
 int get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
                        int offset1, int line_num);
 void set_color(unsigned int *buf, int len, int style);
 void clear_color(unsigned int *buf, int len);
 
+/* keyword set compiled into a perfect hash table by kwhashgen */
+typedef struct KeywordHash {
+    const char * const *words; /* NULL if the slot is empty */
+    unsigned int mask;
+    unsigned int a, b, c;
+} KeywordHash;
+
+/* return TRUE if the 'len' chars at 'p' are a word of 'kh' */
+static inline int keyword_find(const KeywordHash *kh,
+                               const unsigned int *p, int len)
+{
+    const char *w;
+    int i;
+
+    if (len <= 0)
+        return 0;
+    w = kh->words[(kh->a * p[0] + kh->b * p[len >> 1] +
+                   kh->c * p[len - 1] + len) & kh->mask];
+    if (!w)
+        return 0;
+    for(i = 0; i < len; i++) {
+        if ((unsigned char)w[i] != p[i])
+            return 0;
+    }
+    return w[len] == '\0';
+}
+
+/* syntax.c */
+
+#define SYNTAX_IDENTIFIERS   0x0001 /* colorize all the identifiers */
+#define SYNTAX_DECLARATIONS  0x0002 /* only the identifiers of declarations */
+#define SYNTAX_DISABLED      0x0004 /* '#if 0' blocks are comments */
+
+/* declarative description of a programming language, colorized by
+   syntax_colorize_line(). NULL or 0 fields are not used. */
+typedef struct SyntaxDef {
+    const char *line_comment;   /* comment up to the end of line */
+    const char *comment_start;  /* block comment */
+    const char *comment_end;
+    const char *string_delims;  /* chars starting and ending a string */
+    int escape_char;            /* quotes the next char in strings */
+    int preprocessor_char;      /* first char of preprocessor lines */
+    const KeywordHash *keywords;
+    const KeywordHash *types;
+    int flags;
+} SyntaxDef;
+
+unsigned int *umemchr2(const unsigned int *p, const unsigned int *end,
+                       unsigned int c1, unsigned int c2);
+void syntax_tokenize_line(const SyntaxDef *syn,
+                          unsigned int *buf, int len,
+                          int *colorize_state_ptr, int state_only);
+void syntax_colorize_line(const SyntaxDef *syn,
+                          unsigned int *buf, int len,
+                          int *colorize_state_ptr, int state_only);
+void highlight_over_margin(unsigned int *buf, int len);
+
+/* search.c */
+
+#define SEARCH_FLAG_IGNORECASE 0x0001
+#define SEARCH_FLAG_SMARTCASE  0x0002 /* case sensitive if upper case present */
+#define SEARCH_FLAG_WORD       0x0004
+#define SEARCH_FLAG_REGEX      0x0008
+
+#define SEARCH_MAX_SIZE 1024
+
+int eb_search(EditBuffer *b, int offset, int dir, u8 *buf, int size,
+              int flags, CSSAbortFunc *abort_func, void *abort_opaque);
+
+typedef struct SearchPattern SearchPattern;
+
+SearchPattern *search_pattern_new(const u8 *buf, int size, int flags);
+void search_pattern_free(SearchPattern *sp);
+int search_pattern_find(const SearchPattern *sp, const u8 *data, int size,
+                        int pos);
+int eb_search_pattern(EditBuffer *b, int offset, const SearchPattern *sp,
+                      CSSAbortFunc *abort_func, void *abort_opaque);
+
+typedef struct SearchIndex SearchIndex;
+
+void search_index_set(EditBuffer *b, const u8 *buf, int size, int flags,
+                      int cur_start, int cur_end);
+void search_index_free(EditBuffer *b);
+int search_index_count(EditBuffer *b, int *cur_ptr, int *complete_ptr);
+void search_index_highlight(EditBuffer *b, unsigned int *buf, int len,
+                            int offset);
+
+/* regex.c */
+
+#define REGEX_MAX_GROUPS 10 /* including the whole match */
+
+typedef struct QERegex QERegex;
+
+QERegex *regex_compile(const u8 *pattern, int len, int flags,
+                       const char **error_ptr);
+void regex_free(QERegex *re);
+int eb_regex_search(EditBuffer *b, QERegex *re, int offset, int dir,
+                    int *end_ptr, CSSAbortFunc *abort_func,
+                    void *abort_opaque);
+int eb_regex_search_forward(EditBuffer *b, QERegex *re, int offset,
+                            int limit, int *end_ptr,
+                            CSSAbortFunc *abort_func, void *abort_opaque);
+int eb_regex_groups(EditBuffer *b, QERegex *re, int start, int end,
+                    int *groups);
+
+int isword(int c);
 void do_char(EditState *s, int key);
 void do_switch_to_buffer(EditState *s, const char *bufname);;
 void do_set_mode(EditState *s, ModeDef *m, ModeSavedData *saved_data);
@@ -1107,6 +1305,23 @@ void text_move_bol(EditState *s);
 void text_move_eol(EditState *s);
 void do_load(EditState *s, const char *filename);
 void do_goto_line(EditState *s, int line);
+
+/* end of an interactive replacement */
+enum {
+    QUERY_REPLACE_DONE, /* no more match */
+    QUERY_REPLACE_QUIT, /* stopped by the user */
+    QUERY_REPLACE_NEXT, /* 'N': skip to the next buffer */
+    QUERY_REPLACE_ALL,  /* 'Y': replace everywhere without asking */
+};
+
+typedef void QueryReplaceCB(void *opaque, int status, int nb_reps);
+
+void query_replace_start(EditState *s, const char *search_str,
+                         const char *replace_str, int regex,
+                         QueryReplaceCB *cb, void *opaque);
+int eb_replace_all(EditBuffer *b, const u8 *search, int search_len,
+                   const u8 *replace, int replace_len);
+
 void switch_to_buffer(EditState *s, EditBuffer *b);
 void do_up_down(EditState *s, int dir);
 void display_mode_line(EditState *s);
@@ -1132,10 +1347,33 @@ void get_style(EditState *e, QEStyleDef *style, int style_index);
 /* dired.c */
 void do_dired(EditState *s);
 
+/* cscope.c */
+extern int split_horizontal;
+
+void cscope_goto_line(EditState *s, const char *filename, int line);
+void do_cscope_pop_mark(EditState *s);
+
+/* cscope_db.c */
+int cscope_db_query(const char *symdir, int op, const char *sym,
+                    char **response, int *len);
+
+/* symindex.c */
+#define SYMINDEX_FILE "hoe.symbols"
+
+int symindex_update(const char *root);
+int symindex_query(const char *symdir, int op, const char *sym,
+                   char **response, int *len);
+
 /* c_mode.c */
+int c_is_keyword(const unsigned int *p, int len);
+void c_tokenize_line(unsigned int *buf, int len, int *colorize_state_ptr);
 void c_colorize_line(unsigned int *buf, int len, 
                      int *colorize_state_ptr, int state_only);
 
+/* pylang.c */
+int py_is_keyword(const unsigned int *p, int len);
+void py_tokenize_line(unsigned int *buf, int len, int *colorize_state_ptr);
+
 /* xml.c */
 int xml_mode_probe(ModeProbeData *p1);
 
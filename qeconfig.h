@@ -50,7 +50,16 @@ CmdDef basic_commands[] = {
     CMD0( KEY_NONE, KEY_NONE, "doctor", do_doctor)
     CMD1( KEY_CTRL('s'), KEY_NONE, "isearch-forward", do_isearch, 1 )
     CMD1( KEY_CTRL('r'), KEY_NONE, "isearch-backward", do_isearch, -1 )
+    CMD1( KEY_META(KEY_CTRL('s')), KEY_NONE, "isearch-forward-regexp",
+          do_isearch_regexp, 1 )
+    CMD1( KEY_META(KEY_CTRL('r')), KEY_NONE, "isearch-backward-regexp",
+          do_isearch_regexp, -1 )
+    CMDV( KEY_NONE, KEY_NONE, "re-search-forward\0vs{RE search: }|search|",
+          do_re_search, (void *)1 )
+    CMDV( KEY_NONE, KEY_NONE, "re-search-backward\0vs{RE search backward: }|search|",
+          do_re_search, (void *)-1 )
     CMD( KEY_META('%'), KEY_NONE, "query-replace\0s{Query replace: }|search|s{With: }|replace|", do_query_replace )
+    CMD( KEY_NONE, KEY_NONE, "query-replace-regexp\0s{Query replace regexp: }|search|s{With: }|replace|", do_query_replace_regexp )
     CMD0( KEY_CTRLX('u'), KEY_CTRL('_'), "undo", do_undo)
     CMD0( KEY_CTRL('t'), KEY_NONE, "transpose-char", do_transpose_char)
     CMD0( KEY_RET, KEY_NONE, "newline", do_return)
@@ -134,6 +143,13 @@ CmdDef basic_commands[] = {
          do_global_set_highlight_over_margin)
     CMD( KEY_NONE, KEY_NONE, "global-set-margin-size\0i{Size of Margin: }",
          do_global_set_margin_size)
+    CMD( KEY_NONE, KEY_NONE, "global-set-max-frame-rate\0i{Maximum frames per second (0 for no limit): }",
+         do_global_set_max_frame_rate)
+    CMD( KEY_NONE, KEY_NONE, "global-set-redraw-delay\0i{Maximum redraw delay in ms: }",
+         do_global_set_redraw_delay)
+    CMD0( KEY_NONE, KEY_NONE, "show-redraw-stats", do_show_redraw_stats)
+    CMD( KEY_NONE, KEY_NONE, "global-set-colorize-sync-lines\0i{Lines colorized before display: }",
+         do_global_set_colorize_sync_lines)
     CMD( KEY_NONE, KEY_NONE, "global-set-backup-directory\0s{Backup Directory: }",
 	 do_global_set_backup_dir)
     CMD0( KEY_CTRLXRET(KEY_CTRL('s')), KEY_NONE, "set-backup-directory",
@@ -29,6 +29,12 @@
     STYLE_DEF(QE_STYLE_SELECTION, "selection",
               QERGB(0x00, 0x00, 0xff), QERGB(0xff, 0xff, 0xff),
               0, 0)
+    STYLE_DEF(QE_STYLE_SEARCH_HIGHLIGHT, "search-highlight",
+              QERGB(0x00, 0x00, 0x00), QERGB(0x00, 0xaa, 0xaa),
+              0, 0)
+    STYLE_DEF(QE_STYLE_SEARCH_MATCH, "search-match",
+              QERGB(0x00, 0x00, 0x00), QERGB(0xff, 0xff, 0x00),
+              0, 0)
     STYLE_DEF(QE_STYLE_COMMENT, "comment",
               QERGB(0xf8, 0x44, 0x00), COLOR_TRANSPARENT,
               0, 0)
@@ -0,0 +1,1418 @@
+/*
+ * Regular expression search for QEmacs.
+ * Copyright (c) 2020 Himanshu Chauhan
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * The POSIX extended syntax is compiled to a Thompson NFA on bytes.
+ * The search runs a DFA whose states are sets of NFA nodes. They are
+ * built lazily on the first use of each transition and the whole DFA
+ * is flushed when REGEX_MAX_STATES is reached, so the memory is
+ * bounded and no input can cause a backtracking blowup.
+ *
+ * A forward search first scans the pages once with the unanchored
+ * DFA to find the earliest match end. The leftmost match start is
+ * then found in one pass by a NFA whose threads carry their start,
+ * and the anchored DFA gives the longest match from there.
+ * The groups are only computed for a found match, with a Pike VM
+ * restricted to its text.
+ */
+#include "qe.h"
+
+#define REGEX_MAX_NODES  10000
+#define REGEX_MAX_STATES 1024
+#define REGEX_MAX_SET_POOL (256 * 1024) /* NFA nodes of all the states */
+#define REGEX_HASH_SIZE  1024
+#define REGEX_MAX_REPEAT 255
+/* size of the blocks scanned by the backward searches */
+#define REGEX_BLOCK_SIZE 65536
+
+/* NFA node types */
+enum {
+    RE_CHAR,    /* a byte of 'cls', then 'out' */
+    RE_SPLIT,   /* 'out' and 'out1' */
+    RE_EMPTY,   /* 'out' */
+    RE_SAVE,    /* record the position in capture slot 'arg', then 'out' */
+    RE_BOL,     /* beginning of line, then 'out' */
+    RE_EOL,     /* end of line, then 'out' */
+    RE_MATCH,
+};
+
+typedef struct RegexNode {
+    int type;
+    int out, out1;
+    int arg;    /* class index or capture slot */
+} RegexNode;
+
+typedef struct RegexClass {
+    unsigned int bits[8];
+} RegexClass;
+
+#define REGEX_DFA_UNANCHORED 0x0001 /* a match can start at each byte */
+#define REGEX_DFA_ACCEPT     0x0002 /* a match ends here */
+#define REGEX_DFA_ACCEPT_EOL 0x0004 /* a match ends here before a newline */
+#define REGEX_DFA_DEAD       0x0008 /* no match can end after this */
+#define REGEX_DFA_BOL        0x0010 /* at the beginning of a line */
+#define REGEX_DFA_IDLE       0x0020 /* unanchored start: stays the same on
+                                       the bytes which cannot start a
+                                       match, except newlines */
+/* flags which are part of the identity of a state */
+#define REGEX_DFA_KEY        (REGEX_DFA_UNANCHORED | REGEX_DFA_BOL)
+
+typedef struct RegexState {
+    int flags;
+    int set;        /* index of the sorted NFA nodes in 'set_pool' */
+    int nb_set;
+    int hash_next;
+} RegexState;
+
+struct QERegex {
+    RegexNode *nodes;
+    int nb_nodes, max_nodes;
+    RegexClass *classes;
+    int nb_classes, max_classes;
+    int start;
+    int nb_groups;
+    int ignorecase;
+    int nullable;               /* may match the empty string */
+    int has_bol;                /* contains a '^' assertion */
+    u8 first[256];              /* bytes that can start a match */
+    /* lazy DFA */
+    RegexState *states;
+    int nb_states;
+    int *trans;                 /* 256 transitions per state, -1 if
+                                   not computed yet */
+    int *set_pool;
+    int set_pool_len, set_pool_size;
+    int nb_flushes;
+    int hash_table[REGEX_HASH_SIZE];
+    int start_states[2][2];     /* [unanchored][bol] */
+    /* work space */
+    int *mark;
+    int gen;
+    int *stack;
+    int *work, *work1;
+};
+
+typedef struct RegexFrag {
+    int start;
+    int out;    /* list of the dangling outputs */
+} RegexFrag;
+
+typedef struct RegexParser {
+    QERegex *re;
+    const u8 *p, *end;
+    const char *error;
+} RegexParser;
+
+/* The dangling outputs of a fragment are linked through the output
+   fields themselves. An output is identified by 'node * 2 + n' where
+   n is 0 for 'out' and 1 for 'out1'. */
+static int *re_out(QERegex *re, int l)
+{
+    if (l & 1)
+        return &re->nodes[l >> 1].out1;
+    else
+        return &re->nodes[l >> 1].out;
+}
+
+static void re_patch(QERegex *re, int l, int target)
+{
+    int *p;
+
+    while (l >= 0) {
+        p = re_out(re, l);
+        l = *p;
+        *p = target;
+    }
+}
+
+static int re_append(QERegex *re, int l1, int l2)
+{
+    int l, *p;
+
+    if (l1 < 0)
+        return l2;
+    l = l1;
+    for(;;) {
+        p = re_out(re, l);
+        if (*p < 0)
+            break;
+        l = *p;
+    }
+    *p = l2;
+    return l1;
+}
+
+static int re_new_node(RegexParser *rp, int type, int out, int out1, int arg)
+{
+    QERegex *re = rp->re;
+    RegexNode *n;
+
+    if (re->nb_nodes >= re->max_nodes) {
+        if (re->max_nodes >= REGEX_MAX_NODES) {
+            rp->error = "regexp too big";
+            return -1;
+        }
+        re->max_nodes = re->max_nodes ? re->max_nodes * 2 : 64;
+        n = realloc(re->nodes, re->max_nodes * sizeof(RegexNode));
+        if (!n) {
+            rp->error = "out of memory";
+            return -1;
+        }
+        re->nodes = n;
+    }
+    n = &re->nodes[re->nb_nodes];
+    n->type = type;
+    n->out = out;
+    n->out1 = out1;
+    n->arg = arg;
+    return re->nb_nodes++;
+}
+
+static RegexClass *re_new_class(RegexParser *rp, int *index_ptr)
+{
+    QERegex *re = rp->re;
+    RegexClass *c;
+
+    if (re->nb_classes >= re->max_classes) {
+        re->max_classes = re->max_classes ? re->max_classes * 2 : 16;
+        c = realloc(re->classes, re->max_classes * sizeof(RegexClass));
+        if (!c) {
+            rp->error = "out of memory";
+            return NULL;
+        }
+        re->classes = c;
+    }
+    c = &re->classes[re->nb_classes];
+    memset(c, 0, sizeof(RegexClass));
+    *index_ptr = re->nb_classes++;
+    return c;
+}
+
+static inline void class_set(RegexClass *c, int ch)
+{
+    c->bits[ch >> 5] |= 1U << (ch & 31);
+}
+
+static inline int class_test(const RegexClass *c, int ch)
+{
+    return (c->bits[ch >> 5] >> (ch & 31)) & 1;
+}
+
+/* fragment matching a byte of the class 'cls' */
+static int re_char_frag(RegexParser *rp, RegexFrag *f, int cls)
+{
+    int n;
+
+    n = re_new_node(rp, RE_CHAR, -1, -1, cls);
+    if (n < 0)
+        return -1;
+    f->start = n;
+    f->out = n * 2;
+    return 0;
+}
+
+static int re_simple_frag(RegexParser *rp, RegexFrag *f, int type, int arg)
+{
+    int n;
+
+    n = re_new_node(rp, type, -1, -1, arg);
+    if (n < 0)
+        return -1;
+    f->start = n;
+    f->out = n * 2;
+    return 0;
+}
+
+/* add the escape class 'c' (\w, \d, \s and their complements) */
+static int class_add_escape(RegexClass *cls, int c)
+{
+    int ch, neg, in;
+
+    neg = isupper(c) != 0;
+    for(ch = 0; ch < 256; ch++) {
+        switch(tolower(c)) {
+        case 'w':
+            in = isword(ch);
+            break;
+        case 'd':
+            in = (ch >= '0' && ch <= '9');
+            break;
+        case 's':
+            in = (ch == ' ' || (ch >= '\t' && ch <= '\r'));
+            break;
+        default:
+            return 0;
+        }
+        if (in ^ neg)
+            class_set(cls, ch);
+    }
+    return 1;
+}
+
+static int class_add_named(RegexClass *cls, const char *name)
+{
+    static const char names[] =
+        "alpha digit alnum upper lower space punct xdigit blank cntrl ";
+    const char *p;
+    int ch, in, index, len;
+
+    len = strlen(name);
+    for(p = names, index = 0; *p; index++) {
+        if (!strncmp(p, name, len) && p[len] == ' ')
+            break;
+        p = strchr(p, ' ') + 1;
+    }
+    if (!*p)
+        return 0;
+    for(ch = 0; ch < 128; ch++) {
+        switch(index) {
+        case 0: in = isalpha(ch); break;
+        case 1: in = isdigit(ch); break;
+        case 2: in = isalnum(ch); break;
+        case 3: in = isupper(ch); break;
+        case 4: in = islower(ch); break;
+        case 5: in = isspace(ch); break;
+        case 6: in = ispunct(ch); break;
+        case 7: in = isxdigit(ch); break;
+        case 8: in = (ch == ' ' || ch == '\t'); break;
+        default: in = iscntrl(ch); break;
+        }
+        if (in)
+            class_set(cls, ch);
+    }
+    return 1;
+}
+
+static int re_escape_char(int c)
+{
+    switch(c) {
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case 'e': return 27;
+    default: return c;
+    }
+}
+
+static int re_parse_class(RegexParser *rp, RegexFrag *f)
+{
+    RegexClass *cls;
+    char name[16];
+    const u8 *q;
+    int index, neg, c, c1, ch, first;
+
+    cls = re_new_class(rp, &index);
+    if (!cls)
+        return -1;
+    neg = 0;
+    if (rp->p < rp->end && *rp->p == '^') {
+        neg = 1;
+        rp->p++;
+    }
+    first = 1;
+    for(;;) {
+        if (rp->p >= rp->end) {
+            rp->error = "unmatched [";
+            return -1;
+        }
+        c = *rp->p++;
+        if (c == ']' && !first)
+            break;
+        first = 0;
+        if (c == '[' && rp->p < rp->end && *rp->p == ':') {
+            q = rp->p + 1;
+            while (q < rp->end && *q != ':')
+                q++;
+            if (q + 1 < rp->end && q[1] == ']' &&
+                q - rp->p - 1 < (int)sizeof(name)) {
+                memcpy(name, rp->p + 1, q - rp->p - 1);
+                name[q - rp->p - 1] = '\0';
+                if (!class_add_named(cls, name)) {
+                    rp->error = "invalid character class";
+                    return -1;
+                }
+                rp->p = q + 2;
+                continue;
+            }
+        }
+        if (c == '\\' && rp->p < rp->end) {
+            c = *rp->p++;
+            if (class_add_escape(cls, c))
+                continue;
+            c = re_escape_char(c);
+        }
+        c1 = c;
+        if (rp->p + 1 < rp->end && rp->p[0] == '-' && rp->p[1] != ']') {
+            c1 = rp->p[1];
+            rp->p += 2;
+            if (c1 == '\\' && rp->p < rp->end)
+                c1 = re_escape_char(*rp->p++);
+            if (c1 < c) {
+                rp->error = "invalid range";
+                return -1;
+            }
+        }
+        for(ch = c; ch <= c1; ch++)
+            class_set(cls, ch);
+    }
+    if (rp->re->ignorecase) {
+        for(ch = 'a'; ch <= 'z'; ch++) {
+            if (class_test(cls, ch) || class_test(cls, toupper(ch))) {
+                class_set(cls, ch);
+                class_set(cls, toupper(ch));
+            }
+        }
+    }
+    if (neg) {
+        for(ch = 0; ch < 8; ch++)
+            cls->bits[ch] = ~cls->bits[ch];
+    }
+    return re_char_frag(rp, f, index);
+}
+
+static int re_parse_alt(RegexParser *rp, RegexFrag *f);
+
+static int re_parse_atom(RegexParser *rp, RegexFrag *f)
+{
+    RegexClass *cls;
+    int c, index, group;
+
+    c = *rp->p++;
+    switch(c) {
+    case '(':
+        group = -1;
+        if (rp->end - rp->p >= 2 && rp->p[0] == '?' && rp->p[1] == ':') {
+            rp->p += 2;
+        } else if (rp->re->nb_groups < REGEX_MAX_GROUPS - 1) {
+            group = rp->re->nb_groups++;
+        }
+        if (re_parse_alt(rp, f) < 0)
+            return -1;
+        if (rp->p >= rp->end || *rp->p != ')') {
+            rp->error = "unmatched (";
+            return -1;
+        }
+        rp->p++;
+        if (group >= 0) {
+            RegexFrag f1, f2;
+
+            if (re_simple_frag(rp, &f1, RE_SAVE, group * 2) < 0 ||
+                re_simple_frag(rp, &f2, RE_SAVE, group * 2 + 1) < 0)
+                return -1;
+            re_patch(rp->re, f1.out, f->start);
+            re_patch(rp->re, f->out, f2.start);
+            f->start = f1.start;
+            f->out = f2.out;
+        }
+        return 0;
+    case '[':
+        return re_parse_class(rp, f);
+    case '^':
+        rp->re->has_bol = 1;
+        return re_simple_frag(rp, f, RE_BOL, 0);
+    case '$':
+        return re_simple_frag(rp, f, RE_EOL, 0);
+    }
+    cls = re_new_class(rp, &index);
+    if (!cls)
+        return -1;
+    if (c == '.') {
+        memset(cls->bits, 0xff, sizeof(cls->bits));
+        cls->bits['\n' >> 5] &= ~(1U << ('\n' & 31));
+        return re_char_frag(rp, f, index);
+    }
+    if (c == '\\') {
+        if (rp->p >= rp->end) {
+            rp->error = "trailing backslash";
+            return -1;
+        }
+        c = *rp->p++;
+        if (c >= '1' && c <= '9') {
+            rp->error = "back references are not supported";
+            return -1;
+        }
+        if (class_add_escape(cls, c))
+            return re_char_frag(rp, f, index);
+        c = re_escape_char(c);
+    }
+    class_set(cls, c);
+    if (rp->re->ignorecase && isalpha(c)) {
+        class_set(cls, tolower(c));
+        class_set(cls, toupper(c));
+    }
+    return re_char_frag(rp, f, index);
+}
+
+/* parse the repeat count of '{n}', '{n,}' or '{n,m}'. Return 0 if it
+   is not a valid count. */
+static int re_parse_count(RegexParser *rp, int *min_ptr, int *max_ptr)
+{
+    const u8 *p = rp->p + 1;
+    int n, m;
+
+    if (p >= rp->end || !isdigit(*p))
+        return 0;
+    n = 0;
+    while (p < rp->end && isdigit(*p))
+        n = n * 10 + *p++ - '0';
+    m = n;
+    if (p < rp->end && *p == ',') {
+        p++;
+        m = -1;
+        if (p < rp->end && isdigit(*p)) {
+            m = 0;
+            while (p < rp->end && isdigit(*p))
+                m = m * 10 + *p++ - '0';
+        }
+    }
+    if (p >= rp->end || *p != '}')
+        return 0;
+    if (n > REGEX_MAX_REPEAT || m > REGEX_MAX_REPEAT || (m >= 0 && m < n)) {
+        rp->error = "invalid repeat count";
+        return -1;
+    }
+    rp->p = p + 1;
+    *min_ptr = n;
+    *max_ptr = m;
+    return 1;
+}
+
+/* parse again the text of an atom to get a copy of its fragment. The
+   groups of the copy are numbered from 'group' again, so that they
+   share the capture slots of the original and the last iteration is
+   reported as in POSIX. */
+static int re_copy_atom(RegexParser *rp, const u8 *start, const u8 *end,
+                        int group, RegexFrag *f)
+{
+    RegexParser rp1;
+    int ret, nb_groups;
+
+    nb_groups = rp->re->nb_groups;
+    rp->re->nb_groups = group;
+    rp1.re = rp->re;
+    rp1.p = start;
+    rp1.end = end;
+    rp1.error = NULL;
+    ret = re_parse_alt(&rp1, f);
+    if (ret < 0)
+        rp->error = rp1.error;
+    rp->re->nb_groups = nb_groups;
+    return ret;
+}
+
+static int re_star(RegexParser *rp, RegexFrag *f, int plus)
+{
+    int n;
+
+    n = re_new_node(rp, RE_SPLIT, f->start, -1, 0);
+    if (n < 0)
+        return -1;
+    re_patch(rp->re, f->out, n);
+    if (!plus)
+        f->start = n;
+    f->out = n * 2 + 1;
+    return 0;
+}
+
+static int re_quest(RegexParser *rp, RegexFrag *f)
+{
+    int n;
+
+    n = re_new_node(rp, RE_SPLIT, f->start, -1, 0);
+    if (n < 0)
+        return -1;
+    f->start = n;
+    f->out = re_append(rp->re, f->out, n * 2 + 1);
+    return 0;
+}
+
+static void re_concat(QERegex *re, RegexFrag *f, RegexFrag *f1)
+{
+    if (f->start < 0) {
+        *f = *f1;
+    } else {
+        re_patch(re, f->out, f1->start);
+        f->out = f1->out;
+    }
+}
+
+static int re_parse_repeat(RegexParser *rp, RegexFrag *f)
+{
+    RegexFrag res, f1;
+    const u8 *atom_start;
+    int c, min, max, i, ret, group;
+
+    atom_start = rp->p;
+    group = rp->re->nb_groups;
+    if (re_parse_atom(rp, f) < 0)
+        return -1;
+    while (rp->p < rp->end) {
+        c = *rp->p;
+        if (c == '*' || c == '+') {
+            rp->p++;
+            if (re_star(rp, f, c == '+') < 0)
+                return -1;
+        } else if (c == '?') {
+            rp->p++;
+            if (re_quest(rp, f) < 0)
+                return -1;
+        } else if (c == '{') {
+            const u8 *atom_end = rp->p;
+
+            ret = re_parse_count(rp, &min, &max);
+            if (ret < 0)
+                return -1;
+            if (ret == 0)
+                break;
+            /* the parsed fragment is the first copy */
+            res.start = -1;
+            res.out = -1;
+            for(i = 0; i < min || (i == min && max < 0) ||
+                    (max >= 0 && i < max); i++) {
+                if (i == 0) {
+                    f1 = *f;
+                } else {
+                    if (re_copy_atom(rp, atom_start, atom_end, group, &f1) < 0)
+                        return -1;
+                }
+                if (i == min && max < 0) {
+                    if (re_star(rp, &f1, 0) < 0)
+                        return -1;
+                } else if (i >= min) {
+                    if (re_quest(rp, &f1) < 0)
+                        return -1;
+                }
+                re_concat(rp->re, &res, &f1);
+            }
+            if (res.start < 0) {
+                /* {0} or {0,0} */
+                if (re_simple_frag(rp, &res, RE_EMPTY, 0) < 0)
+                    return -1;
+            }
+            *f = res;
+        } else {
+            break;
+        }
+    }
+    return 0;
+}
+
+static int re_parse_concat(RegexParser *rp, RegexFrag *f)
+{
+    RegexFrag f1;
+
+    f->start = -1;
+    f->out = -1;
+    while (rp->p < rp->end && *rp->p != '|' && *rp->p != ')') {
+        if (re_parse_repeat(rp, &f1) < 0)
+            return -1;
+        re_concat(rp->re, f, &f1);
+    }
+    if (f->start < 0)
+        return re_simple_frag(rp, f, RE_EMPTY, 0);
+    return 0;
+}
+
+static int re_parse_alt(RegexParser *rp, RegexFrag *f)
+{
+    RegexFrag f1;
+    int n;
+
+    if (re_parse_concat(rp, f) < 0)
+        return -1;
+    while (rp->p < rp->end && *rp->p == '|') {
+        rp->p++;
+        if (re_parse_concat(rp, &f1) < 0)
+            return -1;
+        n = re_new_node(rp, RE_SPLIT, f->start, f1.start, 0);
+        if (n < 0)
+            return -1;
+        f->start = n;
+        f->out = re_append(rp->re, f->out, f1.out);
+    }
+    return 0;
+}
+
+/* add to 'list' the nodes reachable from 'n' through epsilon
+   transitions. The CHAR, EOL and MATCH nodes are kept. */
+static int re_closure(QERegex *re, int *list, int nb, int n, int bol)
+{
+    RegexNode *node;
+    int sp;
+
+    sp = 0;
+    re->stack[sp++] = n;
+    while (sp > 0) {
+        n = re->stack[--sp];
+        if (n < 0 || re->mark[n] == re->gen)
+            continue;
+        re->mark[n] = re->gen;
+        node = &re->nodes[n];
+        switch(node->type) {
+        case RE_SPLIT:
+            re->stack[sp++] = node->out1;
+            re->stack[sp++] = node->out;
+            break;
+        case RE_EMPTY:
+        case RE_SAVE:
+            re->stack[sp++] = node->out;
+            break;
+        case RE_BOL:
+            if (bol)
+                re->stack[sp++] = node->out;
+            break;
+        default:
+            list[nb++] = n;
+            break;
+        }
+    }
+    return nb;
+}
+
+/* add to 'list' the nodes reachable when the EOL assertions hold. The
+   nodes added are scanned too, so that '$$' or '$(a|)$' are followed
+   to the end. */
+static int re_closure_eol(QERegex *re, int *list, int nb, int bol)
+{
+    int i;
+
+    for(i = 0; i < nb; i++) {
+        if (re->nodes[list[i]].type == RE_EOL)
+            nb = re_closure(re, list, nb, re->nodes[list[i]].out, bol);
+    }
+    return nb;
+}
+
+static int re_int_cmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+static void regex_flush(QERegex *re)
+{
+    int i;
+
+    re->nb_states = 0;
+    re->nb_flushes++;
+    re->set_pool_len = 0;
+    for(i = 0; i < REGEX_HASH_SIZE; i++)
+        re->hash_table[i] = -1;
+    re->start_states[0][0] = re->start_states[0][1] = -1;
+    re->start_states[1][0] = re->start_states[1][1] = -1;
+}
+
+/* return the DFA state of the 'nb' nodes of 're->work' */
+static int regex_find_state(QERegex *re, int nb, int flags)
+{
+    RegexState *st;
+    unsigned int h;
+    int i, index, *set, nb1, size;
+
+    qsort(re->work, nb, sizeof(int), re_int_cmp);
+    h = flags;
+    for(i = 0; i < nb; i++)
+        h = h * 31 + re->work[i];
+    h &= REGEX_HASH_SIZE - 1;
+    for(index = re->hash_table[h]; index >= 0; index = st->hash_next) {
+        st = &re->states[index];
+        if ((st->flags & REGEX_DFA_KEY) == flags && st->nb_set == nb &&
+            !memcmp(re->set_pool + st->set, re->work, nb * sizeof(int)))
+            return index;
+    }
+
+    if (re->nb_states >= REGEX_MAX_STATES ||
+        re->set_pool_len + nb > REGEX_MAX_SET_POOL) {
+        /* bounded memory: restart from an empty DFA */
+        regex_flush(re);
+    }
+    if (re->set_pool_len + nb > re->set_pool_size) {
+        size = max(re->set_pool_size * 2, re->set_pool_len + nb);
+        set = realloc(re->set_pool, size * sizeof(int));
+        if (!set)
+            return -1;
+        re->set_pool = set;
+        re->set_pool_size = size;
+    }
+    index = re->nb_states++;
+    st = &re->states[index];
+    st->set = re->set_pool_len;
+    st->nb_set = nb;
+    memcpy(re->set_pool + st->set, re->work, nb * sizeof(int));
+    re->set_pool_len += nb;
+    st->hash_next = re->hash_table[h];
+    re->hash_table[h] = index;
+    for(i = 0; i < 256; i++)
+        re->trans[index * 256 + i] = -1;
+
+    st->flags = flags;
+    if (nb == 0 && !(flags & REGEX_DFA_UNANCHORED))
+        st->flags |= REGEX_DFA_DEAD;
+    for(i = 0; i < nb; i++) {
+        if (re->nodes[re->work[i]].type == RE_MATCH)
+            st->flags |= REGEX_DFA_ACCEPT;
+    }
+    if (!(st->flags & REGEX_DFA_ACCEPT)) {
+        re->gen++;
+        memcpy(re->work1, re->work, nb * sizeof(int));
+        for(i = 0; i < nb; i++)
+            re->mark[re->work1[i]] = re->gen;
+        nb1 = re_closure_eol(re, re->work1, nb,
+                             (flags & REGEX_DFA_BOL) != 0);
+        for(i = nb; i < nb1; i++) {
+            if (re->nodes[re->work1[i]].type == RE_MATCH)
+                st->flags |= REGEX_DFA_ACCEPT_EOL;
+        }
+    }
+    return index;
+}
+
+/* The BOL flag is only kept in the states if the pattern contains
+   '^': an EOL assertion followed by '^' then holds at an empty line. */
+static int regex_bol_flag(QERegex *re, int bol)
+{
+    return (bol && re->has_bol) ? REGEX_DFA_BOL : 0;
+}
+
+static int regex_start_state(QERegex *re, int unanchored, int bol)
+{
+    int index, nb;
+
+    index = re->start_states[unanchored][bol];
+    if (index < 0) {
+        re->gen++;
+        nb = re_closure(re, re->work, 0, re->start, bol);
+        index = regex_find_state(re, nb,
+                                 (unanchored ? REGEX_DFA_UNANCHORED : 0) |
+                                 regex_bol_flag(re, bol));
+        if (index >= 0 && unanchored && !regex_bol_flag(re, bol) &&
+            !re->nullable)
+            re->states[index].flags |= REGEX_DFA_IDLE;
+        re->start_states[unanchored][bol] = index;
+    }
+    return index;
+}
+
+/* compute the transition of the state 'index' on the byte 'c' */
+static int regex_next_state(QERegex *re, int index, int c)
+{
+    RegexState *st = &re->states[index];
+    RegexNode *node;
+    int i, nb, nb1, bol, flags, next, nb_flushes;
+
+    flags = st->flags & REGEX_DFA_UNANCHORED;
+    nb1 = st->nb_set;
+    memcpy(re->work1, re->set_pool + st->set, nb1 * sizeof(int));
+    if (c == '\n') {
+        /* the EOL assertions hold before a newline */
+        re->gen++;
+        for(i = 0; i < nb1; i++)
+            re->mark[re->work1[i]] = re->gen;
+        nb1 = re_closure_eol(re, re->work1, nb1,
+                             (st->flags & REGEX_DFA_BOL) != 0);
+    }
+    bol = (c == '\n');
+    re->gen++;
+    nb = 0;
+    for(i = 0; i < nb1; i++) {
+        node = &re->nodes[re->work1[i]];
+        if (node->type == RE_CHAR && class_test(&re->classes[node->arg], c))
+            nb = re_closure(re, re->work, nb, node->out, bol);
+    }
+    if (flags & REGEX_DFA_UNANCHORED)
+        nb = re_closure(re, re->work, nb, re->start, bol);
+    nb_flushes = re->nb_flushes;
+    next = regex_find_state(re, nb, flags | regex_bol_flag(re, bol));
+    /* 'index' is no longer valid if the DFA was flushed */
+    if (next >= 0 && re->nb_flushes == nb_flushes)
+        re->trans[index * 256 + c] = next;
+    return next;
+}
+
+static inline int regex_next(QERegex *re, int index, int c)
+{
+    int next;
+
+    next = re->trans[index * 256 + c];
+    if (next < 0)
+        next = regex_next_state(re, index, c);
+    return next;
+}
+
+/* return the same NFA node set without the unanchored start */
+static int regex_anchored_state(QERegex *re, int index)
+{
+    RegexState *st = &re->states[index];
+
+    memcpy(re->work, re->set_pool + st->set, st->nb_set * sizeof(int));
+    return regex_find_state(re, st->nb_set, st->flags & REGEX_DFA_BOL);
+}
+
+void regex_free(QERegex *re)
+{
+    if (!re)
+        return;
+    free(re->nodes);
+    free(re->classes);
+    free(re->states);
+    free(re->trans);
+    free(re->set_pool);
+    free(re->mark);
+    free(re->stack);
+    free(re->work);
+    free(re->work1);
+    free(re);
+}
+
+/* Compile the 'len' bytes of 'pattern'. SEARCH_FLAG_IGNORECASE and
+   SEARCH_FLAG_SMARTCASE are handled as in eb_search(). Return NULL
+   and an error message in '*error_ptr' if the pattern is invalid. */
+QERegex *regex_compile(const u8 *pattern, int len, int flags,
+                       const char **error_ptr)
+{
+    RegexParser rp1, *rp = &rp1;
+    QERegex *re;
+    RegexFrag f;
+    int i, n, c, upper;
+
+    re = malloc(sizeof(QERegex));
+    if (!re) {
+        *error_ptr = "out of memory";
+        return NULL;
+    }
+    memset(re, 0, sizeof(QERegex));
+
+    if (flags & SEARCH_FLAG_SMARTCASE) {
+        /* escaped letters such as \W do not count */
+        upper = 0;
+        for(i = 0; i < len; i++) {
+            c = pattern[i];
+            if (c == '\\')
+                i++;
+            else if (isupper(c))
+                upper = 1;
+        }
+        if (!upper)
+            flags |= SEARCH_FLAG_IGNORECASE;
+    }
+    re->ignorecase = (flags & SEARCH_FLAG_IGNORECASE) != 0;
+
+    rp->re = re;
+    rp->p = pattern;
+    rp->end = pattern + len;
+    rp->error = NULL;
+    if (re_parse_alt(rp, &f) < 0)
+        goto fail;
+    if (rp->p < rp->end) {
+        rp->error = "unmatched )";
+        goto fail;
+    }
+    n = re_new_node(rp, RE_MATCH, -1, -1, 0);
+    if (n < 0)
+        goto fail;
+    re_patch(re, f.out, n);
+    re->start = f.start;
+
+    re->states = malloc(REGEX_MAX_STATES * sizeof(RegexState));
+    re->trans = malloc(REGEX_MAX_STATES * 256 * sizeof(int));
+    re->mark = malloc(re->nb_nodes * sizeof(int));
+    re->stack = malloc((2 * re->nb_nodes + 1) * sizeof(int));
+    re->work = malloc(re->nb_nodes * sizeof(int));
+    re->work1 = malloc(re->nb_nodes * sizeof(int));
+    re->set_pool_size = 256;
+    re->set_pool = malloc(re->set_pool_size * sizeof(int));
+    if (!re->states || !re->trans || !re->mark || !re->stack ||
+        !re->work || !re->work1 || !re->set_pool) {
+        rp->error = "out of memory";
+        goto fail;
+    }
+    memset(re->mark, 0, re->nb_nodes * sizeof(int));
+    regex_flush(re);
+
+    /* bytes that can start a match, to skip the other ones quickly */
+    for(i = 0; i < 2; i++) {
+        n = regex_start_state(re, 0, i);
+        if (re->states[n].flags & (REGEX_DFA_ACCEPT | REGEX_DFA_ACCEPT_EOL))
+            re->nullable = 1;
+    }
+    for(c = 0; c < 256 && !re->nullable; c++) {
+        for(i = 0; i < 2; i++) {
+            n = regex_next(re, regex_start_state(re, 0, i), c);
+            if (!(re->states[n].flags & REGEX_DFA_DEAD))
+                re->first[c] = 1;
+        }
+    }
+    return re;
+
+ fail:
+    *error_ptr = rp->error;
+    regex_free(re);
+    return NULL;
+}
+
+typedef struct RegexReader {
+    EditBuffer *b;
+    const u8 *data;
+    int start, size;
+} RegexReader;
+
+static inline int regex_getc(RegexReader *r, int pos)
+{
+    if (pos < r->start || pos >= r->start + r->size) {
+        r->data = eb_get_page(r->b, pos, &r->start, &r->size);
+        if (!r->data)
+            return -1;
+    }
+    return r->data[pos - r->start];
+}
+
+static int regex_bol(RegexReader *r, int pos)
+{
+    return pos == 0 || regex_getc(r, pos - 1) == '\n';
+}
+
+/* Return the end of the first match ending after 'pos' among those
+   starting in [pos, limit), -1 if none, or -2 if aborted. */
+static int regex_first_end(QERegex *re, RegexReader *r, int pos, int limit,
+                           CSSAbortFunc *abort_func, void *abort_opaque)
+{
+    const u8 *data;
+    int total_size = r->b->total_size;
+    int index, flags, anchored, start, size, n, count;
+
+    /* create the idle state first so that it gets its flag */
+    regex_start_state(re, 1, 0);
+    index = regex_start_state(re, 1, regex_bol(r, pos));
+    anchored = 0;
+    count = 0;
+    for(;;) {
+        /* no match starts after the byte at 'limit - 1' */
+        if (!anchored && pos >= limit - 1) {
+            index = regex_anchored_state(re, index);
+            anchored = 1;
+        }
+        if (index < 0)
+            return -1;
+        flags = re->states[index].flags;
+        if (flags & REGEX_DFA_ACCEPT)
+            return pos;
+        if (flags & REGEX_DFA_DEAD)
+            return -1;
+        if (pos >= total_size)
+            return (flags & REGEX_DFA_ACCEPT_EOL) ? pos : -1;
+        if ((++count % 16) == 0 && abort_func && abort_func(abort_opaque))
+            return -2;
+        data = eb_get_page(r->b, pos, &start, &size);
+        n = start + size;
+        if (!anchored && n > limit - 1)
+            n = limit - 1;
+        /* scan the page data up to the next accepting or dead state */
+        while (pos < n) {
+            if (flags & REGEX_DFA_IDLE) {
+                while (pos < n && !re->first[data[pos - start]] &&
+                       data[pos - start] != '\n')
+                    pos++;
+                if (pos >= n)
+                    break;
+            }
+            if (data[pos - start] == '\n' && (flags & REGEX_DFA_ACCEPT_EOL))
+                return pos;
+            index = regex_next(re, index, data[pos - start]);
+            pos++;
+            if (index < 0)
+                return -1;
+            flags = re->states[index].flags;
+            if (flags & (REGEX_DFA_ACCEPT | REGEX_DFA_DEAD))
+                break;
+        }
+    }
+}
+
+/* return the end of the longest match starting at 'pos', -1 if none
+   or -2 if aborted */
+static int regex_match_at(QERegex *re, RegexReader *r, int pos,
+                          CSSAbortFunc *abort_func, void *abort_opaque)
+{
+    int total_size = r->b->total_size;
+    int index, flags, last, c, count;
+
+    if (pos < total_size && !re->nullable &&
+        !re->first[regex_getc(r, pos)])
+        return -1;
+    index = regex_start_state(re, 0, regex_bol(r, pos));
+    last = -1;
+    count = 0;
+    while (index >= 0) {
+        if ((++count % 65536) == 0 && abort_func && abort_func(abort_opaque))
+            return -2;
+        flags = re->states[index].flags;
+        if (flags & REGEX_DFA_ACCEPT)
+            last = pos;
+        if (flags & REGEX_DFA_DEAD)
+            break;
+        if (pos >= total_size) {
+            if (flags & REGEX_DFA_ACCEPT_EOL)
+                last = pos;
+            break;
+        }
+        c = regex_getc(r, pos);
+        if (c == '\n' && (flags & REGEX_DFA_ACCEPT_EOL))
+            last = pos;
+        index = regex_next(re, index, c);
+        pos++;
+    }
+    return last;
+}
+
+/* NFA thread of the start scans: a node and the start of its match */
+typedef struct RegexStart {
+    int node;
+    int start;
+} RegexStart;
+
+/* add to 'list' the nodes reachable from 'n' at a position where the
+   BOL and EOL assertions are 'bol' and 'eol', for a match beginning
+   at 'start'. A node already in the list is not added again, so the
+   first thread which reaches it wins. */
+static int re_add_start(QERegex *re, RegexStart *list, int nb, int n,
+                        int start, int bol, int eol)
+{
+    RegexNode *node;
+    int sp;
+
+    sp = 0;
+    re->stack[sp++] = n;
+    while (sp > 0) {
+        n = re->stack[--sp];
+        if (n < 0 || re->mark[n] == re->gen)
+            continue;
+        re->mark[n] = re->gen;
+        node = &re->nodes[n];
+        switch(node->type) {
+        case RE_SPLIT:
+            re->stack[sp++] = node->out1;
+            re->stack[sp++] = node->out;
+            break;
+        case RE_EMPTY:
+        case RE_SAVE:
+            re->stack[sp++] = node->out;
+            break;
+        case RE_BOL:
+            if (bol)
+                re->stack[sp++] = node->out;
+            break;
+        case RE_EOL:
+            if (eol)
+                re->stack[sp++] = node->out;
+            break;
+        default:
+            list[nb].node = n;
+            list[nb].start = start;
+            nb++;
+            break;
+        }
+    }
+    return nb;
+}
+
+/* Return the smallest start of a match beginning in [pos, limit), or
+   the largest one if 'latest' is true. Return -1 if none or -2 if
+   aborted. The text is scanned once with a NFA whose threads carry
+   the start of their match. The threads are kept sorted so that the
+   best start wins when two of them reach the same node: they have
+   the same future, so the other one can be dropped. */
+static int regex_scan_start(QERegex *re, RegexReader *r, int pos, int limit,
+                            int latest, CSSAbortFunc *abort_func,
+                            void *abort_opaque)
+{
+    int total_size = r->b->total_size;
+    RegexStart *list, *next;
+    RegexNode *node;
+    int i, nb, nb_next, best, add, c, bol, eol, count;
+
+    list = malloc(re->nb_nodes * sizeof(RegexStart));
+    next = malloc(re->nb_nodes * sizeof(RegexStart));
+    if (!list || !next) {
+        free(list);
+        free(next);
+        return -1;
+    }
+    best = -1;
+    nb_next = 0;
+    count = 0;
+    for(;;) {
+        /* no match starts after the best one in the leftmost case */
+        add = pos < limit && (latest || best < 0);
+        if (nb_next == 0) {
+            if (!add)
+                break;
+            /* skip the bytes which cannot start a match */
+            if (!re->nullable) {
+                while (pos < limit && pos < total_size &&
+                       !re->first[regex_getc(r, pos)]) {
+                    pos++;
+                    if ((++count % 65536) == 0 && abort_func &&
+                        abort_func(abort_opaque)) {
+                        best = -2;
+                        break;
+                    }
+                }
+                if (best == -2 || pos >= limit || pos >= total_size)
+                    break;
+            }
+        }
+        if ((++count % 65536) == 0 && abort_func &&
+            abort_func(abort_opaque)) {
+            best = -2;
+            break;
+        }
+        c = (pos < total_size) ? regex_getc(r, pos) : -1;
+        bol = regex_bol(r, pos);
+        eol = (c < 0 || c == '\n');
+        /* 'next' holds the targets of the transitions on the previous
+           byte. The threads of 'list' are in increasing start order, or
+           decreasing if 'latest', and the new start goes at the right
+           end. */
+        re->gen++;
+        nb = 0;
+        if (add && latest)
+            nb = re_add_start(re, list, nb, re->start, pos, bol, eol);
+        for(i = 0; i < nb_next; i++) {
+            nb = re_add_start(re, list, nb, next[i].node, next[i].start,
+                              bol, eol);
+        }
+        if (add && !latest)
+            nb = re_add_start(re, list, nb, re->start, pos, bol, eol);
+        nb_next = 0;
+        for(i = 0; i < nb; i++) {
+            /* the threads after a match cannot give a better start */
+            if (best >= 0 &&
+                (latest ? list[i].start <= best : list[i].start >= best))
+                continue;
+            node = &re->nodes[list[i].node];
+            if (node->type == RE_MATCH) {
+                best = list[i].start;
+            } else if (node->type == RE_CHAR && c >= 0 &&
+                       class_test(&re->classes[node->arg], c)) {
+                next[nb_next].node = node->out;
+                next[nb_next].start = list[i].start;
+                nb_next++;
+            }
+        }
+        if (c < 0)
+            break;
+        pos++;
+    }
+    free(list);
+    free(next);
+    return best;
+}
+
+/* Return the leftmost longest match starting in [offset, limit) and
+   store its end in '*end_ptr', or -1 if not found or aborted. The
+   match may end after 'limit'. */
+int eb_regex_search_forward(EditBuffer *b, QERegex *re, int offset,
+                            int limit, int *end_ptr,
+                            CSSAbortFunc *abort_func, void *abort_opaque)
+{
+    RegexReader r1, *r = &r1;
+    int start, end, first_end;
+
+    r->b = b;
+    r->data = NULL;
+    r->start = r->size = 0;
+    if (offset < 0)
+        offset = 0;
+    if (limit > b->total_size + 1)
+        limit = b->total_size + 1;
+    if (offset >= limit)
+        return -1;
+    first_end = regex_first_end(re, r, offset, limit,
+                                abort_func, abort_opaque);
+    if (first_end < 0)
+        return -1;
+    /* the leftmost match starts before the first match end */
+    start = regex_scan_start(re, r, offset, min(limit, first_end + 1), 0,
+                             abort_func, abort_opaque);
+    if (start < 0)
+        return -1;
+    end = regex_match_at(re, r, start, abort_func, abort_opaque);
+    if (end < 0)
+        return -1;
+    *end_ptr = end;
+    return start;
+}
+
+/* Search 're' in 'b'. In the forward direction, the leftmost match
+   starting at or after 'offset' is found. In the backward direction,
+   the match starting last before 'offset' is found. The longest
+   match at the found position is taken and its end is stored in
+   '*end_ptr'. Return its start or -1 if not found or aborted. */
+int eb_regex_search(EditBuffer *b, QERegex *re, int offset, int dir,
+                    int *end_ptr, CSSAbortFunc *abort_func,
+                    void *abort_opaque)
+{
+    RegexReader r1, *r = &r1;
+    int total_size = b->total_size;
+    int start, end, first_end, lo, hi;
+
+    r->b = b;
+    r->data = NULL;
+    r->start = r->size = 0;
+    if (dir < 0) {
+        hi = min(offset, total_size);
+        while (hi > 0) {
+            lo = max(hi - REGEX_BLOCK_SIZE, 0);
+            first_end = regex_first_end(re, r, lo, hi,
+                                        abort_func, abort_opaque);
+            if (first_end == -2)
+                return -1;
+            if (first_end >= 0) {
+                start = regex_scan_start(re, r, lo, hi, 1,
+                                         abort_func, abort_opaque);
+                if (start == -2)
+                    return -1;
+                if (start >= 0) {
+                    end = regex_match_at(re, r, start,
+                                         abort_func, abort_opaque);
+                    if (end < 0)
+                        return -1;
+                    *end_ptr = end;
+                    return start;
+                }
+            }
+            hi = lo;
+        }
+    } else {
+        return eb_regex_search_forward(b, re, offset, total_size + 1,
+                                       end_ptr, abort_func, abort_opaque);
+    }
+    return -1;
+}
+
+/* Pike VM thread list used to compute the groups */
+typedef struct RegexThread {
+    int node;
+    int groups[2 * REGEX_MAX_GROUPS];
+} RegexThread;
+
+static int re_add_thread(QERegex *re, RegexReader *r, RegexThread *list,
+                         int nb, int n, int *groups, int pos)
+{
+    RegexNode *node;
+    int save;
+
+    if (n < 0 || re->mark[n] == re->gen)
+        return nb;
+    re->mark[n] = re->gen;
+    node = &re->nodes[n];
+    switch(node->type) {
+    case RE_SPLIT:
+        nb = re_add_thread(re, r, list, nb, node->out, groups, pos);
+        return re_add_thread(re, r, list, nb, node->out1, groups, pos);
+    case RE_EMPTY:
+        return re_add_thread(re, r, list, nb, node->out, groups, pos);
+    case RE_SAVE:
+        save = groups[node->arg];
+        groups[node->arg] = pos;
+        nb = re_add_thread(re, r, list, nb, node->out, groups, pos);
+        groups[node->arg] = save;
+        return nb;
+    case RE_BOL:
+        if (!regex_bol(r, pos))
+            return nb;
+        return re_add_thread(re, r, list, nb, node->out, groups, pos);
+    case RE_EOL:
+        if (pos < r->b->total_size && regex_getc(r, pos) != '\n')
+            return nb;
+        return re_add_thread(re, r, list, nb, node->out, groups, pos);
+    default:
+        list[nb].node = n;
+        memcpy(list[nb].groups, groups, sizeof(list[nb].groups));
+        return nb + 1;
+    }
+}
+
+/* Compute the groups of the match [start, end) found by
+   eb_regex_search(). Group 0 is the whole match. The start and end
+   offsets of group 'n' are stored in 'groups[2 * n]' and
+   'groups[2 * n + 1]', or -1 if it did not participate. Return the
+   number of groups or -1 if error. */
+int eb_regex_groups(EditBuffer *b, QERegex *re, int start, int end,
+                    int *groups)
+{
+    RegexReader r1, *r = &r1;
+    RegexThread *clist, *nlist, *tmp;
+    RegexNode *node;
+    int g[2 * REGEX_MAX_GROUPS];
+    int i, nb, nb1, pos, c, found;
+
+    r->b = b;
+    r->data = NULL;
+    r->start = r->size = 0;
+    clist = malloc(re->nb_nodes * sizeof(RegexThread));
+    nlist = malloc(re->nb_nodes * sizeof(RegexThread));
+    if (!clist || !nlist) {
+        free(clist);
+        free(nlist);
+        return -1;
+    }
+    for(i = 0; i < 2 * REGEX_MAX_GROUPS; i++)
+        g[i] = -1;
+    re->gen++;
+    nb = re_add_thread(re, r, clist, 0, re->start, g, start);
+    found = 0;
+    for(pos = start; nb > 0; pos++) {
+        c = (pos < end) ? regex_getc(r, pos) : -1;
+        re->gen++;
+        nb1 = 0;
+        for(i = 0; i < nb; i++) {
+            node = &re->nodes[clist[i].node];
+            if (node->type == RE_MATCH) {
+                if (pos == end) {
+                    /* the threads are in priority order */
+                    memcpy(g, clist[i].groups, sizeof(g));
+                    found = 1;
+                    break;
+                }
+            } else if (node->type == RE_CHAR && c >= 0 &&
+                       class_test(&re->classes[node->arg], c)) {
+                nb1 = re_add_thread(re, r, nlist, nb1, node->out,
+                                    clist[i].groups, pos + 1);
+            }
+        }
+        if (pos >= end)
+            break;
+        tmp = clist;
+        clist = nlist;
+        nlist = tmp;
+        nb = nb1;
+    }
+    free(clist);
+    free(nlist);
+    if (!found)
+        return -1;
+    groups[0] = start;
+    groups[1] = end;
+    for(i = 1; i < REGEX_MAX_GROUPS; i++) {
+        groups[2 * i] = g[2 * (i - 1)];
+        groups[2 * i + 1] = g[2 * (i - 1) + 1];
+    }
+    return re->nb_groups + 1;
+}
@@ -0,0 +1,805 @@
+/*
+ * Buffer search engine for QEmacs.
+ * Copyright (c) 2020 Himanshu Chauhan
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * The pattern is searched directly in the page data with the
+ * Boyer-Moore-Horspool algorithm. In the forward direction, a SIMD
+ * filter on the first and last bytes of the pattern selects the
+ * candidates first. Only the windows straddling a page boundary are
+ * copied with eb_read().
+ */
+#include "qe.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* number of pages scanned between two calls of the abort function */
+#define SEARCH_ABORT_PAGES 16
+
+struct SearchPattern {
+    u8 pat[SEARCH_MAX_SIZE];  /* case folded if SEARCH_FLAG_IGNORECASE */
+    int size;
+    int flags;
+    u8 fold[256];             /* case folding of the buffer bytes */
+    int skip[256];            /* forward shift for the last window byte */
+    int skip_back[256];       /* backward shift for the first window byte */
+};
+
+static void search_init(SearchPattern *sp, const u8 *buf, int size,
+                        int flags)
+{
+    int shift[256], shift_back[256];
+    int i, c, lower_count, upper_count;
+
+    /* analyse buffer if smart case */
+    if (flags & SEARCH_FLAG_SMARTCASE) {
+        upper_count = 0;
+        lower_count = 0;
+        for(i=0;i<size;i++) {
+            c = buf[i];
+            lower_count += islower(c) != 0;
+            upper_count += isupper(c) != 0;
+        }
+        if (lower_count > 0 && upper_count == 0)
+            flags |= SEARCH_FLAG_IGNORECASE;
+    }
+    sp->flags = flags;
+    sp->size = size;
+
+    for(c=0;c<256;c++) {
+        if (flags & SEARCH_FLAG_IGNORECASE)
+            sp->fold[c] = toupper(c);
+        else
+            sp->fold[c] = c;
+    }
+    for(i=0;i<size;i++)
+        sp->pat[i] = sp->fold[buf[i]];
+
+    /* the shifts are computed on the folded bytes */
+    for(c=0;c<256;c++) {
+        shift[c] = size;
+        shift_back[c] = size;
+    }
+    for(i=0;i<size-1;i++)
+        shift[sp->pat[i]] = size - 1 - i;
+    for(i=size-1;i>0;i--)
+        shift_back[sp->pat[i]] = i;
+    for(c=0;c<256;c++) {
+        sp->skip[c] = shift[sp->fold[c]];
+        sp->skip_back[c] = shift_back[sp->fold[c]];
+    }
+}
+
+static inline int search_match(const SearchPattern *sp, const u8 *p)
+{
+    int i;
+
+    if (!(sp->flags & SEARCH_FLAG_IGNORECASE))
+        return !memcmp(p, sp->pat, sp->size);
+    for(i=0;i<sp->size;i++) {
+        if (sp->fold[p[i]] != sp->pat[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* return the index of the first match starting in [0, lim] of
+   'data', or -1 and set '*next_ptr' to the next index to test */
+static int search_chunk_forward(const SearchPattern *sp, const u8 *data,
+                                int lim, int *next_ptr)
+{
+    int i, c, m, last;
+
+    m = sp->size;
+    last = sp->pat[m - 1];
+    i = 0;
+#ifdef __SSE2__
+    {
+        __m128i f1, f2, l1, l2, v1, v2;
+        int mask;
+
+        /* 16 windows at a time: keep those whose first and last bytes
+           match */
+        f1 = _mm_set1_epi8(sp->pat[0]);
+        f2 = _mm_set1_epi8(tolower(sp->pat[0]));
+        l1 = _mm_set1_epi8(last);
+        l2 = _mm_set1_epi8(tolower(last));
+        if (!(sp->flags & SEARCH_FLAG_IGNORECASE)) {
+            f2 = f1;
+            l2 = l1;
+        }
+        for(; i + 15 <= lim; i += 16) {
+            v1 = _mm_loadu_si128((const __m128i *)(data + i));
+            v2 = _mm_loadu_si128((const __m128i *)(data + i + m - 1));
+            mask = _mm_movemask_epi8(
+                _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(v1, f1),
+                                           _mm_cmpeq_epi8(v1, f2)),
+                              _mm_or_si128(_mm_cmpeq_epi8(v2, l1),
+                                           _mm_cmpeq_epi8(v2, l2))));
+            while (mask) {
+                c = __builtin_ctz(mask);
+                if (search_match(sp, data + i + c))
+                    return i + c;
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+    while (i <= lim) {
+        c = data[i + m - 1];
+        if (sp->fold[c] == last && search_match(sp, data + i))
+            return i;
+        i += sp->skip[c];
+    }
+    *next_ptr = i;
+    return -1;
+}
+
+/* return the index of the last match starting in [0, i] of 'data',
+   or -1 and set '*next_ptr' to the next index to test */
+static int search_chunk_backward(const SearchPattern *sp, const u8 *data,
+                                 int i, int *next_ptr)
+{
+    int c, first;
+
+    first = sp->pat[0];
+    while (i >= 0) {
+        c = data[i];
+        if (sp->fold[c] == first && search_match(sp, data + i))
+            return i;
+        i -= sp->skip_back[c];
+    }
+    *next_ptr = i;
+    return -1;
+}
+
+/* XXX: use UTF8 for words/chars ? */
+static int search_word_ok(EditBuffer *b, int offset, int size)
+{
+    u8 ch;
+
+    if (offset > 0) {
+        eb_read(b, offset - 1, &ch, 1);
+        if (isword(ch))
+            return 0;
+    }
+    if (offset + size < b->total_size) {
+        eb_read(b, offset + size, &ch, 1);
+        if (isword(ch))
+            return 0;
+    }
+    return 1;
+}
+
+/* return the first match of 'sp' starting in [pos, limit), or -1 if
+   not found or aborted */
+static int search_forward(EditBuffer *b, const SearchPattern *sp,
+                          int pos, int limit,
+                          CSSAbortFunc *abort_func, void *abort_opaque)
+{
+    u8 window[SEARCH_MAX_SIZE];
+    const u8 *data;
+    int size = sp->size;
+    int lim, start, page_size, i, next, count;
+
+    /* last window start */
+    lim = min(b->total_size - size, limit - 1);
+    if (pos < 0)
+        pos = 0;
+    count = 0;
+    next = 0;
+    while (pos <= lim) {
+        if ((++count % SEARCH_ABORT_PAGES) == 0 &&
+            abort_func && abort_func(abort_opaque))
+            return -1;
+        data = eb_get_page(b, pos, &start, &page_size);
+        if (pos + size <= start + page_size) {
+            /* the windows starting in [pos, lim] are in the page */
+            i = search_chunk_forward(sp, data + pos - start,
+                                     min(start + page_size - size, lim) - pos,
+                                     &next);
+            if (i < 0) {
+                pos += next;
+                continue;
+            }
+            pos += i;
+        } else {
+            eb_read(b, pos, window, size);
+            if (!search_match(sp, window)) {
+                pos += sp->skip[window[size - 1]];
+                continue;
+            }
+        }
+        if (!(sp->flags & SEARCH_FLAG_WORD) ||
+            search_word_ok(b, pos, size))
+            return pos;
+        pos++;
+    }
+    return -1;
+}
+
+/* Search 'buf' of 'size' bytes in 'b'. In the forward direction, the
+   first match starting at or after 'offset' is found. In the backward
+   direction, the last match starting before 'offset' is found. Return
+   the match offset or -1 if not found or aborted. */
+int eb_search(EditBuffer *b, int offset, int dir, u8 *buf, int size,
+              int flags, CSSAbortFunc *abort_func, void *abort_opaque)
+{
+    SearchPattern sp1, *sp = &sp1;
+    u8 window[SEARCH_MAX_SIZE];
+    const u8 *data;
+    int total_size = b->total_size;
+    int pos, start, page_size, i, next, count;
+
+    if (size <= 0 || size >= SEARCH_MAX_SIZE || size > total_size)
+        return -1;
+    search_init(sp, buf, size, flags);
+
+    if (dir >= 0)
+        return search_forward(b, sp, offset, total_size,
+                              abort_func, abort_opaque);
+
+    count = 0;
+    next = 0;
+    if (offset > total_size - size)
+        pos = total_size - size;
+    else
+        pos = offset - 1;
+    while (pos >= 0) {
+        if ((++count % SEARCH_ABORT_PAGES) == 0 &&
+            abort_func && abort_func(abort_opaque))
+            return -1;
+        data = eb_get_page(b, pos, &start, &page_size);
+        if (pos + size <= start + page_size) {
+            /* the window is in the page */
+            i = search_chunk_backward(sp, data, pos - start, &next);
+            if (i < 0) {
+                pos = start + next;
+                continue;
+            }
+            pos = start + i;
+        } else {
+            eb_read(b, pos, window, size);
+            if (!search_match(sp, window)) {
+                pos -= sp->skip_back[window[0]];
+                continue;
+            }
+        }
+        if (!(sp->flags & SEARCH_FLAG_WORD) ||
+            search_word_ok(b, pos, size))
+            return pos;
+        pos--;
+    }
+    return -1;
+}
+
+/* prepared patterns, for the repeated searches of the same string. The
+   search in memory is used by the project grep threads, so it may not
+   touch the editor state */
+
+SearchPattern *search_pattern_new(const u8 *buf, int size, int flags)
+{
+    SearchPattern *sp;
+
+    if (size <= 0 || size >= SEARCH_MAX_SIZE)
+        return NULL;
+    sp = malloc(sizeof(SearchPattern));
+    if (!sp)
+        return NULL;
+    search_init(sp, buf, size, flags);
+    return sp;
+}
+
+void search_pattern_free(SearchPattern *sp)
+{
+    free(sp);
+}
+
+/* return the offset of the first match of 'sp' starting at or after
+   'pos' in the 'size' bytes of 'data', or -1 if none */
+int search_pattern_find(const SearchPattern *sp, const u8 *data, int size,
+                        int pos)
+{
+    int lim, i, next, m = sp->size;
+
+    lim = size - m;
+    next = 0;
+    while (pos <= lim) {
+        i = search_chunk_forward(sp, data + pos, lim - pos, &next);
+        if (i < 0)
+            return -1;
+        pos += i;
+        if (!(sp->flags & SEARCH_FLAG_WORD) ||
+            ((pos == 0 || !isword(data[pos - 1])) &&
+             (pos + m == size || !isword(data[pos + m]))))
+            return pos;
+        pos++;
+    }
+    return -1;
+}
+
+/* same as eb_search() in the forward direction with a prepared
+   pattern */
+int eb_search_pattern(EditBuffer *b, int offset, const SearchPattern *sp,
+                      CSSAbortFunc *abort_func, void *abort_opaque)
+{
+    return search_forward(b, sp, offset, b->total_size,
+                          abort_func, abort_opaque);
+}
+
+/************************************************************/
+/* match index: the matches of the current search in the whole buffer,
+   used to highlight them and to count them. It is built in background
+   and updated after each modification by searching again only the
+   modified area. */
+
+#define SEARCH_INDEX_MAX_MATCHES  (1 << 20)
+#define SEARCH_INDEX_CHUNK        (256 * 1024) /* bytes searched between two clock checks */
+#define SEARCH_INDEX_SLICE        10  /* duration of a slice, in ms */
+#define SEARCH_INDEX_IDLE_DELAY   20  /* delay between two slices, in ms */
+#define SEARCH_INDEX_LINE_DELAY   2   /* max duration of the direct search of a line, in ms */
+#define SEARCH_INDEX_LINE_SIZE    1024
+
+typedef struct SearchMatch {
+    int start, end;
+} SearchMatch;
+
+struct SearchIndex {
+    EditBuffer *b;
+    u8 buf[SEARCH_MAX_SIZE];
+    int size;
+    int flags;
+    SearchPattern sp;
+    QERegex *regex;     /* if SEARCH_FLAG_REGEX */
+    /* sorted non overlapping matches. Each one is the first match
+       after the end of the previous one, as found by successive
+       forward searches. The empty matches are not stored. */
+    SearchMatch *matches;
+    int nb_matches;
+    int max_matches;
+    /* the matches starting after 'indexed_end' are not known yet and
+       the search restarts there. MAXINT once the buffer is indexed. */
+    int indexed_end;
+    /* the matches starting in [dirty_start, dirty_end) must be searched
+       again after a modification. The search restarts at
+       'dirty_start', which is MAXINT if nothing is modified. */
+    int dirty_start;
+    int dirty_end;
+    /* current match, highlighted differently */
+    int cur_start;
+    int cur_end;
+    QETimer *timer;
+    /* the searches are aborted at 'deadline'. A search aborted twice
+       at 'abort_pos' is given up and the index stays incomplete. */
+    int deadline;
+    int aborted;
+    int abort_pos;
+};
+
+static void search_index_timer_cb(void *opaque);
+
+/* abort function of the index searches */
+static int search_index_abort(void *opaque)
+{
+    SearchIndex *si = opaque;
+
+    if (get_clock_ms() < si->deadline)
+        return 0;
+    si->aborted = 1;
+    return 1;
+}
+
+/* return the first match starting in [pos, limit), or -1 if none or
+   if 'si->deadline' is reached */
+static int search_index_find(SearchIndex *si, int pos, int limit,
+                             int *end_ptr)
+{
+    si->aborted = 0;
+    if (si->regex)
+        return eb_regex_search_forward(si->b, si->regex, pos, limit,
+                                       end_ptr, search_index_abort, si);
+    pos = search_forward(si->b, &si->sp, pos, limit,
+                         search_index_abort, si);
+    *end_ptr = pos + si->sp.size;
+    return pos;
+}
+
+/* return the index of the first match ending after 'offset' */
+static int search_index_lookup(SearchIndex *si, int offset)
+{
+    int lo, hi, m;
+
+    lo = 0;
+    hi = si->nb_matches;
+    while (lo < hi) {
+        m = (lo + hi) >> 1;
+        if (si->matches[m].end > offset)
+            hi = m;
+        else
+            lo = m + 1;
+    }
+    return lo;
+}
+
+/* replace the matches [i, j) with 'nb' (0 or 1) matches */
+static int search_index_replace(SearchIndex *si, int i, int j,
+                                int nb, int start, int end)
+{
+    SearchMatch *m;
+    int n;
+
+    if (si->nb_matches - (j - i) + nb > si->max_matches) {
+        n = max(1024, si->max_matches * 2);
+        m = realloc(si->matches, n * sizeof(SearchMatch));
+        if (!m)
+            return -1;
+        si->matches = m;
+        si->max_matches = n;
+    }
+    m = si->matches;
+    if (j - i != nb) {
+        memmove(m + i + nb, m + j, (si->nb_matches - j) * sizeof(*m));
+        si->nb_matches += nb - (j - i);
+    }
+    if (nb) {
+        m[i].start = start;
+        m[i].end = end;
+    }
+    return 0;
+}
+
+/* search the modified area then the end of the buffer until
+   'deadline'. Return true if nothing is left to do. */
+static int search_index_advance(SearchIndex *si, int deadline)
+{
+    SearchMatch *m;
+    int total_size = si->b->total_size;
+    int pos, limit, start, end, next, i, j, nb;
+
+    si->deadline = deadline;
+    for(;;) {
+        if (si->dirty_start != MAXINT) {
+            pos = si->dirty_start;
+            /* the searches resynchronize as soon as the new one
+               restarts after the modified area where the old one
+               restarted */
+            if (pos >= si->dirty_end || pos >= si->indexed_end) {
+                si->indexed_end = max(si->indexed_end, pos);
+                si->dirty_start = MAXINT;
+                continue;
+            }
+        } else if (si->indexed_end != MAXINT) {
+            pos = si->indexed_end;
+            if (pos > total_size) {
+                si->indexed_end = MAXINT;
+                break;
+            }
+            /* too many matches: the end of the buffer is not indexed */
+            if (si->nb_matches >= SEARCH_INDEX_MAX_MATCHES)
+                return 1;
+        } else {
+            break;
+        }
+        if (get_clock_ms() >= deadline)
+            return 0;
+
+        limit = min(pos + SEARCH_INDEX_CHUNK, total_size + 1);
+        nb = 0;
+        start = search_index_find(si, pos, limit, &end);
+        if (si->aborted) {
+            /* retried from a new slice, then given up */
+            if (pos == si->abort_pos)
+                return 1;
+            si->abort_pos = pos;
+            return 0;
+        }
+        si->abort_pos = -1;
+        if (start < 0) {
+            next = limit;
+        } else if (end == start) {
+            next = start + 1;
+        } else {
+            next = end;
+            nb = 1;
+        }
+        /* the previous matches starting before 'next' are replaced */
+        m = si->matches;
+        i = search_index_lookup(si, pos);
+        for(j = i; j < si->nb_matches && m[j].start < next; j++)
+            continue;
+        if (!(nb && j == i + 1 && m[i].start == start && m[i].end == end)) {
+            /* the old search was not restarted at 'next' */
+            if (j > i && m[j - 1].end > next)
+                si->dirty_end = max(si->dirty_end, m[j - 1].end);
+            if (search_index_replace(si, i, j, nb, start, end) < 0)
+                return 1;
+        }
+        if (si->dirty_start != MAXINT)
+            si->dirty_start = next;
+        else
+            si->indexed_end = next;
+    }
+    return 1;
+}
+
+static void search_index_timer_cb(void *opaque)
+{
+    SearchIndex *si = opaque;
+
+    /* the timer is freed by the caller */
+    si->timer = NULL;
+
+    if (is_user_input_pending() ||
+        !search_index_advance(si, get_clock_ms() + SEARCH_INDEX_SLICE)) {
+        si->timer = qe_add_timer(SEARCH_INDEX_IDLE_DELAY, si,
+                                 search_index_timer_cb);
+    }
+    /* update the highlighting and the count */
+    edit_schedule_background_display(&qe_state);
+}
+
+/* move 'offset' as the text of [offset1, end1) is replaced by
+   'end1 - offset1 + delta' bytes */
+static inline int search_index_shift(int offset, int offset1, int end1,
+                                     int delta)
+{
+    if (offset == MAXINT)
+        return offset;
+    if (offset >= end1)
+        return offset + delta;
+    if (offset > offset1)
+        return offset1;
+    return offset;
+}
+
+/* called before each modification: the matches depending on the
+   modified text are removed and the area around it is marked as dirty */
+static void search_index_callback(EditBuffer *b, void *opaque,
+                                  enum LogOperation op,
+                                  int offset, int size)
+{
+    SearchIndex *si = opaque;
+    SearchMatch *m;
+    int end1, delta, w, lo, hi, start, dirty_end, i, j, k;
+
+    switch(op) {
+    case LOGOP_INSERT:
+        end1 = offset;
+        delta = size;
+        break;
+    case LOGOP_DELETE:
+        end1 = offset + size;
+        delta = -size;
+        break;
+    case LOGOP_WRITE:
+        end1 = offset + size;
+        delta = 0;
+        break;
+    default:
+        return;
+    }
+
+    /* a match depends on the chars before and after it with
+       SEARCH_FLAG_WORD. A regexp match is assumed to depend on its
+       lines only, so the modified lines are searched again. */
+    if (si->regex) {
+        w = 1;
+        lo = eb_goto_bol(b, offset);
+        hi = eb_next_line(b, end1);
+        start = lo;
+    } else {
+        w = (si->sp.flags & SEARCH_FLAG_WORD) != 0;
+        lo = offset;
+        hi = end1;
+        start = max(offset - si->sp.size, 0);
+    }
+    dirty_end = hi + delta + 1;
+
+    /* remove the matches depending on the modified text */
+    m = si->matches;
+    i = search_index_lookup(si, lo - w);
+    for(j = i; j < si->nb_matches && m[j].start - w < hi; j++)
+        continue;
+    if (j > i) {
+        start = min(start, m[i].start);
+        dirty_end = max(dirty_end, m[j - 1].end + delta);
+        search_index_replace(si, i, j, 0, 0, 0);
+    }
+    /* the search restarts after the previous match */
+    if (i > 0)
+        start = max(start, m[i - 1].end);
+    for(k = i; k < si->nb_matches; k++) {
+        m[k].start += delta;
+        m[k].end += delta;
+    }
+
+    if (si->cur_start < end1 && si->cur_end > offset) {
+        si->cur_start = si->cur_end = -1;
+    } else if (si->cur_start >= end1) {
+        si->cur_start += delta;
+        si->cur_end += delta;
+    }
+
+    si->indexed_end = search_index_shift(si->indexed_end,
+                                         offset, end1, delta);
+    if (si->dirty_start != MAXINT) {
+        si->dirty_start = min(start, search_index_shift(si->dirty_start,
+                                                        offset, end1, delta));
+        si->dirty_end = max(dirty_end, search_index_shift(si->dirty_end,
+                                                          offset, end1, delta));
+    } else if (start < si->indexed_end) {
+        si->dirty_start = start;
+        si->dirty_end = dirty_end;
+    }
+    if (!si->timer) {
+        si->timer = qe_add_timer(SEARCH_INDEX_IDLE_DELAY, si,
+                                 search_index_timer_cb);
+    }
+}
+
+/* Index the matches of 'buf' of 'size' bytes in 'b' with the search
+   'flags' and set the current match to [cur_start, cur_end). The
+   index is kept if the search did not change. */
+void search_index_set(EditBuffer *b, const u8 *buf, int size, int flags,
+                      int cur_start, int cur_end)
+{
+    SearchIndex *si = b->search_index;
+    QERegex *re;
+    const char *error;
+
+    if (!si || si->size != size || si->flags != flags ||
+        memcmp(si->buf, buf, size)) {
+        search_index_free(b);
+        if (size <= 0 || size >= SEARCH_MAX_SIZE)
+            return;
+        re = NULL;
+        if (flags & SEARCH_FLAG_REGEX) {
+            re = regex_compile(buf, size, flags, &error);
+            if (!re)
+                return;
+        }
+        si = malloc(sizeof(SearchIndex));
+        if (!si) {
+            regex_free(re);
+            return;
+        }
+        memset(si, 0, sizeof(SearchIndex));
+        si->b = b;
+        memcpy(si->buf, buf, size);
+        si->size = size;
+        si->flags = flags;
+        si->regex = re;
+        if (!re)
+            search_init(&si->sp, buf, size, flags);
+        si->indexed_end = 0;
+        si->dirty_start = MAXINT;
+        si->abort_pos = -1;
+        if (eb_add_callback(b, search_index_callback, si) < 0) {
+            regex_free(re);
+            free(si);
+            return;
+        }
+        b->search_index = si;
+        /* a first slice gives the count at once in most buffers */
+        if (!search_index_advance(si, get_clock_ms() + SEARCH_INDEX_SLICE)) {
+            si->timer = qe_add_timer(SEARCH_INDEX_IDLE_DELAY, si,
+                                     search_index_timer_cb);
+        }
+    }
+    si->cur_start = cur_start;
+    si->cur_end = cur_end;
+}
+
+void search_index_free(EditBuffer *b)
+{
+    SearchIndex *si = b->search_index;
+
+    if (!si)
+        return;
+    eb_free_callback(b, search_index_callback, si);
+    if (si->timer)
+        qe_kill_timer(si->timer);
+    regex_free(si->regex);
+    free(si->matches);
+    free(si);
+    b->search_index = NULL;
+}
+
+/* Return the number of indexed matches. The index of the current match
+   from 1 is stored in '*cur_ptr', or 0 if it is not indexed.
+   '*complete_ptr' is set to false while the index is built. */
+int search_index_count(EditBuffer *b, int *cur_ptr, int *complete_ptr)
+{
+    SearchIndex *si = b->search_index;
+    int i;
+
+    *cur_ptr = 0;
+    *complete_ptr = (si->dirty_start == MAXINT &&
+                     si->indexed_end == MAXINT);
+    if (si->cur_start >= 0) {
+        i = search_index_lookup(si, si->cur_start);
+        if (i < si->nb_matches && si->matches[i].start == si->cur_start)
+            *cur_ptr = i + 1;
+    }
+    return si->nb_matches;
+}
+
+/* color the chars of 'buf' starting in [start, end) with 'style'.
+   'offsets' gives the offset of each char. Return the index of the
+   first char after the colored ones. */
+static int search_index_color(unsigned int *buf, const int *offsets,
+                              int len, int i, int start, int end,
+                              int style)
+{
+    int i1;
+
+    while (i < len && offsets[i] < start)
+        i++;
+    for(i1 = i; i1 < len && offsets[i1] < end; i1++)
+        continue;
+    clear_color(buf + i, i1 - i);
+    set_color(buf + i, i1 - i, style);
+    return i1;
+}
+
+/* Highlight the matches in the 'len' chars of 'buf', which is the line
+   starting at 'offset'. The lines not indexed yet are searched
+   directly. */
+void search_index_highlight(EditBuffer *b, unsigned int *buf, int len,
+                            int offset)
+{
+    SearchIndex *si = b->search_index;
+    SearchMatch *m;
+    int offsets[SEARCH_INDEX_LINE_SIZE + 1];
+    int i, k, pos, line_end, start, end;
+
+    if (len > SEARCH_INDEX_LINE_SIZE)
+        len = SEARCH_INDEX_LINE_SIZE;
+    pos = offset;
+    for(i = 0; i < len; i++) {
+        offsets[i] = pos;
+        eb_nextc(b, pos, &pos);
+    }
+    offsets[len] = pos;
+    line_end = pos;
+
+    i = 0;
+    if (line_end <= si->indexed_end &&
+        (line_end <= si->dirty_start || offset >= si->dirty_end)) {
+        m = si->matches;
+        for(k = search_index_lookup(si, offset);
+            k < si->nb_matches && m[k].start < line_end; k++) {
+            i = search_index_color(buf, offsets, len, i, m[k].start,
+                                   m[k].end, QE_STYLE_SEARCH_HIGHLIGHT);
+        }
+    } else {
+        /* a long match must not stall the display */
+        si->deadline = get_clock_ms() + SEARCH_INDEX_LINE_DELAY;
+        pos = offset;
+        while ((start = search_index_find(si, pos, line_end, &end)) >= 0) {
+            i = search_index_color(buf, offsets, len, i, start, end,
+                                   QE_STYLE_SEARCH_HIGHLIGHT);
+            pos = max(end, start + 1);
+        }
+    }
+    if (si->cur_start >= 0) {
+        search_index_color(buf, offsets, len, 0, si->cur_start,
+                           si->cur_end, QE_STYLE_SEARCH_MATCH);
+    }
+}
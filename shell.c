@@ -529,8 +529,7 @@ static void shell_read_cb(void *opaque)
     for(i=0;i<len;i++) tty_emulate(s, buf[i]);
 
     /* now we do some refresh */
-    edit_display(&qe_state);
-    dpy_flush(qe_state.screen);
+    edit_schedule_background_display(&qe_state);
 }
 
 void shell_pid_cb(void *opaque, int status)
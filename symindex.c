@@ -0,0 +1,1386 @@
+/*
+ * Native symbol indexer for QEmacs.
+ * Copyright (c) 2020 Himanshu Chauhan
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "qe.h"
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+/* The C and Python sources below a directory are tokenized with the
+   tokenizers of the C and Python modes, by a pool of threads taking
+   the files from a shared list. The definitions, references, calls,
+   assignments and includes found are written to SYMINDEX_FILE, which
+   is mapped to answer the cscope queries when there is no cscope.out.
+
+   The index has a table of the files, with their mtime and size, the
+   references grouped by file, the references grouped by symbol, a
+   hash table of the symbols and the strings. When it is updated, the
+   references of the files which did not change are copied from the
+   previous index, so only the modified files are tokenized again. The
+   new index is written to a temporary file renamed over the old one.
+   The whole update runs in a thread and the main loop is woken up by
+   a pipe when it ends. */
+
+#define SYMINDEX_MAGIC       "HOESYM1\n"
+#define SYMINDEX_MAX_THREADS 16
+#define SYMINDEX_LINE_SIZE   1024 /* longest line tokenized */
+#define SYMINDEX_WORD_SIZE   64   /* longest keyword */
+
+/* kinds of references, with the marks of cscope */
+#define SYM_REF     ' '
+#define SYM_FUNC    '$'   /* function definition */
+#define SYM_DEFINE  '#'   /* macro definition */
+#define SYM_GLOBAL  'g'   /* other global definition */
+#define SYM_CALL    '`'
+#define SYM_ASSIGN  '='
+#define SYM_INCLUDE '~'   /* by base name of the included file */
+
+enum {
+    SYM_LANG_C = 1,
+    SYM_LANG_PYTHON,
+};
+
+/* on disk structures, all offsets are in bytes from the start of the
+   file and the names are offsets in the strings */
+typedef struct SymIndexHeader {
+    char magic[8];
+    unsigned int nb_files, nb_syms, nb_refs, hash_size, pool_size;
+    unsigned int files_offset, syms_offset, refs_offset, byname_offset;
+    unsigned int hash_offset, pool_offset;
+} SymIndexHeader;
+
+typedef struct SymIndexFile {
+    unsigned int name;
+    unsigned int mtime, size;
+    unsigned int first_ref, nb_refs;
+} SymIndexFile;
+
+typedef struct SymIndexSym {
+    unsigned int name;
+    unsigned int hash;
+    unsigned int first, nb_refs; /* in the references by symbol */
+} SymIndexSym;
+
+typedef struct SymIndexRef {
+    unsigned int sym;
+    unsigned int func;    /* enclosing function + 1, 0 if none */
+    unsigned int file;
+    unsigned int line : 24, kind : 8;
+} SymIndexRef;
+
+/* a mapped index */
+typedef struct SymIndex {
+    char path[1024];
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    const u8 *data;
+    int size;
+    const SymIndexHeader *h;
+    const SymIndexFile *files;
+    const SymIndexSym *syms;
+    const SymIndexRef *refs;
+    const unsigned int *byname;
+    const unsigned int *hash;
+    const char *pool;
+} SymIndex;
+
+/* references of a file while indexing. The names are offsets from
+   'base': the names of the file, or the strings of the previous index
+   for the files not tokenized again. */
+typedef struct SymTmpRef {
+    unsigned int name;
+    unsigned int func;    /* offset + 1 of the function, 0 if none */
+    unsigned int line;
+    unsigned int kind;
+} SymTmpRef;
+
+typedef struct SymFile {
+    char *name;
+    unsigned int mtime, size;
+    int lang;
+    int old;              /* file in the previous index, or -1 */
+    const char *base;
+    char *names;
+    int names_len, names_size;
+    SymTmpRef *refs;
+    int nb_refs, refs_size;
+} SymFile;
+
+typedef struct SymBuild {
+    char root[1024];
+    SymIndex *old;
+    SymFile *files;
+    int nb_files, files_size;
+    int nb_parsed;
+    int next_file;        /* next file to tokenize */
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int pipe_fds[2];
+    int ret;
+    int start_time;
+    /* the new index */
+    char *pool;
+    int pool_len, pool_size;
+    SymIndexSym *syms;
+    int nb_syms, syms_size;
+    unsigned int *hash;
+    int hash_size;
+    SymIndexRef *refs;
+    int nb_refs, refs_size;
+} SymBuild;
+
+static SymBuild *symindex_build;
+static char symindex_pending[1024]; /* update asked during a build */
+static SymIndex *symindex_cache;
+
+static int symindex_grow(void *pptr, int *size_ptr, int elem_size, int count)
+{
+    void *ptr;
+    int size;
+
+    if (count <= *size_ptr)
+        return 0;
+    size = max(*size_ptr * 2, count + 256);
+    ptr = realloc(*(void **)pptr, (size_t)size * elem_size);
+    if (!ptr)
+        return -1;
+    *(void **)pptr = ptr;
+    *size_ptr = size;
+    return 0;
+}
+
+static unsigned int symindex_hash(const char *str)
+{
+    unsigned int h = 2166136261u;
+
+    while (*str)
+        h = (h ^ (u8)*str++) * 16777619u;
+    return h;
+}
+
+/************************************************************/
+/* reading an index */
+
+static void symindex_close(SymIndex *si)
+{
+    if (!si)
+        return;
+    munmap((void *)si->data, si->size);
+    free(si);
+}
+
+static int symindex_section_ok(unsigned int offset, unsigned int count,
+                               int elem_size, int size)
+{
+    return (offset & 3) == 0 &&
+        offset + (long long)count * elem_size <= size;
+}
+
+/* Check a mapped index before trusting it: the sections are in the
+   file and all the indices and string offsets are in range, so that
+   a truncated or corrupted file cannot make the lookups read outside
+   of the mapping. Return 0 if valid. */
+static int symindex_check(const u8 *data, int size)
+{
+    const SymIndexHeader *h = (const SymIndexHeader *)data;
+    const SymIndexFile *files;
+    const SymIndexSym *syms;
+    const SymIndexRef *refs;
+    const unsigned int *byname, *hash;
+    unsigned int i, nb_used;
+
+    if (memcmp(h->magic, SYMINDEX_MAGIC, 8) ||
+        !symindex_section_ok(h->files_offset, h->nb_files,
+                             sizeof(SymIndexFile), size) ||
+        !symindex_section_ok(h->syms_offset, h->nb_syms,
+                             sizeof(SymIndexSym), size) ||
+        !symindex_section_ok(h->refs_offset, h->nb_refs,
+                             sizeof(SymIndexRef), size) ||
+        !symindex_section_ok(h->byname_offset, h->nb_refs, 4, size) ||
+        !symindex_section_ok(h->hash_offset, h->hash_size, 4, size) ||
+        h->pool_offset + (long long)h->pool_size > size ||
+        h->pool_size == 0 || data[h->pool_offset + h->pool_size - 1] ||
+        (h->hash_size & (h->hash_size - 1)))
+        return -1;
+
+    files = (const SymIndexFile *)(data + h->files_offset);
+    for (i = 0; i < h->nb_files; i++) {
+        if (files[i].name >= h->pool_size ||
+            files[i].first_ref + (long long)files[i].nb_refs > h->nb_refs)
+            return -1;
+    }
+    syms = (const SymIndexSym *)(data + h->syms_offset);
+    for (i = 0; i < h->nb_syms; i++) {
+        if (syms[i].name >= h->pool_size ||
+            syms[i].first + (long long)syms[i].nb_refs > h->nb_refs)
+            return -1;
+    }
+    refs = (const SymIndexRef *)(data + h->refs_offset);
+    byname = (const unsigned int *)(data + h->byname_offset);
+    for (i = 0; i < h->nb_refs; i++) {
+        if (refs[i].sym >= h->nb_syms || refs[i].func > h->nb_syms ||
+            refs[i].file >= h->nb_files || byname[i] >= h->nb_refs)
+            return -1;
+    }
+    /* the probing of a lookup stops at an empty slot */
+    hash = (const unsigned int *)(data + h->hash_offset);
+    nb_used = 0;
+    for (i = 0; i < h->hash_size; i++) {
+        if (hash[i] > h->nb_syms)
+            return -1;
+        nb_used += (hash[i] != 0);
+    }
+    if (h->hash_size && nb_used == h->hash_size)
+        return -1;
+    return 0;
+}
+
+/* map the index of 'dir', kept until the file changes */
+static SymIndex *symindex_open(const char *dir)
+{
+    char path[1024];
+    const SymIndexHeader *h;
+    struct stat st;
+    SymIndex *si;
+    void *data;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, SYMINDEX_FILE);
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+    si = symindex_cache;
+    if (si && !strcmp(si->path, path) && si->dev == st.st_dev &&
+        si->ino == st.st_ino && si->mtime == st.st_mtime)
+        return si;
+    symindex_close(symindex_cache);
+    symindex_cache = NULL;
+
+    if (st.st_size < (off_t)sizeof(SymIndexHeader) ||
+        st.st_size >= 0x7fffffff)
+        return NULL;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    h = data;
+    if (symindex_check(data, st.st_size)) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    si = calloc(1, sizeof(SymIndex));
+    if (!si) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    pstrcpy(si->path, sizeof(si->path), path);
+    si->dev = st.st_dev;
+    si->ino = st.st_ino;
+    si->mtime = st.st_mtime;
+    si->data = data;
+    si->size = st.st_size;
+    si->h = h;
+    si->files = (const SymIndexFile *)(si->data + h->files_offset);
+    si->syms = (const SymIndexSym *)(si->data + h->syms_offset);
+    si->refs = (const SymIndexRef *)(si->data + h->refs_offset);
+    si->byname = (const unsigned int *)(si->data + h->byname_offset);
+    si->hash = (const unsigned int *)(si->data + h->hash_offset);
+    si->pool = (const char *)(si->data + h->pool_offset);
+    symindex_cache = si;
+    return si;
+}
+
+static int symindex_find_sym(const SymIndex *si, const char *name)
+{
+    unsigned int hash, h, mask;
+    const SymIndexSym *sym;
+    int index;
+
+    if (si->h->hash_size == 0)
+        return -1;
+    hash = symindex_hash(name);
+    mask = si->h->hash_size - 1;
+    for (h = hash & mask; (index = si->hash[h]) != 0; h = (h + 1) & mask) {
+        sym = &si->syms[index - 1];
+        if (sym->hash == hash && !strcmp(si->pool + sym->name, name))
+            return index - 1;
+    }
+    return -1;
+}
+
+/************************************************************/
+/* tokenizing a file */
+
+typedef struct SymParser {
+    SymFile *f;
+    int lang;
+    int line;
+    int state;            /* state of the tokenizer */
+    unsigned int func;    /* enclosing function offset + 1 */
+    int func_indent;      /* Python indentation of the function */
+    int depth;            /* C brace depth */
+    int paren;            /* C parenthesis depth */
+    int decl_kw;          /* C: after struct, union or enum */
+    int def_ref;          /* C: function definition + 1 before its body */
+} SymParser;
+
+static inline int sym_is_ident(unsigned int c, int first)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        c == '_' || (!first && c >= '0' && c <= '9');
+}
+
+static int symindex_add_name(SymFile *f, const char *str, int len)
+{
+    int pos;
+
+    if (symindex_grow(&f->names, &f->names_size, 1, f->names_len + len + 1))
+        return -1;
+    pos = f->names_len;
+    memcpy(f->names + pos, str, len);
+    f->names[pos + len] = '\0';
+    f->names_len += len + 1;
+    return pos;
+}
+
+/* add a reference of kind 'kind' to the 'len' chars of 'str'. Return
+   the offset of the name. */
+static int symindex_add_ref(SymParser *sp, const char *str, int len,
+                            int kind)
+{
+    SymFile *f = sp->f;
+    SymTmpRef *ref;
+    int pos;
+
+    pos = symindex_add_name(f, str, len);
+    if (pos < 0)
+        return -1;
+    if (symindex_grow(&f->refs, &f->refs_size, sizeof(SymTmpRef),
+                      f->nb_refs + 1))
+        return -1;
+    ref = &f->refs[f->nb_refs++];
+    ref->name = pos;
+    ref->line = sp->line;
+    ref->kind = kind;
+    if (kind == SYM_FUNC)
+        sp->func = pos + 1;
+    ref->func = sp->func;
+    return pos;
+}
+
+/* the keywords which are not highlighted by the modes */
+static const char * const symindex_c_keywords[] = {
+    "default", "inline", "restrict", "sizeof", NULL,
+};
+
+static const char * const symindex_py_keywords[] = {
+    "and", "assert", "async", "await", "class", "del", "False", "finally",
+    "from", "global", "import", "in", "is", "lambda", "None", "nonlocal",
+    "not", "or", "raise", "True", "yield", NULL,
+};
+
+static int symindex_is_keyword(int lang, const unsigned int *word, int n,
+                               const char *str)
+{
+    const char * const *kw;
+
+    kw = lang == SYM_LANG_C ? symindex_c_keywords : symindex_py_keywords;
+    for (; *kw; kw++) {
+        if (!strncmp(*kw, str, n) && (*kw)[n] == '\0')
+            return 1;
+    }
+    if (n > SYMINDEX_WORD_SIZE)
+        return 0;
+    return lang == SYM_LANG_C ? c_is_keyword(word, n) :
+        py_is_keyword(word, n);
+}
+
+static void symindex_add_include(SymParser *sp, const char *path, int len)
+{
+    const char *p;
+
+    /* indexed by base name, the full path is in the source line */
+    for (p = path + len; p > path && p[-1] != '/'; p--)
+        continue;
+    symindex_add_ref(sp, p, path + len - p, SYM_INCLUDE);
+}
+
+/* return TRUE if the assignment operator starts at 'p' */
+static int symindex_is_assign(const unsigned int *p, const unsigned int *end)
+{
+    unsigned int c0, c1, c2;
+
+    c0 = p < end ? (p[0] & CHAR_MASK) : 0;
+    c1 = p + 1 < end ? (p[1] & CHAR_MASK) : 0;
+    c2 = p + 2 < end ? (p[2] & CHAR_MASK) : 0;
+    if (c0 == '=')
+        return c1 != '=';
+    if (c1 == '=' && c0 && strchr("+-*/%&|^", c0))
+        return 1;
+    if ((c0 == '+' || c0 == '-') && c1 == c0)
+        return 1;
+    return (c0 == '<' || c0 == '>') && c1 == c0 && c2 == '=';
+}
+
+/* a function name followed by its parameters is a definition unless
+   a ';', ',' or '=' follows them */
+static int symindex_c_is_def(const unsigned int *p, const unsigned int *end)
+{
+    int level = 0;
+    unsigned int c;
+
+    for (; p < end; p++) {
+        c = *p & CHAR_MASK;
+        if (c == '(') {
+            level++;
+        } else if (c == ')' && --level == 0) {
+            for (p++; p < end && ((*p & CHAR_MASK) == ' ' ||
+                                  (*p & CHAR_MASK) == '\t'); p++)
+                continue;
+            if (p >= end)
+                return 1;
+            c = *p & CHAR_MASK;
+            return c != ';' && c != ',' && c != '=';
+        }
+    }
+    return 1;
+}
+
+/* read a C preprocessor directive: includes and macro definitions */
+static void symindex_c_directive(SymParser *sp, const char *line, int len)
+{
+    const char *p = line, *end = line + len, *q;
+    int delim;
+
+    for (p++; p < end && (*p == ' ' || *p == '\t'); p++)
+        continue;
+    if (end - p > 7 && !memcmp(p, "include", 7)) {
+        for (p += 7; p < end && (*p == ' ' || *p == '\t'); p++)
+            continue;
+        if (p >= end || (*p != '<' && *p != '"'))
+            return;
+        delim = *p++ == '<' ? '>' : '"';
+        q = memchr(p, delim, end - p);
+        if (q && q > p)
+            symindex_add_include(sp, p, q - p);
+    } else if (end - p > 6 && !memcmp(p, "define", 6) &&
+               (p[6] == ' ' || p[6] == '\t')) {
+        for (p += 6; p < end && (*p == ' ' || *p == '\t'); p++)
+            continue;
+        for (q = p; q < end && sym_is_ident((u8)*q, q == p); q++)
+            continue;
+        if (q > p)
+            symindex_add_ref(sp, p, q - p, SYM_DEFINE);
+    }
+}
+
+static void symindex_c_line(SymParser *sp, unsigned int *buf, int len,
+                            const char *line)
+{
+    unsigned int *end = buf + len, *p, *q;
+    unsigned int word[SYMINDEX_WORD_SIZE];
+    int i, j, n, c, nc, style, kind;
+    SymFile *f;
+
+    for (i = 0; i < len && (line[i] == ' ' || line[i] == '\t'); i++)
+        continue;
+    if (i < len && line[i] == '#' &&
+        (buf[i] >> STYLE_SHIFT) == QE_STYLE_PREPROCESS) {
+        symindex_c_directive(sp, line + i, len - i);
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        c = buf[i] & CHAR_MASK;
+        style = buf[i] >> STYLE_SHIFT;
+        if (style == QE_STYLE_COMMENT || style == QE_STYLE_STRING ||
+            style == QE_STYLE_PREPROCESS)
+            continue;
+        if (c == '(' || c == ')') {
+            sp->paren += c == '(' ? 1 : -1;
+            continue;
+        }
+        if (c == '{') {
+            sp->depth++;
+            sp->decl_kw = sp->paren = sp->def_ref = 0;
+            continue;
+        }
+        if (c == '}') {
+            if (sp->depth > 0 && --sp->depth == 0)
+                sp->func = 0;
+            continue;
+        }
+        if (c == ';' && sp->depth == 0) {
+            if (sp->def_ref) {
+                /* a prototype whose parameters span several lines */
+                f = sp->f;
+                f->refs[sp->def_ref - 1].kind = SYM_REF;
+                for (j = sp->def_ref - 1; j < f->nb_refs; j++)
+                    f->refs[j].func = 0;
+            }
+            sp->decl_kw = sp->paren = sp->def_ref = 0;
+            sp->func = 0;
+            continue;
+        }
+        if (!sym_is_ident(c, 1) ||
+            (i > 0 && sym_is_ident(buf[i - 1] & CHAR_MASK, 0)))
+            continue;
+        for (n = 0; i + n < len && sym_is_ident(buf[i + n] & CHAR_MASK, 0);
+             n++) {
+            if (n < SYMINDEX_WORD_SIZE)
+                word[n] = buf[i + n] & CHAR_MASK;
+        }
+        if (symindex_is_keyword(SYM_LANG_C, word, n, line + i)) {
+            if ((n == 6 && !memcmp(line + i, "struct", 6)) ||
+                (n == 5 && !memcmp(line + i, "union", 5)) ||
+                (n == 4 && !memcmp(line + i, "enum", 4)))
+                sp->decl_kw = 1;
+            i += n - 1;
+            continue;
+        }
+        for (q = buf + i + n; q < end && ((*q & CHAR_MASK) == ' ' ||
+                                          (*q & CHAR_MASK) == '\t'); q++)
+            continue;
+        nc = q < end ? (*q & CHAR_MASK) : 0;
+        p = buf + i;
+
+        if (sp->depth == 0 && sp->paren <= 0 &&
+            (style == QE_STYLE_FUNCTION || nc == '(')) {
+            kind = symindex_c_is_def(q, end) ? SYM_FUNC : SYM_REF;
+        } else if (nc == '(') {
+            kind = SYM_CALL;
+        } else if (sp->depth == 0 && sp->paren <= 0 &&
+                   (style == QE_STYLE_VARIABLE || nc == ';' || nc == ',' ||
+                    nc == '[' || (nc == '=' && symindex_is_assign(q, end)) ||
+                    (sp->decl_kw && nc == '{'))) {
+            /* declarator of a global */
+            kind = SYM_GLOBAL;
+        } else if (symindex_is_assign(q, end)) {
+            kind = SYM_ASSIGN;
+        } else {
+            kind = SYM_REF;
+        }
+        if (symindex_add_ref(sp, line + (p - buf), n, kind) >= 0 &&
+            kind == SYM_FUNC)
+            sp->def_ref = sp->f->nb_refs;
+        i += n - 1;
+    }
+}
+
+static void symindex_py_line(SymParser *sp, unsigned int *buf, int len,
+                             const char *line)
+{
+    unsigned int *end = buf + len, *q;
+    unsigned int word[SYMINDEX_WORD_SIZE];
+    int i, n, c, nc, style, kind, indent, prev_kw, import;
+
+    indent = 0;
+    for (i = 0; i < len && (line[i] == ' ' || line[i] == '\t'); i++)
+        indent = line[i] == '\t' ? (indent + 8) & ~7 : indent + 1;
+    if (i == len || line[i] == '#' ||
+        (buf[i] >> STYLE_SHIFT) == QE_STYLE_STRING)
+        return;
+    if (sp->func && indent <= sp->func_indent)
+        sp->func = 0;
+
+    prev_kw = 0;
+    import = 0;
+    for (; i < len; i++) {
+        c = buf[i] & CHAR_MASK;
+        style = buf[i] >> STYLE_SHIFT;
+        if (style == QE_STYLE_COMMENT || style == QE_STYLE_STRING)
+            continue;
+        if (!sym_is_ident(c, 1) ||
+            (i > 0 && sym_is_ident(buf[i - 1] & CHAR_MASK, 0)))
+            continue;
+        for (n = 0; i + n < len && sym_is_ident(buf[i + n] & CHAR_MASK, 0);
+             n++) {
+            if (n < SYMINDEX_WORD_SIZE)
+                word[n] = buf[i + n] & CHAR_MASK;
+        }
+        if (symindex_is_keyword(SYM_LANG_PYTHON, word, n, line + i)) {
+            prev_kw = 0;
+            if (n == 3 && !memcmp(line + i, "def", 3))
+                prev_kw = SYM_FUNC;
+            else if (n == 5 && !memcmp(line + i, "class", 5))
+                prev_kw = SYM_GLOBAL;
+            else if ((n == 6 && !memcmp(line + i, "import", 6)) ||
+                     (n == 4 && !memcmp(line + i, "from", 4)))
+                import = 1;
+            else
+                import = 0;
+            i += n - 1;
+            continue;
+        }
+        if (import) {
+            /* module name, with its dots */
+            while (i + n < len && ((buf[i + n] & CHAR_MASK) == '.' ||
+                                   sym_is_ident(buf[i + n] & CHAR_MASK, 0)))
+                n++;
+            symindex_add_ref(sp, line + i, n, SYM_INCLUDE);
+            i += n - 1;
+            continue;
+        }
+        for (q = buf + i + n; q < end && ((*q & CHAR_MASK) == ' ' ||
+                                          (*q & CHAR_MASK) == '\t'); q++)
+            continue;
+        nc = q < end ? (*q & CHAR_MASK) : 0;
+
+        if (prev_kw) {
+            kind = prev_kw;
+            if (kind == SYM_FUNC)
+                sp->func_indent = indent;
+        } else if (nc == '(') {
+            kind = SYM_CALL;
+        } else if (symindex_is_assign(q, end)) {
+            kind = (indent == 0 && !sp->func) ? SYM_GLOBAL : SYM_ASSIGN;
+        } else {
+            kind = SYM_REF;
+        }
+        prev_kw = 0;
+        symindex_add_ref(sp, line + i, n, kind);
+        i += n - 1;
+    }
+}
+
+/* tokenize the 'size' bytes of 'data' */
+static void symindex_parse(SymFile *f, const u8 *data, int size)
+{
+    unsigned int buf[SYMINDEX_LINE_SIZE + 1];
+    char line[SYMINDEX_LINE_SIZE + 1];
+    const u8 *p, *end, *q;
+    SymParser sp;
+    int i, len;
+
+    memset(&sp, 0, sizeof(sp));
+    sp.f = f;
+    sp.lang = f->lang;
+    p = data;
+    end = data + size;
+    while (p < end) {
+        q = memchr(p, '\n', end - p);
+        if (!q)
+            q = end;
+        sp.line++;
+        len = min(q - p, SYMINDEX_LINE_SIZE);
+        if (len > 0 && p[len - 1] == '\r')
+            len--;
+        for (i = 0; i < len; i++) {
+            /* the tokenizers expect no style bits and a final '\n' */
+            line[i] = p[i] ? p[i] : ' ';
+            buf[i] = (u8)line[i];
+        }
+        line[len] = '\0';
+        buf[len] = '\n';
+        if (sp.lang == SYM_LANG_C) {
+            c_tokenize_line(buf, len, &sp.state);
+            symindex_c_line(&sp, buf, len, line);
+        } else {
+            py_tokenize_line(buf, len, &sp.state);
+            symindex_py_line(&sp, buf, len, line);
+        }
+        p = q + 1;
+    }
+}
+
+static void symindex_parse_file(SymBuild *sb, SymFile *f)
+{
+    char path[2048];
+    struct stat st;
+    u8 *data;
+    int fd, len, size;
+
+    snprintf(path, sizeof(path), "%s/%s", sb->root, f->name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+        st.st_size >= 0x7fffffff) {
+        close(fd);
+        return;
+    }
+    size = st.st_size;
+    data = malloc(size);
+    if (data) {
+        for (len = 0; len < size; ) {
+            int n = read(fd, data + len, size - len);
+            if (n <= 0)
+                break;
+            len += n;
+        }
+        /* binary files are not sources */
+        if (!memchr(data, '\0', min(len, 4096)))
+            symindex_parse(f, data, len);
+        free(data);
+    }
+    close(fd);
+}
+
+static void *symindex_worker(void *opaque)
+{
+    SymBuild *sb = opaque;
+    SymFile *f;
+    int index;
+
+    for (;;) {
+        pthread_mutex_lock(&sb->lock);
+        index = sb->next_file;
+        while (index < sb->nb_files && sb->files[index].old >= 0)
+            index++;
+        sb->next_file = index + 1;
+        pthread_mutex_unlock(&sb->lock);
+        if (index >= sb->nb_files)
+            break;
+        f = &sb->files[index];
+        symindex_parse_file(sb, f);
+        f->base = f->names;
+    }
+    return NULL;
+}
+
+/************************************************************/
+/* building the index */
+
+static int symindex_lang(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+
+    if (!ext || strchr(ext, '/'))
+        return 0;
+    ext++;
+    if (!strcmp(ext, "c") || !strcmp(ext, "h") || !strcmp(ext, "cc") ||
+        !strcmp(ext, "cpp") || !strcmp(ext, "cxx") || !strcmp(ext, "hh") ||
+        !strcmp(ext, "hpp"))
+        return SYM_LANG_C;
+    if (!strcmp(ext, "py"))
+        return SYM_LANG_PYTHON;
+    return 0;
+}
+
+/* list the sources below 'dir', relative to the root */
+static int symindex_walk(SymBuild *sb, const char *dir)
+{
+    char path[3072], rel[2048];
+    struct dirent *d;
+    struct stat st;
+    SymFile *f;
+    DIR *dp;
+    int lang;
+
+    snprintf(path, sizeof(path), "%s%s%s", sb->root, *dir ? "/" : "", dir);
+    dp = opendir(path);
+    if (!dp)
+        return 0;
+    while ((d = readdir(dp)) != NULL) {
+        /* dot files, version control and build directories */
+        if (d->d_name[0] == '.')
+            continue;
+        snprintf(rel, sizeof(rel), "%s%s%s", dir, *dir ? "/" : "",
+                 d->d_name);
+        snprintf(path, sizeof(path), "%s/%s", sb->root, rel);
+        if (lstat(path, &st) < 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            if (symindex_walk(sb, rel) < 0) {
+                closedir(dp);
+                return -1;
+            }
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || !(lang = symindex_lang(d->d_name)))
+            continue;
+        if (symindex_grow(&sb->files, &sb->files_size, sizeof(SymFile),
+                          sb->nb_files + 1)) {
+            closedir(dp);
+            return -1;
+        }
+        f = &sb->files[sb->nb_files];
+        memset(f, 0, sizeof(*f));
+        f->name = strdup(rel);
+        if (!f->name) {
+            closedir(dp);
+            return -1;
+        }
+        f->mtime = st.st_mtime;
+        f->size = st.st_size;
+        f->lang = lang;
+        f->old = -1;
+        sb->nb_files++;
+    }
+    closedir(dp);
+    return 0;
+}
+
+/* reuse the references of the files unchanged since the previous
+   index */
+static void symindex_reuse(SymBuild *sb)
+{
+    const SymIndex *si = sb->old;
+    const SymIndexFile *of;
+    const SymIndexRef *r;
+    unsigned int *table, h, mask;
+    int i, j, size, index;
+    SymFile *f;
+
+    if (!si || si->h->nb_files == 0)
+        return;
+    for (size = 16; size < (int)si->h->nb_files * 2; size *= 2)
+        continue;
+    table = calloc(size, sizeof(unsigned int));
+    if (!table)
+        return;
+    mask = size - 1;
+    for (i = 0; i < (int)si->h->nb_files; i++) {
+        for (h = symindex_hash(si->pool + si->files[i].name);
+             table[h & mask]; h++)
+            continue;
+        table[h & mask] = i + 1;
+    }
+    for (i = 0; i < sb->nb_files; i++) {
+        f = &sb->files[i];
+        for (h = symindex_hash(f->name); (index = table[h & mask]) != 0;
+             h++) {
+            if (!strcmp(si->pool + si->files[index - 1].name, f->name))
+                break;
+        }
+        if (!index)
+            continue;
+        of = &si->files[index - 1];
+        if (of->mtime != f->mtime || of->size != f->size)
+            continue;
+        f->refs = malloc(max(of->nb_refs, 1) * sizeof(SymTmpRef));
+        if (!f->refs)
+            continue;
+        f->old = index - 1;
+        f->base = si->pool;
+        f->nb_refs = of->nb_refs;
+        for (j = 0; j < (int)of->nb_refs; j++) {
+            r = &si->refs[of->first_ref + j];
+            f->refs[j].name = si->syms[r->sym].name;
+            f->refs[j].func = r->func ? si->syms[r->func - 1].name + 1 : 0;
+            f->refs[j].line = r->line;
+            f->refs[j].kind = r->kind;
+        }
+    }
+    free(table);
+}
+
+static int symindex_add_string(SymBuild *sb, const char *str)
+{
+    int len = strlen(str) + 1, pos;
+
+    if (symindex_grow(&sb->pool, &sb->pool_size, 1, sb->pool_len + len))
+        return -1;
+    pos = sb->pool_len;
+    memcpy(sb->pool + pos, str, len);
+    sb->pool_len += len;
+    return pos;
+}
+
+static int symindex_rehash(SymBuild *sb, int size)
+{
+    unsigned int *hash, h;
+    int i;
+
+    hash = calloc(size, sizeof(unsigned int));
+    if (!hash)
+        return -1;
+    for (i = 0; i < sb->nb_syms; i++) {
+        for (h = sb->syms[i].hash & (size - 1); hash[h];
+             h = (h + 1) & (size - 1))
+            continue;
+        hash[h] = i + 1;
+    }
+    free(sb->hash);
+    sb->hash = hash;
+    sb->hash_size = size;
+    return 0;
+}
+
+/* return the index of the symbol 'name', added if needed */
+static int symindex_intern(SymBuild *sb, const char *name)
+{
+    unsigned int hash, h, mask;
+    SymIndexSym *sym;
+    int index, pos;
+
+    if (sb->nb_syms * 2 >= sb->hash_size &&
+        symindex_rehash(sb, sb->hash_size ? sb->hash_size * 2 : 4096))
+        return -1;
+    hash = symindex_hash(name);
+    mask = sb->hash_size - 1;
+    for (h = hash & mask; (index = sb->hash[h]) != 0; h = (h + 1) & mask) {
+        sym = &sb->syms[index - 1];
+        if (sym->hash == hash && !strcmp(sb->pool + sym->name, name))
+            return index - 1;
+    }
+    if (symindex_grow(&sb->syms, &sb->syms_size, sizeof(SymIndexSym),
+                      sb->nb_syms + 1))
+        return -1;
+    pos = symindex_add_string(sb, name);
+    if (pos < 0)
+        return -1;
+    sym = &sb->syms[sb->nb_syms];
+    sym->name = pos;
+    sym->hash = hash;
+    sym->first = sym->nb_refs = 0;
+    sb->hash[h] = ++sb->nb_syms;
+    return sb->nb_syms - 1;
+}
+
+static int symindex_write_data(FILE *fp, const void *data, int size,
+                               unsigned int *offset_ptr, unsigned int *pos_ptr)
+{
+    static const u8 zeros[4];
+    int pad = (4 - (*pos_ptr & 3)) & 3;
+
+    if (pad && fwrite(zeros, 1, pad, fp) != (size_t)pad)
+        return -1;
+    *pos_ptr += pad;
+    *offset_ptr = *pos_ptr;
+    if (size && fwrite(data, 1, size, fp) != (size_t)size)
+        return -1;
+    *pos_ptr += size;
+    return 0;
+}
+
+/* merge the references of the files and write the index */
+static int symindex_write(SymBuild *sb)
+{
+    char path[1280], tmp[2048];
+    SymIndexHeader h;
+    SymIndexFile *files;
+    SymIndexRef *ref;
+    SymTmpRef *tr;
+    SymFile *f;
+    unsigned int *byname, pos;
+    int i, j, sym, func, ret;
+    FILE *fp;
+
+    files = calloc(max(sb->nb_files, 1), sizeof(SymIndexFile));
+    if (!files)
+        return -1;
+    for (i = 0; i < sb->nb_files; i++) {
+        f = &sb->files[i];
+        ret = symindex_add_string(sb, f->name);
+        if (ret < 0)
+            goto fail;
+        files[i].name = ret;
+        files[i].mtime = f->mtime;
+        files[i].size = f->size;
+        files[i].first_ref = sb->nb_refs;
+        if (symindex_grow(&sb->refs, &sb->refs_size, sizeof(SymIndexRef),
+                          sb->nb_refs + f->nb_refs))
+            goto fail;
+        for (j = 0; j < f->nb_refs; j++) {
+            tr = &f->refs[j];
+            sym = symindex_intern(sb, f->base + tr->name);
+            func = tr->func ? symindex_intern(sb, f->base + tr->func - 1) : -1;
+            if (sym < 0 || (tr->func && func < 0))
+                goto fail;
+            ref = &sb->refs[sb->nb_refs++];
+            ref->sym = sym;
+            ref->func = func + 1;
+            ref->file = i;
+            ref->line = tr->line;
+            ref->kind = tr->kind;
+            sb->syms[sym].nb_refs++;
+        }
+        files[i].nb_refs = sb->nb_refs - files[i].first_ref;
+    }
+
+    /* references grouped by symbol, in file and line order */
+    byname = malloc(max(sb->nb_refs, 1) * sizeof(unsigned int));
+    if (!byname)
+        goto fail;
+    pos = 0;
+    for (i = 0; i < sb->nb_syms; i++) {
+        sb->syms[i].first = pos;
+        pos += sb->syms[i].nb_refs;
+        sb->syms[i].nb_refs = 0;
+    }
+    for (i = 0; i < sb->nb_refs; i++) {
+        sym = sb->refs[i].sym;
+        byname[sb->syms[sym].first + sb->syms[sym].nb_refs++] = i;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", sb->root, SYMINDEX_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (!fp) {
+        free(byname);
+        goto fail;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SYMINDEX_MAGIC, 8);
+    h.nb_files = sb->nb_files;
+    h.nb_syms = sb->nb_syms;
+    h.nb_refs = sb->nb_refs;
+    h.hash_size = sb->hash_size;
+    h.pool_size = sb->pool_len;
+    pos = sizeof(h);
+    ret = fseek(fp, pos, SEEK_SET) ||
+        symindex_write_data(fp, files, sb->nb_files * sizeof(SymIndexFile),
+                            &h.files_offset, &pos) ||
+        symindex_write_data(fp, sb->syms, sb->nb_syms * sizeof(SymIndexSym),
+                            &h.syms_offset, &pos) ||
+        symindex_write_data(fp, sb->refs, sb->nb_refs * sizeof(SymIndexRef),
+                            &h.refs_offset, &pos) ||
+        symindex_write_data(fp, byname, sb->nb_refs * sizeof(unsigned int),
+                            &h.byname_offset, &pos) ||
+        symindex_write_data(fp, sb->hash, sb->hash_size * sizeof(unsigned int),
+                            &h.hash_offset, &pos) ||
+        symindex_write_data(fp, sb->pool, sb->pool_len,
+                            &h.pool_offset, &pos) ||
+        fseek(fp, 0, SEEK_SET) ||
+        fwrite(&h, sizeof(h), 1, fp) != 1;
+    ret |= fclose(fp);
+    free(byname);
+    free(files);
+    if (ret || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+
+ fail:
+    free(files);
+    return -1;
+}
+
+static void *symindex_thread(void *opaque)
+{
+    SymBuild *sb = opaque;
+    pthread_t threads[SYMINDEX_MAX_THREADS];
+    int i, nb_threads;
+    char c = 0;
+
+    sb->ret = -1;
+    if (symindex_walk(sb, "") == 0) {
+        symindex_reuse(sb);
+        for (i = 0; i < sb->nb_files; i++) {
+            if (sb->files[i].old < 0)
+                sb->nb_parsed++;
+        }
+        nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_threads = max(1, min(nb_threads, SYMINDEX_MAX_THREADS));
+        nb_threads = min(nb_threads, max(sb->nb_parsed, 1));
+        for (i = 0; i < nb_threads; i++) {
+            if (pthread_create(&threads[i], NULL, symindex_worker, sb))
+                break;
+        }
+        nb_threads = i;
+        /* do the work alone if no thread could be started */
+        if (nb_threads == 0)
+            symindex_worker(sb);
+        for (i = 0; i < nb_threads; i++)
+            pthread_join(threads[i], NULL);
+        sb->ret = symindex_write(sb);
+    }
+    /* wake up the main loop */
+    if (write(sb->pipe_fds[1], &c, 1) < 0)
+        sb->ret = -1;
+    return NULL;
+}
+
+static void symindex_free_build(SymBuild *sb)
+{
+    int i;
+
+    for (i = 0; i < sb->nb_files; i++) {
+        free(sb->files[i].name);
+        free(sb->files[i].names);
+        free(sb->files[i].refs);
+    }
+    free(sb->files);
+    free(sb->pool);
+    free(sb->syms);
+    free(sb->hash);
+    free(sb->refs);
+    close(sb->pipe_fds[0]);
+    close(sb->pipe_fds[1]);
+    pthread_mutex_destroy(&sb->lock);
+    free(sb);
+}
+
+static void symindex_done_cb(void *opaque)
+{
+    SymBuild *sb = opaque;
+    char root[1024];
+    char c;
+
+    if (read(sb->pipe_fds[0], &c, 1) < 0)
+        return;
+    set_read_handler(sb->pipe_fds[0], NULL, NULL);
+    pthread_join(sb->thread, NULL);
+    if (sb->ret == 0) {
+        put_status(NULL, "Indexed %d files (%d parsed) in %d ms",
+                   sb->nb_files, sb->nb_parsed,
+                   get_clock_ms() - sb->start_time);
+    } else {
+        put_status(NULL, "Could not write %s/%s", sb->root, SYMINDEX_FILE);
+    }
+    /* the previous index stays mapped while it is read */
+    if (sb->old && sb->old != symindex_cache)
+        symindex_close(sb->old);
+    symindex_free_build(sb);
+    symindex_build = NULL;
+
+    if (symindex_pending[0]) {
+        pstrcpy(root, sizeof(root), symindex_pending);
+        symindex_pending[0] = '\0';
+        symindex_update(root);
+    }
+    edit_display(&qe_state);
+    dpy_flush(qe_state.screen);
+}
+
+/* create or update the index of the sources below 'root' in the
+   background */
+int symindex_update(const char *root)
+{
+    SymBuild *sb;
+
+    if (symindex_build) {
+        /* update again when the running one ends */
+        pstrcpy(symindex_pending, sizeof(symindex_pending), root);
+        return 0;
+    }
+    sb = calloc(1, sizeof(SymBuild));
+    if (!sb)
+        return -1;
+    pstrcpy(sb->root, sizeof(sb->root), root);
+    if (pipe(sb->pipe_fds) < 0) {
+        free(sb);
+        return -1;
+    }
+    pthread_mutex_init(&sb->lock, NULL);
+    sb->start_time = get_clock_ms();
+    /* the thread only reads the previous index, which is kept mapped
+       until the end of the update */
+    sb->old = symindex_open(root);
+    symindex_cache = NULL;
+    if (pthread_create(&sb->thread, NULL, symindex_thread, sb)) {
+        symindex_cache = sb->old;
+        sb->old = NULL;
+        symindex_free_build(sb);
+        return -1;
+    }
+    symindex_build = sb;
+    set_read_handler(sb->pipe_fds[0], symindex_done_cb, sb);
+    put_status(NULL, "Indexing %s...", root);
+    return 0;
+}
+
+/************************************************************/
+/* queries */
+
+typedef struct SymOutput {
+    char *buf;
+    int len, size;
+    /* source file of the previous result */
+    int file;
+    u8 *data;
+    int data_size;
+    int pos, line;        /* start of the line 'line' in data */
+} SymOutput;
+
+/* return in 'buf' the source line 'line' of 'file' */
+static void symindex_source_line(const SymIndex *si, const char *symdir,
+                                 SymOutput *out, int file, int line,
+                                 char *buf, int size)
+{
+    char path[2048];
+    const u8 *p, *q, *end;
+    FILE *fp;
+    int len;
+
+    if (file != out->file) {
+        free(out->data);
+        out->data = NULL;
+        out->data_size = 0;
+        out->file = file;
+        out->pos = 0;
+        out->line = 1;
+        snprintf(path, sizeof(path), "%s/%s", symdir,
+                 si->pool + si->files[file].name);
+        fp = fopen(path, "rb");
+        if (fp) {
+            len = si->files[file].size;
+            out->data = malloc(max(len, 1));
+            if (out->data)
+                out->data_size = fread(out->data, 1, len, fp);
+            fclose(fp);
+        }
+    }
+    end = out->data + out->data_size;
+    if (line < out->line) {
+        out->pos = 0;
+        out->line = 1;
+    }
+    p = out->data + out->pos;
+    while (out->line < line && p < end) {
+        q = memchr(p, '\n', end - p);
+        p = q ? q + 1 : end;
+        out->line++;
+    }
+    out->pos = p - out->data;
+    q = p < end ? memchr(p, '\n', end - p) : NULL;
+    len = (q ? q : end) - p;
+    if (len > 0 && p[len - 1] == '\r')
+        len--;
+    pstrncpy(buf, size, (const char *)p, len);
+}
+
+static int symindex_output(const SymIndex *si, const char *symdir,
+                           SymOutput *out, const SymIndexRef *r,
+                           const char *func)
+{
+    char text[1024];
+    int len;
+
+    symindex_source_line(si, symdir, out, r->file, r->line,
+                         text, sizeof(text));
+    for (;;) {
+        len = snprintf(out->buf + out->len, out->size - out->len,
+                       "%s %s %d %s\n", si->pool + si->files[r->file].name,
+                       func, (int)r->line, text);
+        if (len < out->size - out->len)
+            break;
+        if (symindex_grow(&out->buf, &out->size, 1, out->len + len + 1))
+            return -1;
+    }
+    out->len += len;
+    return 0;
+}
+
+static int symindex_match(int op, int kind)
+{
+    switch (op) {
+    case 0: /* symbol */
+        return kind != SYM_INCLUDE;
+    case 1: /* definition */
+        return kind == SYM_FUNC || kind == SYM_DEFINE || kind == SYM_GLOBAL;
+    case 3: /* calls */
+        return kind == SYM_CALL;
+    case 8: /* includes */
+        return kind == SYM_INCLUDE;
+    case 9: /* assignments */
+        return kind == SYM_ASSIGN;
+    }
+    return 0;
+}
+
+/* Answer the cscope query 'op' on 'sym' from the index of 'symdir'.
+   Return -1 if there is no index or the query is not handled, else 0
+   with the matches in a malloced, null terminated '*response', in the
+   format of "cscope -L". */
+int symindex_query(const char *symdir, int op, const char *sym,
+                   char **response, int *len)
+{
+    const SymIndexSym *s;
+    const SymIndexRef *r, *r1;
+    const SymIndexFile *f;
+    const char *key, *func;
+    char text[1024];
+    SymOutput out;
+    SymIndex *si;
+    int i, j, index, last_file, last_line, ret = 0;
+
+    if (op != 0 && op != 1 && op != 2 && op != 3 && op != 7 &&
+        op != 8 && op != 9)
+        return -1;
+    si = symindex_open(symdir);
+    if (!si)
+        return -1;
+
+    memset(&out, 0, sizeof(out));
+    out.file = -1;
+    if (symindex_grow(&out.buf, &out.size, 1, 4096))
+        return -1;
+    out.buf[0] = '\0';
+
+    if (op == 7) {
+        for (i = 0; i < (int)si->h->nb_files && !ret; i++) {
+            key = si->pool + si->files[i].name;
+            if (!strstr(key, sym))
+                continue;
+            j = strlen(key);
+            if (symindex_grow(&out.buf, &out.size, 1, out.len + j + 32)) {
+                ret = -1;
+                break;
+            }
+            out.len += sprintf(out.buf + out.len,
+                               "%s <unknown> 1 <unknown>\n", key);
+        }
+        goto done;
+    }
+
+    key = sym;
+    if (op == 8 && strrchr(sym, '/'))
+        key = strrchr(sym, '/') + 1;
+    index = symindex_find_sym(si, key);
+    if (index < 0)
+        goto done;
+    s = &si->syms[index];
+    last_file = last_line = -1;
+    for (i = 0; i < (int)s->nb_refs && !ret; i++) {
+        r = &si->refs[si->byname[s->first + i]];
+        if (op == 2) {
+            /* calls in the body of the function, in the same file */
+            if (r->kind != SYM_FUNC)
+                continue;
+            f = &si->files[r->file];
+            for (j = 0; j < (int)f->nb_refs && !ret; j++) {
+                r1 = &si->refs[f->first_ref + j];
+                if (r1->kind == SYM_CALL && r1->func == (unsigned int)index + 1)
+                    ret = symindex_output(si, symdir, &out, r1,
+                                          si->pool + si->syms[r1->sym].name);
+            }
+            continue;
+        }
+        /* one match per line */
+        if (!symindex_match(op, r->kind) ||
+            ((int)r->file == last_file && (int)r->line == last_line))
+            continue;
+        last_file = r->file;
+        last_line = r->line;
+        if (key != sym) {
+            symindex_source_line(si, symdir, &out, r->file, r->line,
+                                 text, sizeof(text));
+            if (!strstr(text, sym))
+                continue;
+        }
+        func = r->func ? si->pool + si->syms[r->func - 1].name : "<global>";
+        ret = symindex_output(si, symdir, &out, r, func);
+    }
+
+ done:
+    free(out.data);
+    if (ret) {
+        free(out.buf);
+        return -1;
+    }
+    *response = out.buf;
+    *len = out.len;
+    return 0;
+}
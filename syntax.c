@@ -0,0 +1,319 @@
+/*
+ * Table driven colorizer for QEmacs.
+ * Copyright (c) 2020 Himanshu Chauhan
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "qe.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Return the first char of [p, end) equal to 'c1' or 'c2', or 'end'
+   if none. The colorizers use it to skip comment and string bodies. */
+unsigned int *umemchr2(const unsigned int *p, const unsigned int *end,
+                       unsigned int c1, unsigned int c2)
+{
+#ifdef __SSE2__
+    __m128i v1, v2, v;
+    int mask;
+
+    /* compare four chars at a time */
+    v1 = _mm_set1_epi32(c1);
+    v2 = _mm_set1_epi32(c2);
+    while (end - p >= 4) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi32(v, v1),
+                                              _mm_cmpeq_epi32(v, v2)));
+        if (mask)
+            return (unsigned int *)p + (__builtin_ctz(mask) >> 2);
+        p += 4;
+    }
+#endif
+    for(; p < end; p++) {
+        if (*p == c1 || *p == c2)
+            break;
+    }
+    return (unsigned int *)p;
+}
+
+/* colorization states: the string delimiter index or the nesting
+   level of the disabled block is stored in the upper bits */
+enum {
+    SYNTAX_COMMENT = 1,
+    SYNTAX_STRING,
+    SYNTAX_PREPROCESS,
+    SYNTAX_IF0,
+};
+
+#define SYNTAX_STATE_MASK   0xff
+#define SYNTAX_DELIM_SHIFT  8
+
+static int syntax_match(const unsigned int *p, const unsigned int *end,
+                        const char *str)
+{
+    while (*str) {
+        if (p >= end || *p != (unsigned char)*str)
+            return 0;
+        p++;
+        str++;
+    }
+    return 1;
+}
+
+static inline int syntax_is_ident(unsigned int c, int first)
+{
+    return (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z') ||
+        (c == '_') ||
+        (!first && c >= '0' && c <= '9');
+}
+
+/* return the position of 'c' in the string delimiters 'delims', or
+   NULL */
+static inline const char *syntax_find_delim(const char *delims,
+                                            unsigned int c)
+{
+    for(; *delims; delims++) {
+        if ((unsigned char)*delims == c)
+            return delims;
+    }
+    return NULL;
+}
+
+/* return the state after a line of a '#if 0' block. Only the
+   directives matching the '#if 0' end the block. */
+static int syntax_disabled_line(const SyntaxDef *syn,
+                                const unsigned int *p,
+                                const unsigned int *end, int state)
+{
+    int level;
+
+    level = state >> SYNTAX_DELIM_SHIFT;
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (p < end && *p == (unsigned int)syn->preprocessor_char) {
+        p++;
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (syntax_match(p, end, "if")) {
+            /* nested #if, #ifdef or #ifndef */
+            level++;
+        } else if (syntax_match(p, end, "endif")) {
+            level--;
+        } else if (level == 0 && (syntax_match(p, end, "else") ||
+                                  syntax_match(p, end, "elif"))) {
+            level = -1;
+        }
+    }
+    if (level < 0)
+        return 0;
+    return SYNTAX_IF0 | (level << SYNTAX_DELIM_SHIFT);
+}
+
+/* set the styles of the tokens of a line according to the syntax
+   'syn' */
+void syntax_tokenize_line(const SyntaxDef *syn,
+                          unsigned int *buf, int len,
+                          int *colorize_state_ptr, int state_only)
+{
+    unsigned int *p, *p_start, *p1, *end;
+    unsigned int c, delim, escape;
+    const char *q;
+    int state, style, decl;
+
+    state = *colorize_state_ptr;
+    p = buf;
+    p_start = p;
+    end = buf + len;
+    escape = syn->escape_char;
+    delim = 0;
+    decl = 0;
+
+    /* if already in a state, go directly in the code parsing it */
+    switch(state & SYNTAX_STATE_MASK) {
+    case SYNTAX_COMMENT:
+        goto parse_comment;
+    case SYNTAX_STRING:
+        delim = (unsigned char)syn->string_delims[state >> SYNTAX_DELIM_SHIFT];
+        goto parse_string;
+    case SYNTAX_PREPROCESS:
+        goto parse_preprocessor;
+    case SYNTAX_IF0:
+        /* the whole line is disabled */
+        *colorize_state_ptr = syntax_disabled_line(syn, buf, end, state);
+        if (!state_only)
+            set_color(buf, len, QE_STYLE_COMMENT);
+        return;
+    default:
+        break;
+    }
+
+    while (p < end) {
+        p_start = p;
+        c = *p;
+        if (c == ' ' || c == '\t') {
+            p++;
+            continue;
+        }
+        if (syntax_is_ident(c, 1)) {
+            do {
+                p++;
+            } while (p < end && syntax_is_ident(*p, 0));
+            if (state_only)
+                continue;
+            p1 = p;
+            if (syn->keywords &&
+                keyword_find(syn->keywords, p_start, p1 - p_start)) {
+                style = QE_STYLE_KEYWORD;
+            } else if (syn->types &&
+                       keyword_find(syn->types, p_start, p1 - p_start)) {
+                style = QE_STYLE_TYPE;
+                /* if not a cast, assume a declaration */
+                while (p1 < end && (*p1 == ' ' || *p1 == '\t'))
+                    p1++;
+                if (p1 >= end || *p1 != ')')
+                    decl = 1;
+            } else if (syn->flags & (SYNTAX_IDENTIFIERS |
+                                     SYNTAX_DECLARATIONS)) {
+                /* assume a declaration if starting at the first column */
+                if (p_start == buf)
+                    decl = 1;
+                if (!decl && !(syn->flags & SYNTAX_IDENTIFIERS))
+                    continue;
+                while (p1 < end && (*p1 == ' ' || *p1 == '\t'))
+                    p1++;
+                if (p1 < end && *p1 == '(') {
+                    /* function definition or call */
+                    style = QE_STYLE_FUNCTION;
+                } else if (p_start == buf) {
+                    /* assume type if first column */
+                    style = QE_STYLE_TYPE;
+                } else {
+                    style = QE_STYLE_VARIABLE;
+                }
+            } else {
+                continue;
+            }
+            set_color(p_start, p - p_start, style);
+            continue;
+        }
+        if (syn->line_comment && syntax_match(p, end, syn->line_comment)) {
+            p = end;
+            if (!state_only)
+                set_color(p_start, p - p_start, QE_STYLE_COMMENT);
+            break;
+        }
+        if (syn->comment_start &&
+            syntax_match(p, end, syn->comment_start)) {
+            p += strlen(syn->comment_start);
+            state = SYNTAX_COMMENT;
+        parse_comment:
+            for(;;) {
+                c = (unsigned char)syn->comment_end[0];
+                p = umemchr2(p, end, c, c);
+                if (p >= end)
+                    break;
+                if (syntax_match(p, end, syn->comment_end)) {
+                    p += strlen(syn->comment_end);
+                    state = 0;
+                    break;
+                }
+                p++;
+            }
+            if (!state_only)
+                set_color(p_start, p - p_start, QE_STYLE_COMMENT);
+            continue;
+        }
+        if (syn->string_delims &&
+            (q = syntax_find_delim(syn->string_delims, c)) != NULL) {
+            state = SYNTAX_STRING |
+                ((q - syn->string_delims) << SYNTAX_DELIM_SHIFT);
+            delim = c;
+            p++;
+        parse_string:
+            for(;;) {
+                p = umemchr2(p, end, delim, escape ? escape : delim);
+                if (p >= end)
+                    break;
+                p++;
+                if (p[-1] == delim) {
+                    state = 0;
+                    break;
+                }
+                /* escaped char */
+                if (p >= end)
+                    break;
+                p++;
+            }
+            if (!state_only)
+                set_color(p_start, p - p_start, QE_STYLE_STRING);
+            continue;
+        }
+        if (c == syn->preprocessor_char && c != 0) {
+            /* only first non blank char of the line */
+            for(p1 = buf; p1 < p && (*p1 == ' ' || *p1 == '\t'); p1++)
+                continue;
+            if (p1 == p) {
+                if ((syn->flags & SYNTAX_DISABLED) &&
+                    syntax_match(p + 1, end, "if 0")) {
+                    state = SYNTAX_IF0;
+                    p = end;
+                    if (!state_only)
+                        set_color(p_start, p - p_start, QE_STYLE_COMMENT);
+                    break;
+                }
+            parse_preprocessor:
+                p = end;
+                if (!state_only)
+                    set_color(p_start, p - p_start, QE_STYLE_PREPROCESS);
+                if (p > buf && (p[-1] & CHAR_MASK) == '\\')
+                    state = SYNTAX_PREPROCESS;
+                else
+                    state = 0;
+                break;
+            }
+        }
+        /* an initializer ends the declaration */
+        if (c == '=')
+            decl = 0;
+        p++;
+    }
+
+    *colorize_state_ptr = state;
+}
+
+/* highlight the part of the line that oversteps the margin */
+void highlight_over_margin(unsigned int *buf, int len)
+{
+    if (g_highlight_over_margin && len > g_margin_size) {
+        /* clear previous from margin to the end of line */
+        clear_color(buf + g_margin_size, len - g_margin_size);
+        set_color(buf + g_margin_size, len - g_margin_size,
+                  QE_STYLE_MARGIN_HIGHLIGHT);
+    }
+}
+
+/* colorize a line according to the syntax 'syn'. Used as the body of
+   the ColorizeFunc of the modes */
+void syntax_colorize_line(const SyntaxDef *syn,
+                          unsigned int *buf, int len,
+                          int *colorize_state_ptr, int state_only)
+{
+    syntax_tokenize_line(syn, buf, len, colorize_state_ptr, state_only);
+    if (!state_only)
+        highlight_over_margin(buf, len);
+}
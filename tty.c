@@ -44,6 +44,13 @@ enum InputState {
     IS_ESC2,
 };
 
+/* size of the input ring buffer (must be a power of two) */
+#define TTY_INPUT_SIZE 4096
+
+/* bracketed paste markers */
+#define TTY_PASTE_START 200
+#define TTY_PASTE_END   "\033[201~"
+
 typedef struct TTYState {
     TTYChar *old_screen;
     TTYChar *screen;
@@ -56,6 +63,13 @@ typedef struct TTYState {
     int utf8_state;
     int utf8_index;
     unsigned char buf[10];
+    /* input ring buffer: bytes read but not yet decoded */
+    unsigned char input_buf[TTY_INPUT_SIZE];
+    unsigned int input_head, input_tail;
+    /* bracketed paste: the pasted bytes are sent as a single event */
+    int in_paste;
+    unsigned char *paste_buf;
+    int paste_len, paste_size;
 } TTYState;
 
 static void tty_resize(int sig);
@@ -73,7 +87,7 @@ static int term_probe(void)
 static QEDisplay tty_dpy;
 
 
-#define MAX_WH 500
+#define MAX_WH 9999
 
 /* return (0,0) if error */
 static void get_cursor_pos(int *pw, int *ph)
@@ -200,12 +214,22 @@ static int term_init(QEditScreen *s, int w, int h)
     set_read_handler(0, tty_read_handler, s);
 
     tty_resize(-1);
+
+    /* enable bracketed paste */
+    printf("\033[?2004h");
+    fflush(stdout);
     return 0;
 }
 
 static void term_close(QEditScreen *s)
 {
+    TTYState *ts = s->private;
+
     fcntl(0, F_SETFL, 0);
+    /* disable bracketed paste */
+    printf("\033[?2004l");
+    free(ts->paste_buf);
+    ts->paste_buf = NULL;
     /* go to the last line */
     printf("\033[%d;%dH\033[m\033[K", s->height, 1);
     fflush(stdout);
@@ -223,18 +247,17 @@ static void tty_resize(int sig)
 {
     QEditScreen *s = tty_screen;
     TTYState *ts = s->private;
+    struct winsize ws;
     int size;
 
-    if (sig == -1) {
+    if (ioctl(0, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+        s->width = ws.ws_col;
+        s->height = ws.ws_row;
+    } else if (sig == -1) {
         tty_get_screen_size(&s->width, &s->height);
     } else {
-        struct winsize ws;
         s->width = 80;
         s->height = 24;
-        if (ioctl(0, TIOCGWINSZ, &ws) == 0) {
-            s->width = ws.ws_col;
-            s->height = ws.ws_row;
-        }
     }
     
     size = s->width * s->height * sizeof(TTYChar);
@@ -261,9 +284,14 @@ static void term_cursor_at(QEditScreen *s, int x1, int y1, int w, int h)
 
 static int term_is_user_input_pending(QEditScreen *s)
 {
+    TTYState *ts = s->private;
     fd_set rfds;
     struct timeval tv;
-    
+
+    /* bytes already read but not yet decoded */
+    if (ts->input_head != ts->input_tail)
+        return 1;
+
     tv.tv_sec = 0;
     tv.tv_usec = 0;
     FD_ZERO(&rfds);
@@ -274,29 +302,90 @@ static int term_is_user_input_pending(QEditScreen *s)
         return 0;
 }
 
-static void tty_read_handler(void *opaque)
+/* add a byte to the paste buffer. Return true if the end of paste
+   marker was found (it is then removed from the buffer) */
+static int tty_paste_add(TTYState *ts, int c)
+{
+    static const char paste_end[] = TTY_PASTE_END;
+    int n = sizeof(paste_end) - 1;
+    int size;
+    unsigned char *ptr;
+
+    if (ts->paste_len >= ts->paste_size) {
+        size = max(ts->paste_size * 2, TTY_INPUT_SIZE);
+        ptr = realloc(ts->paste_buf, size);
+        if (ptr) {
+            ts->paste_buf = ptr;
+            ts->paste_size = size;
+        } else if (ts->paste_len >= n) {
+            /* drop the data, but still detect the end of paste */
+            memmove(ts->paste_buf, ts->paste_buf + ts->paste_len - n, n);
+            ts->paste_len = n;
+        } else {
+            /* give up: the following bytes are handled as keys */
+            ts->in_paste = 0;
+            return 0;
+        }
+    }
+    ts->paste_buf[ts->paste_len++] = c;
+    if (c == '~' && ts->paste_len >= n &&
+        !memcmp(ts->paste_buf + ts->paste_len - n, paste_end, n)) {
+        ts->paste_len -= n;
+        return 1;
+    }
+    return 0;
+}
+
+static void tty_paste_end(QEditScreen *s)
+{
+    TTYState *ts = s->private;
+    QEEvent ev1, *ev = &ev1;
+
+    ts->in_paste = 0;
+    /* the removed end marker leaves room to terminate the data so that
+       a truncated multibyte char cannot be decoded past the end */
+    memset(ts->paste_buf + ts->paste_len, 0, sizeof(TTY_PASTE_END) - 1);
+    ev->paste_event.type = QE_PASTE_EVENT;
+    ev->paste_event.data = ts->paste_buf;
+    ev->paste_event.len = ts->paste_len;
+    qe_handle_event(ev);
+    ts->paste_len = 0;
+    /* do not keep a big paste buffer */
+    if (ts->paste_size > TTY_INPUT_SIZE * 16) {
+        free(ts->paste_buf);
+        ts->paste_buf = NULL;
+        ts->paste_size = 0;
+    }
+}
+
+/* decode one input byte */
+static void tty_input_byte(QEditScreen *s, int c)
 {
-    QEditScreen *s = opaque;
     TTYState *ts = s->private;
     int ch;
     QEEvent ev1, *ev = &ev1;
 
-    if (read(0, ts->buf + ts->utf8_index, 1) != 1)
+    if (ts->in_paste) {
+        if (tty_paste_add(ts, c))
+            tty_paste_end(s);
         return;
+    }
 
     /* charset handling */
     if (s->charset == &charset_utf8) {
-        if (ts->utf8_state == 0) {
+        ts->buf[ts->utf8_index++] = c;
+        if (ts->utf8_index == 1)
+            ts->utf8_state = utf8_length[c];
+        if (ts->utf8_index < ts->utf8_state)
+            return;
+        {
             const char *p;
             p = (const char *)ts->buf;
             ch = utf8_decode(&p);
-        } else {
-            ts->utf8_state = utf8_length[ts->buf[0]] - 1;
-            ts->utf8_index = 0;
-            return;
         }
+        ts->utf8_index = 0;
     } else {
-        ch = ts->buf[0];
+        ch = c;
     }
         
     switch(ts->input_state) {
@@ -323,6 +412,11 @@ static void tty_read_handler(void *opaque)
             ts->input_state = IS_NORM;
             switch(ch) {
             case '~':
+                if (ts->input_param == TTY_PASTE_START) {
+                    ts->in_paste = 1;
+                    ts->paste_len = 0;
+                    break;
+                }
                 ch = KEY_ESC1(ts->input_param);
                 goto the_end;
             case 'H':
@@ -359,6 +453,34 @@ static void tty_read_handler(void *opaque)
     }
 }
 
+/* read all the available input in the ring buffer, then decode it */
+static void tty_read_handler(void *opaque)
+{
+    QEditScreen *s = opaque;
+    TTYState *ts = s->private;
+    int len, index, size;
+
+    for(;;) {
+        /* fill the free contiguous part of the ring buffer */
+        index = ts->input_head & (TTY_INPUT_SIZE - 1);
+        size = TTY_INPUT_SIZE - (ts->input_head - ts->input_tail);
+        if (size > TTY_INPUT_SIZE - index)
+            size = TTY_INPUT_SIZE - index;
+        len = read(0, ts->input_buf + index, size);
+        if (len > 0)
+            ts->input_head += len;
+
+        while (ts->input_tail != ts->input_head) {
+            index = ts->input_tail & (TTY_INPUT_SIZE - 1);
+            ts->input_tail++;
+            tty_input_byte(s, ts->input_buf[index]);
+        }
+        /* stop if no more input is immediately available */
+        if (len < size)
+            break;
+    }
+}
+
 static inline int color_dist(unsigned int c1, unsigned c2)
 {
 
@@ -453,27 +575,24 @@ static void term_close_font(QEditScreen *s, QEFont *font)
 }
 
 /*
- * Modified implementation of wcwidth() from Markus Kuhn. We do not
- * handle non spacing and enclosing combining characters and control
- * chars.  
+ * Glyph width: we do not handle non spacing and enclosing combining
+ * characters and control chars. The double width chars are found in
+ * a two level bit table generated from the Unicode East Asian Width
+ * data (see wcwidthgen.c).
  */
 
-static int term_glyph_width(QEditScreen *s, unsigned int ucs)
+#include "wcwidth.h"
+
+static inline int term_glyph_width(QEditScreen *s, unsigned int ucs)
 {
-  /* fast test for majority of non-wide scripts */
-  if (ucs < 0x900)
-    return 1;
+    const unsigned int *block;
+
+    /* fast test for ASCII and the majority of non-wide scripts */
+    if (ucs < 0x1100 || ucs >= GLYPH_WIDTH_MAX_CHAR)
+        return 1;
 
-  return 1 +
-    ((ucs >= 0x1100 && ucs <= 0x115f) || /* Hangul Jamo */
-     (ucs >= 0x2e80 && ucs <= 0xa4cf && (ucs & ~0x0011) != 0x300a &&
-      ucs != 0x303f) ||                  /* CJK ... Yi */
-     (ucs >= 0xac00 && ucs <= 0xd7a3) || /* Hangul Syllables */
-     (ucs >= 0xf900 && ucs <= 0xfaff) || /* CJK Compatibility Ideographs */
-     (ucs >= 0xfe30 && ucs <= 0xfe6f) || /* CJK Compatibility Forms */
-     (ucs >= 0xff00 && ucs <= 0xff5f) || /* Fullwidth Forms */
-     (ucs >= 0xffe0 && ucs <= 0xffe6)
-     );
+    block = glyph_width_blocks[glyph_width_index[ucs >> 8]];
+    return 1 + ((block[(ucs >> 5) & 7] >> (ucs & 31)) & 1);
 }
 
 static void term_text_metrics(QEditScreen *s, QEFont *font, 
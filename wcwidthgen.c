@@ -0,0 +1,146 @@
+/*
+ * Glyph width table generator for QEmacs
+ * Copyright (c) 2020 Himanshu Chauhan
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * Read the Unicode EastAsianWidth.txt file and output a two level
+ * table giving the double width (W and F) chars: the first level is
+ * indexed by the code point divided by 256 and gives a block of 256
+ * bits. Identical blocks are shared.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* only the first four planes contain wide chars */
+#define MAX_CHAR    0x40000
+#define BLOCK_BITS  8
+#define BLOCK_SIZE  (1 << BLOCK_BITS)
+#define BLOCK_WORDS (BLOCK_SIZE / 32)
+#define NB_BLOCKS   (MAX_CHAR / BLOCK_SIZE)
+
+static unsigned int bits[NB_BLOCKS][BLOCK_WORDS];
+static int block_index[NB_BLOCKS];
+static int nb_unique_blocks;
+
+static void set_wide(unsigned int c1, unsigned int c2)
+{
+    unsigned int c;
+
+    if (c2 >= MAX_CHAR)
+        c2 = MAX_CHAR - 1;
+    for (c = c1; c <= c2; c++)
+        bits[c >> BLOCK_BITS][(c >> 5) & (BLOCK_WORDS - 1)] |= 1U << (c & 31);
+}
+
+static int parse_file(FILE *f)
+{
+    char line[1024], prop[16], *p;
+    unsigned int c1, c2;
+    int line_num;
+
+    line_num = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_num++;
+        p = strchr(line, '#');
+        if (p)
+            *p = '\0';
+        p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0' || *p == '\n')
+            continue;
+        /* the upstream file pads the code points with spaces before
+           the ';' since Unicode 15.1 */
+        if (sscanf(p, "%x..%x ;%15s", &c1, &c2, prop) != 3) {
+            if (sscanf(p, "%x ;%15s", &c1, prop) != 2) {
+                fprintf(stderr, "line %d: syntax error\n", line_num);
+                return -1;
+            }
+            c2 = c1;
+        }
+        if (c2 < c1 || c1 >= MAX_CHAR)
+            continue;
+        if (!strcmp(prop, "W") || !strcmp(prop, "F"))
+            set_wide(c1, c2);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *f;
+    int i, j, k;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: wcwidthgen EastAsianWidth.txt\n");
+        exit(1);
+    }
+    f = fopen(argv[1], "r");
+    if (!f) {
+        perror(argv[1]);
+        exit(1);
+    }
+    if (parse_file(f) < 0)
+        exit(1);
+    fclose(f);
+
+    printf("/* This file was generated by wcwidthgen from %s */\n\n",
+           argv[1]);
+    printf("#define GLYPH_WIDTH_MAX_CHAR 0x%x\n\n", MAX_CHAR);
+
+    /* share identical blocks */
+    for (i = 0; i < NB_BLOCKS; i++) {
+        for (j = 0; j < i; j++) {
+            if (!memcmp(bits[j], bits[i], sizeof(bits[0])))
+                break;
+        }
+        if (j < i) {
+            block_index[i] = block_index[j];
+        } else {
+            block_index[i] = nb_unique_blocks++;
+        }
+    }
+    if (nb_unique_blocks > 256) {
+        fprintf(stderr, "too many blocks (%d)\n", nb_unique_blocks);
+        exit(1);
+    }
+
+    printf("static const unsigned char glyph_width_index[%d] = {",
+           NB_BLOCKS);
+    for (i = 0; i < NB_BLOCKS; i++) {
+        if ((i % 16) == 0)
+            printf("\n   ");
+        printf(" %d,", block_index[i]);
+    }
+    printf("\n};\n\n");
+
+    printf("static const unsigned int glyph_width_blocks[%d][%d] = {\n",
+           nb_unique_blocks, BLOCK_WORDS);
+    k = 0;
+    for (i = 0; i < NB_BLOCKS; i++) {
+        if (block_index[i] != k)
+            continue;
+        printf("    {");
+        for (j = 0; j < BLOCK_WORDS; j++)
+            printf(" 0x%08x,", bits[i][j]);
+        printf(" },\n");
+        k++;
+    }
+    printf("};\n");
+    return 0;
+}